@@ -0,0 +1,3 @@
+void ngx_http_zip_crc32_init(void);
+void ngx_http_zip_crc32_update(uint32_t *crc, u_char *p, size_t len);
+uint32_t ngx_http_zip_crc32_combine(uint32_t crc1, uint32_t crc2, off_t len2);
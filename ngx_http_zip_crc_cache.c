@@ -0,0 +1,223 @@
+/*
+ * zip_crc_cache: the CRC-32s computed for files listed without one, so that
+ * the next archives with them have them up front. An entry is found by the
+ * location, the size and the offset of a slice, and holds the ETag or else
+ * the Last-Modified of the response it was computed from: when the location
+ * answers with another, the file changed and the archive is aborted.
+ */
+
+#include "ngx_http_zip_module.h"
+#include "ngx_http_zip_crc_cache.h"
+
+static ngx_int_t
+ngx_http_zip_crc_cache_key(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
+        ngx_http_zip_file_t *file, ngx_str_t *key)
+{
+    size_t len;
+
+    len = sizeof("+ ? ?") - 1 + 2 * NGX_OFF_T_LEN
+        + ctx->uri_template.len + ctx->args_template.len
+        + file->uri.len + file->args.len;
+
+    if ((key->data = ngx_pnalloc(r->pool, len)) == NULL) {
+        return NGX_ERROR;
+    }
+
+    key->len = ngx_sprintf(key->data, "%O+%O %V?%V %V?%V",
+            file->source_offset, file->size,
+            &ctx->uri_template, &ctx->args_template, &file->uri, &file->args)
+        - key->data;
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_zip_crc_cache_delete(ngx_http_zip_crc_cache_t *cache,
+        ngx_http_zip_crc_cache_node_t *node)
+{
+    ngx_queue_remove(&node->queue);
+    ngx_rbtree_delete(&cache->sh->rbtree, &node->sn.node);
+    ngx_slab_free_locked(cache->shpool, node);
+}
+
+ngx_int_t
+ngx_http_zip_crc_cache_lookup(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
+        ngx_http_zip_crc_cache_t *cache, ngx_http_zip_file_t *file)
+{
+    ngx_http_zip_crc_cache_node_t  *node;
+    ngx_int_t                       rc = NGX_DECLINED;
+    ngx_str_t                       key;
+    uint32_t                        hash;
+
+    if (ngx_http_zip_crc_cache_key(r, ctx, file, &key) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    hash = ngx_crc32_short(key.data, key.len);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    node = (ngx_http_zip_crc_cache_node_t *)
+        ngx_str_rbtree_lookup(&cache->sh->rbtree, &key, hash);
+
+    if (node) {
+        file->validator.len = node->validator.len;
+        file->validator.data = ngx_pnalloc(r->pool, node->validator.len);
+
+        if (file->validator.data == NULL) {
+            rc = NGX_ERROR;
+
+        } else {
+            ngx_memcpy(file->validator.data, node->validator.data, node->validator.len);
+            file->crc32 = node->crc32;
+
+            ngx_queue_remove(&node->queue);
+            ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+
+            rc = NGX_OK;
+        }
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return rc;
+}
+
+/* The oldest entries make room for a new one */
+ngx_int_t
+ngx_http_zip_crc_cache_store(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
+        ngx_http_zip_crc_cache_t *cache, ngx_http_zip_file_t *file,
+        ngx_str_t *validator)
+{
+    ngx_http_zip_crc_cache_node_t  *node;
+    ngx_str_t                       key;
+    uint32_t                        hash;
+    size_t                          size;
+
+    if (ngx_http_zip_crc_cache_key(r, ctx, file, &key) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    hash = ngx_crc32_short(key.data, key.len);
+    size = offsetof(ngx_http_zip_crc_cache_node_t, data) + key.len + validator->len;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    node = (ngx_http_zip_crc_cache_node_t *)
+        ngx_str_rbtree_lookup(&cache->sh->rbtree, &key, hash);
+
+    if (node) {
+        ngx_http_zip_crc_cache_delete(cache, node);
+    }
+
+    while ((node = ngx_slab_alloc_locked(cache->shpool, size)) == NULL
+            && !ngx_queue_empty(&cache->sh->queue)) {
+        ngx_http_zip_crc_cache_delete(cache, ngx_queue_data(
+                    ngx_queue_last(&cache->sh->queue), ngx_http_zip_crc_cache_node_t, queue));
+    }
+
+    if (node) {
+        node->sn.node.key = hash;
+        node->sn.str.len = key.len;
+        node->sn.str.data = node->data;
+        ngx_memcpy(node->data, key.data, key.len);
+
+        node->validator.len = validator->len;
+        node->validator.data = node->data + key.len;
+        ngx_memcpy(node->validator.data, validator->data, validator->len);
+
+        node->crc32 = file->crc32;
+
+        ngx_rbtree_insert(&cache->sh->rbtree, &node->sn.node);
+        ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return NGX_OK;
+}
+
+ngx_int_t
+ngx_http_zip_crc_cache_forget(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
+        ngx_http_zip_crc_cache_t *cache, ngx_http_zip_file_t *file)
+{
+    ngx_http_zip_crc_cache_node_t  *node;
+    ngx_str_t                       key;
+    uint32_t                        hash;
+
+    if (ngx_http_zip_crc_cache_key(r, ctx, file, &key) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    hash = ngx_crc32_short(key.data, key.len);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    node = (ngx_http_zip_crc_cache_node_t *)
+        ngx_str_rbtree_lookup(&cache->sh->rbtree, &key, hash);
+
+    if (node) {
+        ngx_http_zip_crc_cache_delete(cache, node);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return NGX_OK;
+}
+
+/* The ETag of a response, or else its Last-Modified; empty with neither */
+void
+ngx_http_zip_crc_cache_validator(ngx_http_request_t *r, ngx_str_t *validator)
+{
+    if (r->headers_out.etag) {
+        *validator = r->headers_out.etag->value;
+
+    } else if (r->headers_out.last_modified) {
+        *validator = r->headers_out.last_modified->value;
+
+    } else if (r->headers_out.last_modified_time != -1
+            && (validator->data = ngx_pnalloc(r->pool,
+                    sizeof("Mon, 28 Sep 1970 06:00:00 GMT") - 1)) != NULL) {
+        validator->len = ngx_http_time(validator->data,
+                r->headers_out.last_modified_time) - validator->data;
+
+    } else {
+        ngx_str_null(validator);
+    }
+}
+
+ngx_int_t
+ngx_http_zip_init_crc_cache(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_zip_crc_cache_t  *ocache = data;
+    ngx_http_zip_crc_cache_t  *cache = shm_zone->data;
+
+    if (ocache) {
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+        return NGX_OK;
+    }
+
+    cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->sh = cache->shpool->data;
+        return NGX_OK;
+    }
+
+    cache->sh = ngx_slab_alloc(cache->shpool, sizeof(ngx_http_zip_crc_cache_sh_t));
+    if (cache->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->shpool->data = cache->sh;
+
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                    ngx_str_rbtree_insert_value);
+    ngx_queue_init(&cache->sh->queue);
+
+    // a full cache is not worth a log line per entry
+    cache->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
@@ -0,0 +1,9 @@
+ngx_int_t ngx_http_zip_crc_cache_lookup(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
+        ngx_http_zip_crc_cache_t *cache, ngx_http_zip_file_t *file);
+ngx_int_t ngx_http_zip_crc_cache_store(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
+        ngx_http_zip_crc_cache_t *cache, ngx_http_zip_file_t *file,
+        ngx_str_t *validator);
+ngx_int_t ngx_http_zip_crc_cache_forget(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
+        ngx_http_zip_crc_cache_t *cache, ngx_http_zip_file_t *file);
+void ngx_http_zip_crc_cache_validator(ngx_http_request_t *r, ngx_str_t *validator);
+ngx_int_t ngx_http_zip_init_crc_cache(ngx_shm_zone_t *shm_zone, void *data);
@@ -4,6 +4,8 @@
 #include "ngx_http_zip_file_format.h"
 #include "ngx_http_zip_endian.h"
 #include "ngx_http_zip_headers.h"
+#include "ngx_http_zip_crc32.h"
+#include "ngx_http_zip_crc_cache.h"
 
 #ifdef NGX_ZIP_HAVE_ICONV
 #include <iconv.h>
@@ -14,6 +16,7 @@ static ngx_str_t ngx_http_zip_header_charset_name = ngx_string("upstream_http_x_
 #endif
 static ngx_str_t ngx_http_zip_header_name_separator = ngx_string("upstream_http_x_archive_name_sep");
 static ngx_str_t ngx_http_zip_header_name_pass_headers = ngx_string("upstream_http_x_archive_pass_headers");
+static ngx_str_t ngx_http_zip_header_name_uri_template = ngx_string("upstream_http_x_archive_uri_template");
 
 #define NGX_MAX_UINT16_VALUE 0xffff
 
@@ -194,24 +197,38 @@ ngx_http_zip_strnrstr(const char * str, ngx_uint_t n,
 #define ICONV_CSNMAXLEN 64
 #endif
 
-// make our proposed ZIP-file chunk map
-ngx_int_t
-ngx_http_zip_generate_pieces(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx)
+#ifdef NGX_ZIP_HAVE_ICONV
+static void
+ngx_http_zip_iconv_cleanup(void *data)
+{
+    ngx_http_zip_ctx_t *ctx = data;
+
+    if (ctx->iconv_cd) {
+        iconv_close(ctx->iconv_cd);
+    }
+}
+#endif
+
+// read the upstream headers the pieces depend on
+static ngx_int_t
+ngx_http_zip_init_pieces(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx)
 {
-    ngx_uint_t i, piece_i;
-    off_t offset = 0;
-    time_t unix_time = 0;
-    ngx_uint_t dos_time = 0;
-    ngx_http_zip_file_t  *file;
-    ngx_http_zip_piece_t *header_piece, *file_piece, *trailer_piece, *cd_piece;
     ngx_http_variable_value_t  *vv;
+#ifdef NGX_ZIP_HAVE_ICONV
+    ngx_pool_cleanup_t         *cln;
+#endif
 
     if ((vv = ngx_palloc(r->pool, sizeof(ngx_http_variable_value_t))) == NULL)
         return NGX_ERROR;
 
     ctx->unicode_path = 0;
 #ifdef NGX_ZIP_HAVE_ICONV
-    iconv_t *iconv_cd = NULL;
+    if ((cln = ngx_pool_cleanup_add(r->pool, 0)) == NULL)
+        return NGX_ERROR;
+
+    ctx->iconv_cd = NULL;
+    cln->handler = ngx_http_zip_iconv_cleanup;
+    cln->data = ctx;
 #endif
 
     // Let's try to find special header that contains separator string.
@@ -261,8 +278,11 @@ ngx_http_zip_generate_pieces(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx)
 
     if (variable_header_status == NGX_OK && !vv->not_found) {
         ctx->native_charset = 1;
-        if(vv->len)
+        if(vv->len) {
             ctx->unicode_path = 1;
+            ctx->name_sep.data = vv->data;
+            ctx->name_sep.len = vv->len;
+        }
     } else {
 #ifdef NGX_ZIP_HAVE_ICONV
         variable_header_status = NGX_OK;
@@ -279,12 +299,12 @@ ngx_http_zip_generate_pieces(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx)
                 char encoding[ICONV_CSNMAXLEN];
                 snprintf(encoding, sizeof(encoding), "%s//TRANSLIT//IGNORE", vv->data);
 
-                iconv_cd = iconv_open((const char *)encoding, "utf-8");
-                if (iconv_cd == (iconv_t)(-1)) {
+                ctx->iconv_cd = iconv_open((const char *)encoding, "utf-8");
+                if (ctx->iconv_cd == (iconv_t)(-1)) {
                     ngx_log_error(NGX_LOG_WARN, r->connection->log, errno,
                                   "mod_zip: iconv_open('%s', 'utf-8') failed",
                                   vv->data);
-                    iconv_cd = NULL;
+                    ctx->iconv_cd = NULL;
                 }
                 else
                 {
@@ -298,25 +318,227 @@ ngx_http_zip_generate_pieces(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx)
 #endif
     }
 
+    // Collect names of original request's header fields that
+    // have to be present in each of the issued sub-requests.
+    variable_header_status = ngx_http_zip_variable_unknown_header(r, vv, &ngx_http_zip_header_name_pass_headers,
+            &r->upstream->headers_in.headers.part, sizeof("upstream_http_")-1);
+
+    if (variable_header_status == NGX_OK && !vv->not_found) {
+        ngx_str_t *header;
+        ngx_int_t len;
+        u_char    *next;
+        u_char    *start = vv->data;
+        u_char    *end = vv->data + vv->len;
+
+        // Split the list of names by ':'.
+        while (start < end) {
+            next = ngx_strnstr(start, ":", end - start);
+
+            if (next == NULL) {
+                next = end;
+            }
+
+            len = next - start;
+
+            if (len) {
+                if ((header = ngx_array_push(&ctx->pass_srq_headers)) == NULL) {
+                    return NGX_ERROR;
+                }
+
+                if ((header->data = ngx_pnalloc(r->pool, len)) == NULL) {
+                      return NGX_ERROR;
+                }
+
+                ngx_memcpy(header->data, start, len);
+                header->len = len;
+            }
+
+            start = next + 1;
+        }
+    }
+
+    // The locations in the list may be IDs, fetched from the template
+    // location they are put in, see ngx_http_zip_expand_template().
+    variable_header_status = NGX_OK;
+    if (r->upstream) {
+        variable_header_status = ngx_http_zip_variable_unknown_header(r, vv, &ngx_http_zip_header_name_uri_template,
+                &r->upstream->headers_in.headers.part, sizeof("upstream_http_")-1);
+    } else {
+        vv->not_found = 1;
+    }
+
+    if (variable_header_status == NGX_OK && !vv->not_found && vv->len) {
+        u_char *q;
+
+        ctx->uri_template.data = vv->data;
+        ctx->uri_template.len = vv->len;
+
+        if (ngx_strnstr(vv->data, "{id}", vv->len) == NULL) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "mod_zip: no \"{id}\" in X-Archive-Uri-Template \"%V\"",
+                    &ctx->uri_template);
+            return NGX_ERROR;
+        }
+
+        if ((q = ngx_strlchr(vv->data, vv->data + vv->len, '?')) != NULL) {
+            ctx->uri_template.len = q - vv->data;
+            ctx->args_template.data = q + 1;
+            ctx->args_template.len = vv->data + vv->len - q - 1;
+        }
+    }
+
+    ctx->files_part = &ctx->files.part;
+    ctx->pieces_init = 1;
+
+    return NGX_OK;
+}
+
+// the time of the entries the file list gives none
+static time_t
+ngx_http_zip_default_mtime(ngx_http_request_t *r, ngx_http_zip_loc_conf_t *zlcf)
+{
+    time_t mtime = zlcf->mtime;
+
+    if (mtime == NGX_HTTP_ZIP_MTIME_LAST_MODIFIED) {
+        mtime = r->headers_out.last_modified_time;
+        // not set from upstream unless the response is cacheable
+        if (mtime == -1 && r->headers_out.last_modified) {
+            mtime = ngx_http_parse_time(r->headers_out.last_modified->value.data,
+                    r->headers_out.last_modified->value.len);
+        }
+    }
+
+    if (mtime < NGX_HTTP_ZIP_DOS_EPOCH) {
+        mtime = time(NULL);
+    }
+
+    return mtime;
+}
+
+// make our proposed ZIP-file chunk map: for the files that are complete
+// and not mapped yet, up to the central directory once all of them are
+ngx_int_t
+ngx_http_zip_generate_pieces(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx)
+{
+    ngx_uint_t i, n, files_n, piece_i, segments_n = 0;
+    ngx_uint_t complete, missing_crc32;
+    ngx_int_t rc;
+    off_t offset, data_end, segment_size;
+    time_t unix_time = 0;
+    ngx_uint_t dos_time = 0;
+    ngx_list_part_t      *part;
+    ngx_http_zip_file_t  *file;
+    ngx_http_zip_piece_t *header_piece, *file_piece, *trailer_piece, *cd_piece;
+    ngx_http_zip_loc_conf_t  *zlcf;
+
+    if (!ctx->pieces_init && ngx_http_zip_init_pieces(r, ctx) == NGX_ERROR)
+        return NGX_ERROR;
+
+    // the last file of a list still coming in may not be complete
+    files_n = ctx->files_n - ctx->files_pieced;
+    if (!ctx->parsed && files_n)
+        files_n--;
+    complete = ctx->parsed;
+
+    // nor can the files after one whose size is still being asked for
+    if (ctx->sizes_missing) {
+        part = ctx->files_part;
+        i = ctx->files_part_i;
+        for (n = 0; n < files_n; n++, i++) {
+            if (i >= part->nelts) {
+                part = part->next;
+                i = 0;
+            }
+            if (((ngx_http_zip_file_t *)part->elts)[i].missing_size) {
+                files_n = n;
+                complete = 0;
+                break;
+            }
+        }
+    }
+
+    if (ctx->pieces_done || (files_n == 0 && !complete))
+        return NGX_DECLINED;
+
+    // Large files may be fetched as several Range subrequests in parallel.
+    // Only when their CRC-32 is known (it can't be computed out of order)
+    // and the entries are sent in order.
+    zlcf = ngx_http_get_module_loc_conf(r, ngx_http_zip_module);
+
+    // CRC-32s computed for earlier archives, see zip_crc_cache
+    if (zlcf->crc_cache && ctx->missing_crc32) {
+        missing_crc32 = 0;
+        part = ctx->files_part;
+        i = ctx->files_part_i;
+        for (n = 0; n < files_n; n++, i++) {
+            if (i >= part->nelts) {
+                part = part->next;
+                i = 0;
+            }
+            file = &((ngx_http_zip_file_t *)part->elts)[i];
+            if (file->missing_crc32 && !file->is_stream && !file->is_inline
+                    && !file->is_directory && file->size > 0) {
+                rc = ngx_http_zip_crc_cache_lookup(r, ctx, zlcf->crc_cache, file);
+                if (rc == NGX_ERROR)
+                    return NGX_ERROR;
+                if (rc == NGX_OK) {
+                    file->missing_crc32 = 0;
+                    file->crc32_cached = 1;
+                }
+            }
+            missing_crc32 |= file->missing_crc32;
+        }
+        // all of them found: the archive can be sent in parts again
+        if (complete && ctx->files_pieced == 0 && !missing_crc32)
+            ctx->missing_crc32 = 0;
+    }
+
+    if (zlcf->segment_threshold && zlcf->segments > 1 && !ctx->out_of_order) {
+        part = ctx->files_part;
+        i = ctx->files_part_i;
+        for (n = 0; n < files_n; n++, i++) {
+            if (i >= part->nelts) {
+                part = part->next;
+                i = 0;
+            }
+            file = &((ngx_http_zip_file_t *)part->elts)[i];
+            if (!file->missing_crc32 && !file->is_directory && !file->is_inline && file->size > zlcf->segment_threshold)
+                segments_n += zlcf->segments - 1;
+        }
+    }
+
     // pieces: for each file: header, data, footer (if needed) -> 2 or 3 per file
+    // (data split into segments for large files)
     // plus file footer (CD + [zip64 end + zip64 locator +] end of cd) in one chunk
-    ctx->pieces_n = ctx->files.nelts * (2 + (!!ctx->missing_crc32)) + 1;
+    ctx->pieces_n = files_n * (2 + (!!ctx->missing_crc32)) + segments_n + (!!complete);
 
     if ((ctx->pieces = ngx_palloc(r->pool, sizeof(ngx_http_zip_piece_t) * ctx->pieces_n)) == NULL)
         return NGX_ERROR;
 
-    ctx->cd_size = 0;
-    unix_time = time(NULL);
+    ctx->pieces_i = 0;
+    offset = ctx->pieces_end;
+    unix_time = ngx_http_zip_default_mtime(r, zlcf);
     dos_time = ngx_dos_time(unix_time);
-    for (piece_i = i = 0; i < ctx->files.nelts; i++) {
-        file = &((ngx_http_zip_file_t *)ctx->files.elts)[i];
+    part = ctx->files_part;
+    i = ctx->files_part_i;
+    for (piece_i = n = 0; n < files_n; n++, i++) {
+        if (i >= part->nelts) {
+            part = part->next;
+            i = 0;
+        }
+        file = &((ngx_http_zip_file_t *)part->elts)[i];
         file->offset = offset;
-        file->unix_time = unix_time;
-        file->dos_time = dos_time;
+        // from the file list, unless before DOS times begin
+        if (file->unix_time >= NGX_HTTP_ZIP_DOS_EPOCH) {
+            file->dos_time = ngx_dos_time(file->unix_time);
+        } else {
+            file->unix_time = unix_time;
+            file->dos_time = dos_time;
+        }
 
         if(ctx->unicode_path) {
 #ifdef NGX_ZIP_HAVE_ICONV
-            if (iconv_cd) {
+            if (ctx->iconv_cd) {
                 size_t inlen = file->filename.len, outlen, outleft;
                 u_char *p, *in;
 
@@ -334,10 +556,10 @@ ngx_http_zip_generate_pieces(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx)
                 p = file->filename.data;
 
                 //reset state
-                iconv(iconv_cd, NULL, NULL, NULL, NULL);
+                iconv(ctx->iconv_cd, NULL, NULL, NULL, NULL);
 
                 //convert the string
-                iconv(iconv_cd, (char **)&in, &inlen, (char **)&p, &outleft);
+                iconv(ctx->iconv_cd, (char **)&in, &inlen, (char **)&p, &outleft);
                 //XXX if (res == (size_t)-1) { ? }
 
                 file->filename.len = outlen - outleft;
@@ -346,16 +568,16 @@ ngx_http_zip_generate_pieces(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx)
             }
             else
 #endif
-              if(vv->len) {
+              if(ctx->name_sep.len) {
                 const char * sep = ngx_http_zip_strnrstr((const char*)file->filename.data, file->filename.len,
-                                                         (const char*)vv->data, vv->len);
+                                                         (const char*)ctx->name_sep.data, ctx->name_sep.len);
                 if(sep) {
-                    size_t utf8_len = file->filename.len - vv->len - (size_t)(sep - (const char *)file->filename.data);
+                    size_t utf8_len = file->filename.len - ctx->name_sep.len - (size_t)(sep - (const char *)file->filename.data);
                     file->filename_utf8.data = ngx_pnalloc(r->pool, utf8_len);
                     file->filename_utf8.len = utf8_len;
-                    ngx_memcpy(file->filename_utf8.data, sep + vv->len, utf8_len);
+                    ngx_memcpy(file->filename_utf8.data, sep + ctx->name_sep.len, utf8_len);
 
-                    file->filename.len -= utf8_len + vv->len;
+                    file->filename.len -= utf8_len + ctx->name_sep.len;
                     file->filename_utf8_crc32 = ngx_crc32_long(file->filename_utf8.data, file->filename_utf8.len);
                 } /* else { } */    // Separator not found. Okay, no extra field for this one then.
             }
@@ -363,7 +585,7 @@ ngx_http_zip_generate_pieces(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx)
 
         if(offset >= (off_t) NGX_MAX_UINT32_VALUE)
             ctx->zip64_used = file->need_zip64_offset = 1;
-        if(file->size >= (off_t) NGX_MAX_UINT32_VALUE)
+        if(file->size >= (off_t) NGX_MAX_UINT32_VALUE || file->is_stream)
             ctx->zip64_used = file->need_zip64 = 1;
 
         ctx->cd_size += sizeof(ngx_zip_central_directory_file_header_t) + file->filename.len + sizeof(ngx_zip_extra_field_central_t);
@@ -391,11 +613,23 @@ ngx_http_zip_generate_pieces(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx)
             offset += sizeof(ngx_zip_extra_field_unicode_path_t) + file->filename_utf8.len;
         header_piece->range.end = offset;
 
-        file_piece = &ctx->pieces[piece_i++];
-        file_piece->type = file->is_directory ? zip_dir_piece : zip_file_piece;
-        file_piece->file = file;
-        file_piece->range.start = offset;
-        file_piece->range.end = offset += file->size; //!note: (sizeless chunks): we need file size here / or mark it and modify ranges after
+        if (segments_n && !file->missing_crc32 && !file->is_directory && !file->is_inline && file->size > zlcf->segment_threshold) {
+            data_end = offset + file->size;
+            segment_size = (file->size + zlcf->segments - 1) / zlcf->segments;
+            while (offset < data_end) {
+                file_piece = &ctx->pieces[piece_i++];
+                file_piece->type = zip_file_piece;
+                file_piece->file = file;
+                file_piece->range.start = offset;
+                file_piece->range.end = offset = ngx_min(offset + segment_size, data_end);
+            }
+        } else {
+            file_piece = &ctx->pieces[piece_i++];
+            file_piece->type = file->is_directory ? zip_dir_piece : zip_file_piece;
+            file_piece->file = file;
+            file_piece->range.start = offset;
+            file_piece->range.end = offset += file->size; //!note: (sizeless chunks): we need file size here / or mark it and modify ranges after
+        }
 
         if (file->missing_crc32) { // if incomplete header -> add footer with that info to file
             trailer_piece = &ctx->pieces[piece_i++];
@@ -408,13 +642,42 @@ ngx_http_zip_generate_pieces(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx)
         }
     }
 
-#ifdef NGX_ZIP_HAVE_ICONV
-    if (iconv_cd) {
-        iconv_close(iconv_cd);
+    ctx->files_part = part;
+    ctx->files_part_i = i;
+    ctx->files_pieced += files_n;
+    ctx->pieces_end = offset;
+
+    if (!complete) {
+        ctx->pieces_n = piece_i;
+        return NGX_OK;
     }
-#endif
 
-    ctx->zip64_used |= offset >= (off_t) NGX_MAX_UINT32_VALUE || ctx->files.nelts >= NGX_MAX_UINT16_VALUE;
+    // out of order, any entry may end up past 4GB: reserve Zip64 offsets for all of them
+    // (and so may any entry after one of unknown size)
+    if ((ctx->out_of_order && offset >= (off_t) NGX_MAX_UINT32_VALUE) || ctx->stream) {
+        part = &ctx->files.part;
+        file = part->elts;
+        for (i = 0; /* void */; i++) {
+            if (i >= part->nelts) {
+                if (part->next == NULL)
+                    break;
+                part = part->next;
+                file = part->elts;
+                i = 0;
+            }
+            if (file[i].need_zip64_offset)
+                continue;
+
+            file[i].need_zip64_offset = 1;
+            if (file[i].need_zip64)
+                ctx->cd_size += sizeof(ngx_zip_extra_field_zip64_sizes_offset_t) - sizeof(ngx_zip_extra_field_zip64_sizes_only_t);
+            else
+                ctx->cd_size += sizeof(ngx_zip_extra_field_zip64_offset_only_t);
+        }
+    }
+
+    ctx->zip64_used |= offset >= (off_t) NGX_MAX_UINT32_VALUE || ctx->files_n >= NGX_MAX_UINT16_VALUE
+        || ctx->stream;
 
     ctx->cd_size += sizeof(ngx_zip_end_of_central_directory_record_t);
     if (ctx->zip64_used)
@@ -427,48 +690,10 @@ ngx_http_zip_generate_pieces(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx)
     cd_piece->range.end = offset += ctx->cd_size;
 
     ctx->pieces_n = piece_i; //!! nasty hack (truncating allocated array without reallocation)
+    ctx->pieces_done = 1;
 
     ctx->archive_size = offset;
 
-    // Collect names of original request's header fields that
-    // have to be present in each of the issued sub-requests.
-    variable_header_status = ngx_http_zip_variable_unknown_header(r, vv, &ngx_http_zip_header_name_pass_headers,
-            &r->upstream->headers_in.headers.part, sizeof("upstream_http_")-1);
-
-    if (variable_header_status == NGX_OK && !vv->not_found) {
-        ngx_str_t *header;
-        ngx_int_t len;
-        u_char    *next;
-        u_char    *start = vv->data;
-        u_char    *end = vv->data + vv->len;
-
-        // Split the list of names by ':'.
-        while (start < end) {
-            next = ngx_strnstr(start, ":", end - start);
-
-            if (next == NULL) {
-                next = end;
-            }
-
-            len = next - start;
-
-            if (len) {
-                if ((header = ngx_array_push(&ctx->pass_srq_headers)) == NULL) {
-                    return NGX_ERROR;
-                }
-
-                if ((header->data = ngx_pnalloc(r->pool, len)) == NULL) {
-                      return NGX_ERROR;
-                }
-
-                ngx_memcpy(header->data, start, len);
-                header->len = len;
-            }
-
-            start = next + 1;
-        }
-    }
-
     return NGX_OK;
 }
 
@@ -584,6 +809,28 @@ ngx_http_zip_file_header_chain_link(ngx_http_request_t *r, ngx_http_zip_ctx_t *c
 }
 
 
+// make buffer with the data of an inline file, which is kept with the file list
+ngx_chain_t*
+ngx_http_zip_inline_chain_link(ngx_http_request_t *r, ngx_http_zip_piece_t *piece, ngx_http_zip_range_t *range)
+{
+    ngx_chain_t *link;
+    ngx_buf_t   *b;
+    ngx_http_zip_file_t *file = piece->file;
+
+    if ((link = ngx_alloc_chain_link(r->pool)) == NULL || (b = ngx_calloc_buf(r->pool)) == NULL)
+        return NULL;
+    b->memory = 1;
+    b->pos = file->uri.data;
+    b->last = b->pos + file->size;
+
+    ngx_http_zip_truncate_buffer(b, &piece->range, range);
+
+    link->buf = b;
+    link->next = NULL;
+
+    return link;
+}
+
 // make buffer with 32/64 bit Data Descriptor chunk, this follows files with incomplete headers
 ngx_chain_t*
 ngx_http_zip_data_descriptor_chain_link(ngx_http_request_t *r, ngx_http_zip_piece_t *piece, ngx_http_zip_range_t *range)
@@ -592,10 +839,6 @@ ngx_http_zip_data_descriptor_chain_link(ngx_http_request_t *r, ngx_http_zip_piec
     ngx_buf_t   *b;
     ngx_http_zip_file_t *file = piece->file;
     size_t struct_size = file->need_zip64? sizeof(ngx_zip_data_descriptor_zip64_t) : sizeof(ngx_zip_data_descriptor_t);
-    union {
-        ngx_zip_data_descriptor_t  descriptor;
-        ngx_zip_data_descriptor_zip64_t  descriptor64;
-    } data;
 
     if ((link = ngx_alloc_chain_link(r->pool)) == NULL || (b = ngx_calloc_buf(r->pool)) == NULL
             || (b->pos = ngx_palloc(r->pool, struct_size)) == NULL)
@@ -603,6 +846,30 @@ ngx_http_zip_data_descriptor_chain_link(ngx_http_request_t *r, ngx_http_zip_piec
     b->memory = 1;
     b->last = b->pos + struct_size;
 
+    ngx_http_zip_write_data_descriptor(b->pos, file);
+
+    // the file is still being fetched: its CRC-32 is filled in once the body is complete
+    if (!file->crc32_final)
+        file->data_descriptor = b->pos;
+
+    ngx_http_zip_truncate_buffer(b, &piece->range, range);
+
+    link->buf = b;
+    link->next = NULL;
+
+    return link;
+}
+
+
+u_char *
+ngx_http_zip_write_data_descriptor(u_char *p, ngx_http_zip_file_t *file)
+{
+    size_t struct_size = file->need_zip64? sizeof(ngx_zip_data_descriptor_zip64_t) : sizeof(ngx_zip_data_descriptor_t);
+    union {
+        ngx_zip_data_descriptor_t  descriptor;
+        ngx_zip_data_descriptor_zip64_t  descriptor64;
+    } data;
+
     if (!file->need_zip64) {
         data.descriptor = ngx_zip_data_descriptor_template;
         data.descriptor.signature = htole32(data.descriptor.signature);
@@ -615,13 +882,9 @@ ngx_http_zip_data_descriptor_chain_link(ngx_http_request_t *r, ngx_http_zip_piec
         data.descriptor64.compressed_size = data.descriptor64.uncompressed_size = htole64(file->size);
     }
 
-    ngx_memcpy(b->pos, &data, struct_size);
-    ngx_http_zip_truncate_buffer(b, &piece->range, range);
-
-    link->buf = b;
-    link->next = NULL;
+    ngx_memcpy(p, &data, struct_size);
 
-    return link;
+    return p + struct_size;
 }
 
 
@@ -633,9 +896,10 @@ ngx_http_zip_central_directory_chain_link(ngx_http_request_t *r, ngx_http_zip_ct
     ngx_chain_t           *trailer;
     ngx_buf_t             *trailer_buf;
     u_char                *p;
-    off_t                  cd_size;
+    off_t                  cd_size, cd_offset, shift = 0;
     ngx_uint_t             i;
-    ngx_array_t           *files;
+    ngx_list_part_t       *part;
+    ngx_http_zip_file_t   *file;
     ngx_zip_end_of_central_directory_record_t  eocdr;
     ngx_zip_zip64_end_of_central_directory_record_t eocdr64;
     ngx_zip_zip64_end_of_central_directory_locator_t locator64;
@@ -645,7 +909,6 @@ ngx_http_zip_central_directory_chain_link(ngx_http_request_t *r, ngx_http_zip_ct
             || (p = ngx_palloc(r->pool, ctx->cd_size)) == NULL)
         return NULL;
 
-    files = &ctx->files;
     trailer->buf = trailer_buf;
     trailer->next = NULL;
 
@@ -655,14 +918,31 @@ ngx_http_zip_central_directory_chain_link(ngx_http_request_t *r, ngx_http_zip_ct
     trailer_buf->sync = 1;
     trailer_buf->memory = 1;
 
-    for (i = 0; i < files->nelts; i++)
-        p = ngx_http_zip_write_central_directory_entry(p, &((ngx_http_zip_file_t *)files->elts)[i], ctx);
+    part = &ctx->files.part;
+    file = part->elts;
+    for (i = 0; /* void */; i++) {
+        if (i >= part->nelts) {
+            if (part->next == NULL)
+                break;
+            part = part->next;
+            file = part->elts;
+            i = 0;
+        }
+        // entries of unknown size were laid out empty, in order the ones
+        // after them are further on by what they turned out to be
+        if (!ctx->out_of_order)
+            file[i].offset += shift;
+        p = ngx_http_zip_write_central_directory_entry(p, &file[i], ctx);
+        if (file[i].is_stream)
+            shift += file[i].size;
+    }
+    cd_offset = piece->range.start + shift;
 
     eocdr = ngx_zip_end_of_central_directory_record_template;
     eocdr.signature = htole32(eocdr.signature);
-    if (files->nelts < NGX_MAX_UINT16_VALUE) {
-        eocdr.disk_entries_n = htole16(files->nelts);
-        eocdr.entries_n = htole16(files->nelts);
+    if (ctx->files_n < NGX_MAX_UINT16_VALUE) {
+        eocdr.disk_entries_n = htole16(ctx->files_n);
+        eocdr.entries_n = htole16(ctx->files_n);
     }
 
     cd_size = ctx->cd_size - sizeof(ngx_zip_end_of_central_directory_record_t)
@@ -671,8 +951,8 @@ ngx_http_zip_central_directory_chain_link(ngx_http_request_t *r, ngx_http_zip_ct
 
     if (cd_size < (off_t) NGX_MAX_UINT32_VALUE)
         eocdr.size = htole32(cd_size);
-    if (piece->range.start < (off_t) NGX_MAX_UINT32_VALUE)
-        eocdr.offset = htole32(piece->range.start);
+    if (cd_offset < (off_t) NGX_MAX_UINT32_VALUE)
+        eocdr.offset = htole32(cd_offset);
 
     if (ctx->zip64_used) {
         eocdr64 = ngx_zip_zip64_end_of_central_directory_record_template;
@@ -681,9 +961,9 @@ ngx_http_zip_central_directory_chain_link(ngx_http_request_t *r, ngx_http_zip_ct
         eocdr64.version_made_by = htole16(eocdr64.version_made_by);
         eocdr64.version_needed = htole16(eocdr64.version_made_by);
 
-        eocdr64.cd_n_entries_on_this_disk = eocdr64.cd_n_entries_total = htole64(files->nelts);
+        eocdr64.cd_n_entries_on_this_disk = eocdr64.cd_n_entries_total = htole64(ctx->files_n);
         eocdr64.cd_size = htole64(cd_size);
-        eocdr64.cd_offset = htole64(piece->range.start);
+        eocdr64.cd_offset = htole64(cd_offset);
 
         ngx_memcpy(p, &eocdr64, sizeof(ngx_zip_zip64_end_of_central_directory_record_t));
         p += sizeof(ngx_zip_zip64_end_of_central_directory_record_t);
@@ -691,7 +971,7 @@ ngx_http_zip_central_directory_chain_link(ngx_http_request_t *r, ngx_http_zip_ct
         locator64 = ngx_zip_zip64_end_of_central_directory_locator_template;
         locator64.signature = htole32(locator64.signature);
         locator64.disks_total_n = htole32(locator64.disks_total_n);
-        locator64.cd_relative_offset = htole64(piece->range.start + cd_size);
+        locator64.cd_relative_offset = htole64(cd_offset + cd_size);
         ngx_memcpy(p, &locator64, sizeof(ngx_zip_zip64_end_of_central_directory_locator_t));
         p += sizeof(ngx_zip_zip64_end_of_central_directory_locator_t);
     }
@@ -726,6 +1006,13 @@ ngx_http_zip_write_central_directory_entry(u_char *p, ngx_http_zip_file_t *file,
         central_directory_file_header.attr_external = zip_directory_attr_external;
     }
 
+    if (file->mode) { // Unix permissions, only read as such from a Unix host
+        central_directory_file_header.version_made_by |= htole16(zip_version_made_by_unix);
+        central_directory_file_header.attr_external = file->is_directory
+            ? ((zip_unix_directory_type | file->mode) << 16) | zip_dos_directory_attr
+            : (zip_unix_file_type | file->mode) << 16;
+    }
+
     central_directory_file_header.attr_external = htole32(central_directory_file_header.attr_external);
     central_directory_file_header.mtime = htole32(file->dos_time);
     central_directory_file_header.crc32 = htole32(file->crc32);
@@ -12,6 +12,10 @@
 #define zip_directory_attr_external 0x41ED0010
 //                      Unix dir bit -^     ^- DOS dir bit
 //        Unix permission bits (0755) -^^^
+#define zip_version_made_by_unix 0x0300
+#define zip_unix_file_type 0100000
+#define zip_unix_directory_type 0040000
+#define zip_dos_directory_attr 0x10
 
 typedef struct {
     uint16_t   tag; //0x5455
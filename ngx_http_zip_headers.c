@@ -19,12 +19,12 @@ ngx_http_zip_find_key_in_set(ngx_str_t *key, ngx_array_t *set)
 }
 
 ngx_int_t 
-ngx_http_zip_add_cache_control(ngx_http_request_t *r)
+ngx_http_zip_add_cache_control(ngx_http_request_t *r, ngx_str_t *value)
 {
 #ifdef NGX_ZIP_MULTI_HEADERS_LINKED_LISTS
     ngx_table_elt_t            *cc;
 
-    /* convoluted way of adding Cache-Control: max-age=0 */
+    /* convoluted way of setting Cache-Control: zip_cache_control */
     /* The header is necessary so IE doesn't barf */
     cc = r->headers_out.cache_control;
 
@@ -47,14 +47,14 @@ ngx_http_zip_add_cache_control(ngx_http_request_t *r)
          cc->next = NULL;
     }
 
-    ngx_str_set(&cc->value, "max-age=0");
+    cc->value = *value;
 
     return NGX_OK;
 #else
     ngx_table_elt_t           **ccp, *cc;
     ngx_uint_t                  i;
 
-    /* convoluted way of adding Cache-Control: max-age=0 */
+    /* convoluted way of setting Cache-Control: zip_cache_control */
     /* The header is necessary so IE doesn't barf */
     ccp = r->headers_out.cache_control.elts;
 
@@ -89,12 +89,35 @@ ngx_http_zip_add_cache_control(ngx_http_request_t *r)
         cc = ccp[0];
     }
 
-    ngx_str_set(&cc->value, "max-age=0");
+    cc->value = *value;
 
     return NGX_OK;
 #endif
 }
 
+ngx_int_t
+ngx_http_zip_add_retry_after(ngx_http_request_t *r, time_t delay)
+{
+    ngx_table_elt_t              *retry_after;
+
+    retry_after = ngx_list_push(&r->headers_out.headers);
+    if (retry_after == NULL) {
+        return NGX_ERROR;
+    }
+
+    retry_after->value.data = ngx_palloc(r->pool, NGX_TIME_T_LEN);
+    if (retry_after->value.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    retry_after->hash = 1;
+    ngx_str_set(&retry_after->key, "Retry-After");
+    retry_after->value.len = ngx_sprintf(retry_after->value.data, "%T", delay)
+        - retry_after->value.data;
+
+    return NGX_OK;
+}
+
 ngx_int_t 
 ngx_http_zip_add_content_range_header(ngx_http_request_t *r)
 {
@@ -255,7 +278,7 @@ ngx_http_zip_strip_range_header(ngx_http_request_t *r)
 ngx_int_t
 ngx_http_zip_init_subrequest_headers(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
         ngx_http_request_t *sr, ngx_http_zip_range_t *piece_range,
-        ngx_http_zip_range_t *req_range)
+        ngx_http_zip_range_t *req_range, ngx_http_zip_file_t *file)
 {
     ngx_list_t new_headers;
 
@@ -287,7 +310,8 @@ ngx_http_zip_init_subrequest_headers(ngx_http_request_t *r, ngx_http_zip_ctx_t *
     sr->headers_in.content_length_n = -1;
     sr->headers_in.keep_alive_n = -1;
 
-    if (req_range && (piece_range->start < req_range->start || piece_range->end > req_range->end)) {
+    if (req_range && ((file && file->is_slice)
+                || piece_range->start < req_range->start || piece_range->end > req_range->end)) {
         ngx_table_elt_t *range_header = ngx_list_push(&sr->headers_in.headers);
         off_t start = req_range->start - piece_range->start;
         off_t end = req_range->end - piece_range->start;
@@ -297,6 +321,12 @@ ngx_http_zip_init_subrequest_headers(ngx_http_request_t *r, ngx_http_zip_ctx_t *
         if (end > piece_range->end)
             end = piece_range->end;
 
+        // a slice is further on in its location
+        if (file && file->is_slice) {
+            start += file->source_offset;
+            end += file->source_offset;
+        }
+
         if (range_header == NULL)
             return NGX_ERROR;
 
@@ -1,5 +1,6 @@
 ngx_int_t ngx_http_zip_strip_range_header(ngx_http_request_t *r);
-ngx_int_t ngx_http_zip_add_cache_control(ngx_http_request_t *r);
+ngx_int_t ngx_http_zip_add_cache_control(ngx_http_request_t *r, ngx_str_t *value);
+ngx_int_t ngx_http_zip_add_retry_after(ngx_http_request_t *r, time_t delay);
 ngx_int_t ngx_http_zip_set_range_header(ngx_http_request_t *r, 
         ngx_http_zip_range_t *piece_range, ngx_http_zip_range_t *range);
 ngx_int_t ngx_http_zip_add_content_range_header(ngx_http_request_t *r);
@@ -12,7 +13,7 @@ ngx_int_t ngx_http_zip_init_multipart_range(ngx_http_request_t *r,
 
 ngx_int_t ngx_http_zip_init_subrequest_headers(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
         ngx_http_request_t *sr, ngx_http_zip_range_t *piece_range,
-        ngx_http_zip_range_t *req_range);
+        ngx_http_zip_range_t *req_range, ngx_http_zip_file_t *file);
 
 ngx_int_t ngx_http_zip_variable_unknown_header(ngx_http_request_t *r,
                                            ngx_http_variable_value_t *v, ngx_str_t *var, ngx_list_part_t *part,
@@ -10,6 +10,8 @@
 #include "ngx_http_zip_parsers.h"
 #include "ngx_http_zip_file.h"
 #include "ngx_http_zip_headers.h"
+#include "ngx_http_zip_crc32.h"
+#include "ngx_http_zip_crc_cache.h"
 
 static ngx_chain_t *ngx_chain_last_link(ngx_chain_t *chain_link);
 static ngx_int_t ngx_http_zip_discard_chain(ngx_http_request_t *r,
@@ -18,8 +20,8 @@ static ngx_int_t ngx_http_zip_discard_chain(ngx_http_request_t *r,
 static ngx_int_t ngx_http_zip_ranges_intersect(ngx_http_zip_range_t *range1,
         ngx_http_zip_range_t *range2);
 
-static ngx_int_t ngx_http_zip_copy_unparsed_request(ngx_http_request_t *r,
-        ngx_chain_t *in, ngx_http_zip_ctx_t *ctx);
+static ngx_int_t ngx_http_zip_check_validator(ngx_http_request_t *r,
+        ngx_http_zip_ctx_t *ctx, ngx_http_zip_sr_ctx_t *sr_ctx);
 static ngx_int_t ngx_http_zip_set_headers(ngx_http_request_t *r, 
         ngx_http_zip_ctx_t *ctx);
 
@@ -28,12 +30,38 @@ static ngx_int_t ngx_http_zip_body_filter(ngx_http_request_t *r,
         ngx_chain_t *in);
 static ngx_int_t ngx_http_zip_main_request_body_filter(ngx_http_request_t *r,
         ngx_chain_t *in);
+static ngx_int_t ngx_http_zip_hold(ngx_http_request_t *r, ngx_int_t rc);
+static void ngx_http_zip_write_handler(ngx_http_request_t *r);
+static void ngx_http_zip_rehold(ngx_http_request_t *r);
 static ngx_int_t ngx_http_zip_subrequest_body_filter(ngx_http_request_t *r, 
         ngx_chain_t *in);
-
+static ngx_http_zip_sr_ctx_t *ngx_http_zip_get_module_sr_ctx(ngx_http_request_t *r);
+
+static ngx_int_t ngx_http_zip_subrequest_output(ngx_http_request_t *r,
+        ngx_http_zip_ctx_t *ctx, ngx_http_zip_sr_ctx_t *sr_ctx, ngx_chain_t *in);
+#if (NGX_THREADS)
+static ngx_int_t ngx_http_zip_crc32_thread(ngx_http_request_t *r,
+        ngx_http_zip_ctx_t *ctx, ngx_http_zip_sr_ctx_t *sr_ctx, ngx_chain_t *in);
+static ngx_int_t ngx_http_zip_crc32_hold(ngx_http_request_t *r,
+        ngx_http_zip_sr_ctx_t *sr_ctx, ngx_chain_t *in);
+static void ngx_http_zip_crc32_thread_handler(void *data, ngx_log_t *log);
+static void ngx_http_zip_crc32_thread_event_handler(ngx_event_t *ev);
+#endif
 static ngx_int_t ngx_http_zip_subrequest_update_crc32(ngx_chain_t *in, 
         ngx_http_zip_file_t *file);
+static void ngx_http_zip_subrequest_finalize_crc32(ngx_http_request_t *r,
+        ngx_http_zip_file_t *file);
 static ngx_int_t ngx_http_zip_subrequest_done(ngx_http_request_t *r, void *data, ngx_int_t rc);
+static ngx_int_t ngx_http_zip_hedge_done(ngx_http_request_t *r,
+        ngx_http_zip_ctx_t *ctx, ngx_http_zip_sr_ctx_t *sr_ctx, ngx_int_t rc);
+static ngx_int_t ngx_http_zip_retry_fetch(ngx_http_request_t *r,
+        ngx_http_zip_ctx_t *ctx, ngx_http_zip_sr_ctx_t *sr_ctx, ngx_int_t rc);
+static ngx_int_t ngx_http_zip_send_next_pieces(ngx_http_request_t *r,
+        ngx_http_zip_ctx_t *ctx, ngx_int_t rc);
+static ngx_int_t ngx_http_zip_subrequest_save_body(ngx_http_request_t *r,
+        ngx_http_zip_ctx_t *ctx, ngx_http_zip_sr_ctx_t *sr_ctx, ngx_chain_t *in);
+static ngx_int_t ngx_http_zip_save_body_to_temp_file(ngx_http_request_t *r,
+        ngx_http_zip_ctx_t *ctx, ngx_http_zip_sr_ctx_t *sr_ctx, ngx_buf_t *b);
 
 static ngx_int_t ngx_http_zip_send_pieces(ngx_http_request_t *r,
         ngx_http_zip_ctx_t *ctx);
@@ -41,8 +69,20 @@ static ngx_int_t ngx_http_zip_send_header_piece(ngx_http_request_t *r,
         ngx_http_zip_ctx_t *ctx, ngx_http_zip_piece_t *piece, ngx_http_zip_range_t *req_range);
 static ngx_int_t ngx_http_zip_send_file_piece(ngx_http_request_t *r,
         ngx_http_zip_ctx_t *ctx, ngx_http_zip_piece_t *piece, ngx_http_zip_range_t *req_range);
+static ngx_http_zip_sr_ctx_t *ngx_http_zip_fetch_piece(ngx_http_request_t *r,
+        ngx_http_zip_ctx_t *ctx, ngx_http_zip_piece_t *piece, ngx_http_zip_range_t *req_range,
+        ngx_str_t *uri, ngx_str_t *args);
+static ngx_int_t ngx_http_zip_expand_template(ngx_pool_t *pool, ngx_str_t *template,
+        ngx_str_t *id, ngx_uint_t escape, ngx_str_t *tail, ngx_str_t *out);
+static ngx_int_t ngx_http_zip_start_fetch(ngx_http_request_t *r,
+        ngx_http_request_t *pr, ngx_http_zip_ctx_t *ctx, ngx_http_zip_sr_ctx_t *sr_ctx);
+static ngx_int_t ngx_http_zip_send_hedge(ngx_http_request_t *r,
+        ngx_http_zip_ctx_t *ctx, ngx_http_zip_sr_ctx_t *entry);
+static void ngx_http_zip_hedge_handler(ngx_event_t *ev);
 static ngx_int_t ngx_http_zip_send_directory_piece(ngx_http_request_t *r,
         ngx_http_zip_ctx_t *ctx, ngx_http_zip_piece_t *piece, ngx_http_zip_range_t *req_range);
+static ngx_int_t ngx_http_zip_send_inline_piece(ngx_http_request_t *r,
+        ngx_http_zip_ctx_t *ctx, ngx_http_zip_piece_t *piece, ngx_http_zip_range_t *req_range);
 static ngx_int_t ngx_http_zip_send_trailer_piece(ngx_http_request_t *r,
         ngx_http_zip_ctx_t *ctx, ngx_http_zip_piece_t *piece, ngx_http_zip_range_t *req_range);
 static ngx_int_t ngx_http_zip_send_central_directory_piece(ngx_http_request_t *r,
@@ -55,16 +95,242 @@ static ngx_int_t ngx_http_zip_send_boundary(ngx_http_request_t *r,
 static ngx_int_t ngx_http_zip_send_final_boundary(ngx_http_request_t *r,
         ngx_http_zip_ctx_t *ctx);
 
+static ngx_int_t ngx_http_zip_can_send_piece(ngx_http_request_t *r,
+        ngx_http_zip_ctx_t *ctx, ngx_http_zip_piece_t *piece);
+
+static ngx_int_t ngx_http_zip_fetch_zone_acquire(ngx_http_request_t *r,
+        ngx_http_zip_ctx_t *ctx);
+static void ngx_http_zip_fetch_zone_release(ngx_http_zip_fetch_zone_t *zone);
+static void ngx_http_zip_fetch_zone_wake_next(ngx_http_zip_fetch_zone_t *zone);
+static void ngx_http_zip_fetch_zone_wake(ngx_event_t *ev);
+static void ngx_http_zip_fetch_zone_cleanup(void *data);
+static ngx_int_t ngx_http_zip_admit(ngx_http_request_t *r,
+        ngx_http_zip_ctx_t *ctx);
+static void ngx_http_zip_admission_cleanup(void *data);
+static void ngx_http_zip_fetch_done(ngx_http_zip_ctx_t *ctx,
+        ngx_http_zip_sr_ctx_t *sr_ctx);
+
+static ngx_int_t ngx_http_zip_send_pieces_out_of_order(ngx_http_request_t *r,
+        ngx_http_zip_ctx_t *ctx);
+static ngx_int_t ngx_http_zip_send_entry(ngx_http_request_t *r,
+        ngx_http_zip_ctx_t *ctx, ngx_http_zip_piece_t *piece, ngx_chain_t *body);
+
+static void *ngx_http_zip_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_http_zip_merge_loc_conf(ngx_conf_t *cf, void *parent,
+        void *child);
 static ngx_int_t ngx_http_zip_init(ngx_conf_t *cf);
+static char *ngx_http_zip_fetch_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static ngx_int_t ngx_http_zip_init_fetch_zone(ngx_shm_zone_t *shm_zone,
+        void *data);
+static char *ngx_http_zip_admission_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static ngx_int_t ngx_http_zip_init_admission_zone(ngx_shm_zone_t *shm_zone,
+        void *data);
+#if (NGX_THREADS)
+static char *ngx_http_zip_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+#endif
+static char *ngx_http_zip_crc_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
+static char *ngx_http_zip_mtime(ngx_conf_t *cf, ngx_command_t *cmd,
+        void *conf);
 
 static ngx_int_t ngx_http_zip_main_request_header_filter(ngx_http_request_t *r);
 static ngx_int_t ngx_http_zip_subrequest_header_filter(ngx_http_request_t *r);
 
+static ngx_int_t ngx_http_zip_parse_list(ngx_http_request_t *r,
+        ngx_http_zip_ctx_t *ctx, ngx_buf_t *buf);
+static ngx_int_t ngx_http_zip_copy_header(ngx_http_request_t *r,
+        ngx_str_t *name, ngx_str_t *value);
+static ngx_int_t ngx_http_zip_read_manifest_file(ngx_http_request_t *r,
+        ngx_http_zip_ctx_t *ctx);
+static ngx_int_t ngx_http_zip_fetch_page(ngx_http_request_t *r,
+        ngx_http_zip_ctx_t *ctx);
+static ngx_int_t ngx_http_zip_end_page(ngx_http_request_t *r,
+        ngx_http_zip_ctx_t *ctx);
+static ngx_int_t ngx_http_zip_page_body_filter(ngx_http_request_t *r,
+        ngx_http_zip_ctx_t *ctx, ngx_chain_t *in);
+static ngx_int_t ngx_http_zip_page_done(ngx_http_request_t *r, void *data,
+        ngx_int_t rc);
+static ngx_int_t ngx_http_zip_probe_sizes(ngx_http_request_t *r,
+        ngx_http_zip_ctx_t *ctx);
+static ngx_int_t ngx_http_zip_probe_size(ngx_http_request_t *r,
+        ngx_http_zip_ctx_t *ctx, ngx_http_zip_file_t *file);
+static ngx_int_t ngx_http_zip_probe_done(ngx_http_request_t *r, void *data,
+        ngx_int_t rc);
+static ngx_uint_t ngx_http_zip_bundle_member(ngx_http_zip_piece_t *piece);
+static ngx_http_zip_piece_t *ngx_http_zip_bundle_end(ngx_http_request_t *r,
+        ngx_http_zip_ctx_t *ctx, ngx_http_zip_piece_t *piece);
+static ngx_chain_t *ngx_http_zip_split_bundle(ngx_http_request_t *r,
+        ngx_http_zip_ctx_t *ctx, ngx_http_zip_sr_ctx_t *sr_ctx, ngx_chain_t *in);
+static ngx_int_t ngx_http_zip_set_location(ngx_http_request_t *r,
+        ngx_http_zip_ctx_t *ctx, ngx_http_zip_sr_ctx_t *sr_ctx,
+        ngx_str_t *uri, ngx_str_t *args);
+static ngx_int_t ngx_http_zip_report_crc32(ngx_http_request_t *r,
+        ngx_http_zip_ctx_t *ctx);
+
 static ngx_str_t ngx_http_zip_header_variable_name = ngx_string("upstream_http_x_archive_files");
+static ngx_str_t ngx_http_zip_header_next_page_name = ngx_string("upstream_http_x_archive_files_next");
+static ngx_str_t ngx_http_zip_header_manifest_file_name = ngx_string("upstream_http_x_archive_manifest_file");
+static ngx_str_t ngx_http_zip_head_method = ngx_string("HEAD");
+static ngx_str_t ngx_http_zip_post_method = ngx_string("POST");
 
 static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
 static ngx_http_output_body_filter_pt    ngx_http_next_body_filter;
 
+static ngx_conf_num_bounds_t  ngx_http_zip_subrequest_concurrency_bounds = {
+    ngx_conf_check_num_bounds, 1, -1
+};
+
+static ngx_conf_num_bounds_t  ngx_http_zip_segments_bounds = {
+    ngx_conf_check_num_bounds, 1, -1
+};
+
+static ngx_path_init_t  ngx_http_zip_temp_path = {
+    ngx_string(NGX_HTTP_ZIP_TEMP_PATH), { 1, 2, 0 }
+};
+
+static ngx_command_t  ngx_http_zip_commands[] = {
+
+    { ngx_string("zip_subrequest_concurrency"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_zip_loc_conf_t, subrequest_concurrency),
+      &ngx_http_zip_subrequest_concurrency_bounds },
+
+    { ngx_string("zip_subrequest_buffer_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_zip_loc_conf_t, subrequest_buffer_size),
+      NULL },
+
+    { ngx_string("zip_out_of_order"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_zip_loc_conf_t, out_of_order),
+      NULL },
+
+    { ngx_string("zip_progressive"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_zip_loc_conf_t, progressive),
+      NULL },
+
+    { ngx_string("zip_temp_path"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1234,
+      ngx_conf_set_path_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_zip_loc_conf_t, temp_path),
+      NULL },
+
+    { ngx_string("zip_segment_threshold"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_off_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_zip_loc_conf_t, segment_threshold),
+      NULL },
+
+    { ngx_string("zip_segments"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_zip_loc_conf_t, segments),
+      &ngx_http_zip_segments_bounds },
+
+    { ngx_string("zip_bundle_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_off_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_zip_loc_conf_t, bundle_size),
+      NULL },
+
+#if (NGX_THREADS)
+    { ngx_string("zip_thread_pool"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_zip_thread_pool,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("zip_thread_chunk"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_zip_loc_conf_t, thread_chunk),
+      NULL },
+#endif
+
+    { ngx_string("zip_hedge_delay"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_zip_loc_conf_t, hedge_delay),
+      NULL },
+
+    { ngx_string("zip_subrequest_retries"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_zip_loc_conf_t, subrequest_retries),
+      NULL },
+
+    { ngx_string("zip_fetch_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_zip_fetch_zone,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("zip_admission_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_zip_admission_zone,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("zip_crc_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_zip_crc_cache,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("zip_mtime"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_zip_mtime,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("zip_cache_control"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_zip_loc_conf_t, cache_control),
+      NULL },
+
+    { ngx_string("zip_crc_report"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_zip_loc_conf_t, crc_report),
+      NULL },
+
+    { ngx_string("zip_manifest_root"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_zip_loc_conf_t, manifest_root),
+      NULL },
+
+      ngx_null_command
+};
+
 static ngx_http_module_t  ngx_http_zip_module_ctx = {
     NULL,                       /* preconfiguration */
     ngx_http_zip_init,          /* postconfiguration */
@@ -75,14 +341,14 @@ static ngx_http_module_t  ngx_http_zip_module_ctx = {
     NULL,                       /* create server configuration */
     NULL,                       /* merge server configuration */
 
-    NULL,                       /* create location configuration */
-    NULL                        /* merge location configuration */
+    ngx_http_zip_create_loc_conf, /* create location configuration */
+    ngx_http_zip_merge_loc_conf /* merge location configuration */
 };
 
 ngx_module_t  ngx_http_zip_module = {
     NGX_MODULE_V1,
     &ngx_http_zip_module_ctx,   /* module context */
-    NULL,                       /* module directives */
+    ngx_http_zip_commands,      /* module directives */
     NGX_HTTP_MODULE,            /* module type */
     NULL,                       /* init master */
     NULL,                       /* init module */
@@ -126,22 +392,6 @@ ngx_http_zip_ranges_intersect(ngx_http_zip_range_t *range1, ngx_http_zip_range_t
     return !(range1->start >= range2->end || range2->start >= range1->end);
 }
 
-static ngx_int_t ngx_http_zip_copy_unparsed_request(ngx_http_request_t *r,
-        ngx_chain_t *in, ngx_http_zip_ctx_t *ctx)
-{
-    ngx_chain_t *chain_link;
-    void *buf;
-
-    for (chain_link = in; chain_link; chain_link = chain_link->next ) {
-        buf = ngx_array_push_n(&ctx->unparsed_request, chain_link->buf->last - chain_link->buf->pos);
-        ngx_memcpy(buf, chain_link->buf->pos, chain_link->buf->last - chain_link->buf->pos);
-    }
-
-    chain_link = ngx_chain_last_link(in);
-
-    return chain_link->buf->last_buf ? NGX_OK: NGX_AGAIN;
-}
-
 /* 
  * The header filter looks for "X-Archive-Files: zip" and allocates
  * a module context struct if found
@@ -161,6 +411,8 @@ ngx_http_zip_main_request_header_filter(ngx_http_request_t *r)
 {
     ngx_http_variable_value_t  *vv;
     ngx_http_zip_ctx_t         *ctx;
+    ngx_http_zip_loc_conf_t    *zlcf;
+    ngx_pool_cleanup_t         *cln;
 
     if ((ctx = ngx_http_get_module_ctx(r, ngx_http_zip_module)) != NULL)
         return ngx_http_next_header_filter(r);
@@ -190,11 +442,37 @@ ngx_http_zip_main_request_header_filter(ngx_http_request_t *r)
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "mod_zip: X-Archive-Files found");
 
     if ((ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_zip_ctx_t))) == NULL 
-        || ngx_array_init(&ctx->unparsed_request, r->pool, 64 * 1024, 1) == NGX_ERROR
-        || ngx_array_init(&ctx->files, r->pool, 1, sizeof(ngx_http_zip_file_t)) == NGX_ERROR
+        || ngx_list_init(&ctx->files, r->pool, 16, sizeof(ngx_http_zip_file_t)) == NGX_ERROR
         || ngx_array_init(&ctx->ranges, r->pool, 1, sizeof(ngx_http_zip_range_t)) == NGX_ERROR
         || ngx_array_init(&ctx->pass_srq_headers, r->pool, 1, sizeof(ngx_str_t)) == NGX_ERROR)
         return NGX_ERROR;
+
+    ngx_queue_init(&ctx->subrequests);
+
+    ctx->binary = vv->len == sizeof("zip-bin") - 1
+                  && ngx_strncmp(vv->data, "zip-bin", vv->len) == 0;
+
+    if (ngx_http_zip_copy_header(r, &ngx_http_zip_header_next_page_name, &ctx->next_page) == NGX_ERROR
+        || ngx_http_zip_copy_header(r, &ngx_http_zip_header_manifest_file_name, &ctx->manifest_file) == NGX_ERROR)
+        return NGX_ERROR;
+
+    zlcf = ngx_http_get_module_loc_conf(r, ngx_http_zip_module);
+    ctx->out_of_order = zlcf->out_of_order || zlcf->progressive;
+    ctx->progressive = zlcf->progressive;
+    ctx->mirrors = zlcf->hedge_delay != 0;
+
+    if (zlcf->fetch_zone) {
+        if ((cln = ngx_pool_cleanup_add(r->pool, 0)) == NULL)
+            return NGX_ERROR;
+
+        cln->handler = ngx_http_zip_fetch_zone_cleanup;
+        cln->data = ctx;
+
+        ctx->fetch_zone = zlcf->fetch_zone;
+        ctx->fetch_wait.handler = ngx_http_zip_fetch_zone_wake;
+        ctx->fetch_wait.data = r;
+        ctx->fetch_wait.log = r->connection->log;
+    }
     
     ngx_http_set_ctx(r, ctx, ngx_http_zip_module);
 
@@ -205,30 +483,131 @@ static ngx_int_t
 ngx_http_zip_subrequest_header_filter(ngx_http_request_t *r)
 {
     ngx_http_zip_ctx_t    *ctx;
+    ngx_http_zip_sr_ctx_t *sr_ctx;
 
     ctx = ngx_http_get_module_ctx(r->main, ngx_http_zip_module);
     if (ctx != NULL) {
+        sr_ctx = ngx_http_zip_get_module_sr_ctx(r);
+
+        /* nobody waits for the answer to the CRC-32 report */
+        if (sr_ctx && sr_ctx->report) {
+            if (r->headers_out.status >= NGX_HTTP_SPECIAL_RESPONSE) {
+                ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                        "mod_zip: the CRC-32 report returned %d",
+                        r->headers_out.status);
+            }
+            return ngx_http_next_header_filter(r);
+        }
+
         if (r->headers_out.status != NGX_HTTP_OK &&
                 r->headers_out.status != NGX_HTTP_PARTIAL_CONTENT) {
+            if (sr_ctx && sr_ctx->entry->hedged) {
+                /* another location may still answer, see ngx_http_zip_hedge_done() */
+                ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                        "mod_zip: a subrequest returned %d, dropping it",
+                        r->headers_out.status);
+                return ngx_http_next_header_filter(r);
+            }
             ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
                     "mod_zip: a subrequest returned %d, aborting...",
                     r->headers_out.status);
             ctx->abort = 1;
             return NGX_ERROR;
         }
-        if (ctx->missing_crc32) {
+        if (sr_ctx && sr_ctx->page) {
+            if (ngx_http_zip_copy_header(r, &ngx_http_zip_header_next_page_name,
+                        &ctx->next_page) == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+            return ngx_http_next_header_filter(r);
+        }
+        if (sr_ctx && sr_ctx->probe) {
+            if (r->headers_out.content_length_n < 0) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                        "mod_zip: no Content-Length for \"%V\", aborting...",
+                        &sr_ctx->requesting_file->filename);
+                ctx->abort = 1;
+                return NGX_ERROR;
+            }
+            sr_ctx->requesting_file->size = r->headers_out.content_length_n;
+            sr_ctx->requesting_file->missing_size = 0;
+            return ngx_http_next_header_filter(r);
+        }
+        if (sr_ctx && sr_ctx->requesting_file->is_slice
+                && r->headers_out.status != NGX_HTTP_PARTIAL_CONTENT) {
+            /* the whole location instead of the slice of it */
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "mod_zip: a subrequest ignored the Range of \"%V\", aborting...",
+                    &sr_ctx->requesting_file->filename);
+            ctx->abort = 1;
+            return NGX_ERROR;
+        }
+        if (sr_ctx && (r->headers_out.status == NGX_HTTP_OK
+                    || r->headers_out.status == NGX_HTTP_PARTIAL_CONTENT)
+                && ngx_http_zip_check_validator(r, ctx, sr_ctx) != NGX_OK) {
+            ctx->abort = 1;
+            return NGX_ERROR;
+        }
+        if (ctx->missing_crc32 || ctx->out_of_order || (sr_ctx && sr_ctx->bundle_last)) {
             r->filter_need_in_memory = 1;
         }
+        if (sr_ctx && sr_ctx->entry->hedged && sr_ctx->entry->winner == NULL) {
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                    "mod_zip: keeping \"%V?%V\"", &r->uri, &r->args);
+            sr_ctx->entry->winner = sr_ctx;
+            if (sr_ctx->entry->hedge.timer_set) {
+                ngx_del_timer(&sr_ctx->entry->hedge);
+            }
+        }
     }
     return ngx_http_next_header_filter(r);
 }
 
+/*
+ * With zip_crc_cache, keep what the CRC-32 computed from a response is of,
+ * and see that a file whose CRC-32 came from the cache did not change since
+ */
+static ngx_int_t
+ngx_http_zip_check_validator(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
+        ngx_http_zip_sr_ctx_t *sr_ctx)
+{
+    ngx_http_zip_loc_conf_t *zlcf;
+    ngx_http_zip_file_t     *file = sr_ctx->requesting_file;
+
+    zlcf = ngx_http_get_module_loc_conf(r->main, ngx_http_zip_module);
+
+    if (zlcf->crc_cache == NULL) {
+        return NGX_OK;
+    }
+
+    ngx_http_zip_crc_cache_validator(r, &sr_ctx->validator);
+
+    if (!file->crc32_cached
+            || (sr_ctx->validator.len == file->validator.len
+                && ngx_strncmp(sr_ctx->validator.data, file->validator.data,
+                    file->validator.len) == 0)) {
+        return NGX_OK;
+    }
+
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+            "mod_zip: \"%V\" changed since its CRC-32 was cached, aborting...",
+            &file->filename);
+
+    (void) ngx_http_zip_crc_cache_forget(r, ctx, zlcf->crc_cache, file);
+
+    return NGX_ERROR;
+}
+
 static ngx_int_t
 ngx_http_zip_set_headers(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx)
 {
     time_t if_range, last_modified;
+    ngx_http_zip_loc_conf_t *zlcf;
 
-    if (ngx_http_zip_add_cache_control(r) == NGX_ERROR) {
+    zlcf = ngx_http_get_module_loc_conf(r, ngx_http_zip_module);
+
+    if (zlcf->cache_control.len
+            && ngx_http_zip_add_cache_control(r, &zlcf->cache_control) == NGX_ERROR) {
         return NGX_ERROR;
     }
 
@@ -236,11 +615,16 @@ ngx_http_zip_set_headers(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx)
     ngx_str_set(&r->headers_out.content_type, NGX_ZIP_MIME_TYPE);
     ngx_http_clear_content_length(r);
 
-    if (ctx->missing_crc32) {
+    if (ctx->missing_crc32 || ctx->out_of_order) {
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                 "mod_zip: Clearing Accept-Ranges header");
         ngx_http_clear_accept_ranges(r);
     }
+    if (ctx->progressive || ctx->stream) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                "mod_zip: Archive size not known yet");
+        return NGX_OK;
+    }
     r->headers_out.content_length_n = ctx->archive_size;
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
             "mod_zip: Archive will be %O bytes", ctx->archive_size);
@@ -252,6 +636,11 @@ ngx_http_zip_set_headers(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx)
                     "mod_zip: Missing checksums, ignoring Range");
             return NGX_OK;
         }
+        if (ctx->out_of_order) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                    "mod_zip: Entries out of order, ignoring Range");
+            return NGX_OK;
+        }
         if (r->headers_in.if_range && r->upstream) {
             if_range = ngx_http_parse_time(r->headers_in.if_range->value.data,
                     r->headers_in.if_range->value.len);
@@ -320,20 +709,157 @@ ngx_http_zip_set_headers(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx)
 static ngx_int_t 
 ngx_http_zip_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 {
+    ngx_chain_t *cl;
+    ngx_int_t    rc;
+
     if (r != r->main) {
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "mod_zip: entering subrequest body filter");
         return ngx_http_zip_subrequest_body_filter(r, in);
     }
 
+    /* the filter may take the last_buf flag off */
+    for (cl = in; cl && !cl->buf->last_buf; cl = cl->next) { /* void */ }
+
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "mod_zip: entering main request body filter");
-    return ngx_http_zip_main_request_body_filter(r, in);
+    rc = ngx_http_zip_main_request_body_filter(r, in);
+
+    return cl ? ngx_http_zip_hold(r, rc) : rc;
+}
+
+/*
+ * Whatever made the file list finalizes the request once the end of it has
+ * been through the body filter. When the archive is not complete by then
+ * (its files are fetched in the background, or it waits for sizes, pages,
+ * hashing threads or a fetch zone), the main request is held like one that
+ * reads its body, with r->main->count++ and NGX_DONE, and carried on by
+ * ngx_http_zip_write_handler(). The handlers it had are put back when the
+ * archive is done.
+ */
+static ngx_int_t
+ngx_http_zip_hold(ngx_http_request_t *r, ngx_int_t rc)
+{
+    ngx_http_zip_ctx_t *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_zip_module);
+
+    if (ctx == NULL || ctx->held || rc == NGX_ERROR
+            || (ctx->trailer_sent && ctx->output.in == NULL)
+            || (r->headers_out.status != NGX_HTTP_OK
+                && r->headers_out.status != NGX_HTTP_PARTIAL_CONTENT)) {
+        return rc;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "mod_zip: holding the request for the rest of the archive");
+
+    ctx->held = 1;
+    r->main->count++;
+
+    ctx->read_event_handler = r->read_event_handler;
+    ctx->write_event_handler = r->write_event_handler;
+
+    r->read_event_handler = ngx_http_test_reading;
+    r->write_event_handler = ngx_http_zip_write_handler;
+
+    return NGX_DONE;
+}
+
+/*
+ * The writer of a held archive, which the completion of its subrequests,
+ * threads and fetch zone wake up like any other: the archive goes on until
+ * the trailer is sent, and the request is then finalized.
+ */
+static void
+ngx_http_zip_write_handler(ngx_http_request_t *r)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+    ngx_http_zip_ctx_t        *ctx;
+    ngx_connection_t          *c;
+    ngx_event_t               *wev;
+    ngx_int_t                  rc;
+
+    c = r->connection;
+    wev = c->write;
+
+    if (wev->timedout) {
+        c->timedout = 1;
+        ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (wev->delayed) {
+        if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+            ngx_http_finalize_request(r, NGX_ERROR);
+        }
+        return;
+    }
+
+    rc = ngx_http_output_filter(r, NULL);
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_zip_module);
+
+    if (rc == NGX_ERROR || (ctx->trailer_sent && ctx->output.in == NULL)) {
+        r->read_event_handler = ctx->read_event_handler;
+        r->write_event_handler = ctx->write_event_handler;
+        ngx_http_finalize_request(r, rc);
+        return;
+    }
+
+    /* the client is slow, or the archive waits for something else */
+    if (c->buffered) {
+        ngx_add_timer(wev, clcf->send_timeout);
+
+        if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+            ngx_http_finalize_request(r, NGX_ERROR);
+        }
+
+    } else if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
+}
+
+/*
+ * Whatever made the file list may finalize the request with NGX_OK rather
+ * than with what the body filter returned, and that takes the writer off a
+ * held archive once its output is flushed. The archive is still held by its
+ * own reference then, and the writer is put back before the main request
+ * is woken up for it.
+ */
+static void
+ngx_http_zip_rehold(ngx_http_request_t *r)
+{
+    ngx_http_zip_ctx_t *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_zip_module);
+
+    if (ctx == NULL || !ctx->held || !r->done
+            || r->write_event_handler == ngx_http_zip_write_handler) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "mod_zip: the request was finalized, carrying on with the archive");
+
+    r->read_event_handler = ngx_http_test_reading;
+    r->write_event_handler = ngx_http_zip_write_handler;
 }
 
-// a dummy cleanup function, used to find sr_ctx for internal redirects
+// used to find sr_ctx for internal redirects, and stops what is left of it
 static void
 ngx_http_zip_sr_ctx_cleanup(void *data)
 {
-    (void)data;
+    ngx_http_zip_sr_ctx_t *sr_ctx = data;
+
+    if (sr_ctx->hedge.timer_set) {
+        ngx_del_timer(&sr_ctx->hedge);
+    }
+
+    if (sr_ctx->fetch_zone) {
+        ngx_http_zip_fetch_zone_release(sr_ctx->fetch_zone);
+        sr_ctx->fetch_zone = NULL;
+    }
 }
 
 // taken from modules/ngx_http_realip_module.c
@@ -364,425 +890,3136 @@ ngx_http_zip_get_module_sr_ctx(ngx_http_request_t *r)
 static ngx_int_t
 ngx_http_zip_subrequest_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 {
+    ngx_http_zip_ctx_t    *ctx;
     ngx_http_zip_sr_ctx_t *sr_ctx;
+    ngx_http_zip_file_t   *file;
+    ngx_chain_t           *cl;
+#if (NGX_THREADS)
+    ngx_http_zip_loc_conf_t *zlcf;
+#endif
 
     sr_ctx = ngx_http_zip_get_module_sr_ctx(r);
 
-    if (in && sr_ctx && sr_ctx->requesting_file->missing_crc32) {
-        uint32_t old_crc32 = sr_ctx->requesting_file->crc32;
+    if (in == NULL || sr_ctx == NULL) {
+        return ngx_http_next_body_filter(r, in);
+    }
 
-        ngx_http_zip_subrequest_update_crc32(in, sr_ctx->requesting_file);
+    ctx = ngx_http_get_module_ctx(r->main, ngx_http_zip_module);
 
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
-                "mod_zip: updated CRC-32 (%08Xd -> %08Xd)", old_crc32, sr_ctx->requesting_file->crc32);
+    if (sr_ctx->page && ctx) {
+        return ngx_http_zip_page_body_filter(r, ctx, in);
+    }
 
-        (void)old_crc32;
+    /* neither a size probe nor the CRC-32 report has a body to speak of */
+    if (sr_ctx->probe || sr_ctx->report) {
+        for (cl = in; cl; cl = cl->next) {
+            cl->buf->pos = cl->buf->last;
+        }
+        return NGX_OK;
     }
-    
-    return ngx_http_next_body_filter(r, in);
-}
 
-static ngx_int_t
-ngx_http_zip_subrequest_update_crc32(ngx_chain_t *in, 
-        ngx_http_zip_file_t *file)
-{
-    ngx_chain_t *cl;
-    size_t       len;
-    u_char      *p;
+    /* the body of a hedged fetch that lost the race goes nowhere */
+    if (sr_ctx->entry->hedged && sr_ctx->entry->winner != sr_ctx) {
+        for (cl = in; cl; cl = cl->next) {
+            cl->buf->pos = cl->buf->last;
+            if (cl->buf->in_file) {
+                cl->buf->file_pos = cl->buf->file_last;
+            }
+        }
+        return NGX_OK;
+    }
 
-    if (file == NULL) 
-        return NGX_ERROR;
+    for (cl = in; cl; cl = cl->next) {
+        sr_ctx->received += ngx_buf_size(cl->buf);
+    }
 
-    for (cl = in; cl != NULL; cl = cl->next) {
-        p = cl->buf->pos;
-        len = cl->buf->last - p;
+    file = sr_ctx->requesting_file;
 
-        ngx_crc32_update(&file->crc32, p, len);
+    /* the size of an entry streamed in is what it turns out to be */
+    if (file->is_stream) {
+        for (cl = in; cl; cl = cl->next) {
+            file->size += ngx_buf_size(cl->buf);
+        }
     }
 
-    return NGX_OK;
-}
+    /* several entries in one response, see ngx_http_zip_split_bundle() */
+    if (sr_ctx->bundle_last) {
+        if ((in = ngx_http_zip_split_bundle(r, ctx, sr_ctx, in)) == NULL) {
+            return NGX_ERROR;
+        }
 
-static ngx_int_t
-ngx_http_zip_subrequest_done(ngx_http_request_t *r, void *data, ngx_int_t rc)
-{
-    ngx_http_zip_piece_t *piece = (ngx_http_zip_piece_t *)data;
+    } else if (file->missing_crc32 && !file->crc32_final) {
+        uint32_t old_crc32 = file->crc32;
 
-    (void)piece; /* fix warning */
+#if (NGX_THREADS)
+        zlcf = ngx_http_get_module_loc_conf(r->main, ngx_http_zip_module);
 
-    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-            "mod_zip: subrequest for \"%V?%V\" done, result %d",
-            &piece->file->uri, &piece->file->args, rc);
+        if (ctx && zlcf->thread_pool) {
+            return ngx_http_zip_crc32_thread(r, ctx, sr_ctx, in);
+        }
+#endif
 
-    return rc;
+        ngx_http_zip_subrequest_update_crc32(in, file);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
+                "mod_zip: updated CRC-32 (%08Xd -> %08Xd)", old_crc32, file->crc32);
+
+        (void)old_crc32;
+
+        for (cl = in; cl; cl = cl->next) {
+            if (cl->buf->last_in_chain) {
+                ngx_http_zip_subrequest_finalize_crc32(r, file);
+                break;
+            }
+        }
+    }
+
+    return ngx_http_zip_subrequest_output(r, ctx, sr_ctx, in);
 }
 
+/* Pass on the body of a file, once it is done with */
 static ngx_int_t
-ngx_http_zip_main_request_body_filter(ngx_http_request_t *r,
-        ngx_chain_t *in)
+ngx_http_zip_subrequest_output(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
+        ngx_http_zip_sr_ctx_t *sr_ctx, ngx_chain_t *in)
 {
-    ngx_http_zip_ctx_t   *ctx;
-    ngx_chain_t          *chain_link;
-    int rc;
-
-    ctx = ngx_http_get_module_ctx(r, ngx_http_zip_module);
+    ngx_chain_t *cl;
 
-    if (ctx == NULL || ctx->trailer_sent) {
-        return ngx_http_next_body_filter(r, in);
+    if (ctx && ctx->out_of_order) {
+        return ngx_http_zip_subrequest_save_body(r, ctx, sr_ctx->entry, in);
     }
 
-    if (ctx->abort) {
-        return NGX_ERROR;
+    /* output of a subrequest that is not active yet is held by postpone */
+    if (r != r->connection->data) {
+        for (cl = in; ctx && cl; cl = cl->next) {
+            if (ngx_buf_in_memory(cl->buf)) {
+                sr_ctx->buffered += cl->buf->last - cl->buf->pos;
+                ctx->subrequests_buffered += cl->buf->last - cl->buf->pos;
+            }
+        }
     }
+    
+    return ngx_http_next_body_filter(r, in);
+}
 
-    if (r->headers_out.status != NGX_HTTP_OK &&
-            r->headers_out.status != NGX_HTTP_PARTIAL_CONTENT) {
-        return ngx_http_next_body_filter(r, in);
-    }
+#if (NGX_THREADS)
 
-    if (ctx->parsed) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                "mod_zip: restarting subrequests");
-        return ngx_http_zip_send_pieces(r, ctx);
+/*
+ * With zip_thread_pool, the body of a file without a CRC-32 is hashed in the
+ * thread pool when at least zip_thread_chunk of it comes at once, in chunks
+ * of that size side by side, so that a large file does not hold up the
+ * other connections of the worker. The body is held back until the CRC-32s
+ * of its chunks are folded in, and what comes meanwhile waits behind it.
+ */
+static ngx_int_t
+ngx_http_zip_crc32_thread(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
+        ngx_http_zip_sr_ctx_t *sr_ctx, ngx_chain_t *in)
+{
+    ngx_http_zip_loc_conf_t    *zlcf;
+    ngx_http_zip_crc32_task_t  *t, **tl;
+    ngx_thread_task_t          *task;
+    ngx_chain_t                *cl;
+    u_char                     *pos;
+    size_t                      size, len, left, n;
+
+    if (sr_ctx->crc32_tasks_n) {
+        if (ngx_chain_add_copy(r->pool, &sr_ctx->crc32_waiting, in) != NGX_OK) {
+            return NGX_ERROR;
+        }
+        return ngx_http_zip_crc32_hold(r, sr_ctx, in);
     }
 
-    if (in == NULL) {
-        return ngx_http_next_body_filter(r, NULL);
-    }
+    zlcf = ngx_http_get_module_loc_conf(r->main, ngx_http_zip_module);
 
-    rc = ngx_http_zip_copy_unparsed_request(r, in, ctx);
-    if (rc == NGX_AGAIN) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                "mod_zip: not the last buf");
-        return ngx_http_zip_discard_chain(r, in);
-    } else if (rc == NGX_ERROR) {
-        return NGX_ERROR;
+    size = 0;
+    for (cl = in; cl; cl = cl->next) {
+        size += cl->buf->last - cl->buf->pos;
     }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-            "mod_zip: about to parse list");
+    if (size < zlcf->thread_chunk) {
+        ngx_http_zip_subrequest_update_crc32(in, sr_ctx->requesting_file);
 
-    if (ngx_http_zip_parse_request(ctx) == NGX_ERROR) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                "mod_zip: invalid file list from upstream");
-        return NGX_ERROR;
+        for (cl = in; cl; cl = cl->next) {
+            if (cl->buf->last_in_chain) {
+                ngx_http_zip_subrequest_finalize_crc32(r, sr_ctx->requesting_file);
+                break;
+            }
+        }
+
+        return ngx_http_zip_subrequest_output(r, ctx, sr_ctx, in);
     }
 
-    if (ngx_http_zip_generate_pieces(r, ctx) == NGX_ERROR) {
+    if (ngx_chain_add_copy(r->pool, &sr_ctx->crc32_hashing, in) != NGX_OK) {
         return NGX_ERROR;
     }
 
-    if (!r->header_sent) {
-        rc = ngx_http_zip_set_headers(r, ctx);
-        if (rc == NGX_ERROR) {
+    cl = sr_ctx->crc32_hashing;
+    pos = cl->buf->pos;
+    tl = &sr_ctx->crc32_tasks;
+
+    for ( /* void */ ; size; size -= len) {
+        len = ngx_min(size, zlcf->thread_chunk);
+
+        task = ngx_thread_task_alloc(r->pool, sizeof(ngx_http_zip_crc32_task_t));
+        if (task == NULL) {
             return NGX_ERROR;
         }
-        if (rc == NGX_HTTP_RANGE_NOT_SATISFIABLE) {
-            return ngx_http_special_response_handler(r, rc);
-        }
-        rc = ngx_http_send_header(r);
-        if (rc != NGX_OK &&
-            !(rc == NGX_AGAIN && r->connection->buffered)) {
-            return rc;
+
+        while (pos == cl->buf->last) {
+            cl = cl->next;
+            pos = cl->buf->pos;
         }
-    }
 
-    chain_link = ngx_chain_last_link(in);
-    chain_link->buf->last_buf = 0;
+        t = task->ctx;
+        t->in = cl;
+        t->pos = pos;
+        t->len = len;
+        t->request = r;
+        t->sr_ctx = sr_ctx;
 
-    if (ngx_http_zip_strip_range_header(r) == NGX_ERROR) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                "mod_zip: failed to strip Range: header from request");
-        return NGX_ERROR;
-    }
+        *tl = t;
+        tl = &t->next;
 
-    return ngx_http_zip_send_pieces(r, ctx);
-}
+        for (left = len; left; left -= n) {
+            if (pos == cl->buf->last) {
+                cl = cl->next;
+                pos = cl->buf->pos;
+            }
+            n = ngx_min(left, (size_t) (cl->buf->last - pos));
+            pos += n;
+        }
 
+        task->handler = ngx_http_zip_crc32_thread_handler;
+        task->event.data = t;
+        task->event.handler = ngx_http_zip_crc32_thread_event_handler;
+
+        if (ngx_thread_task_post(zlcf->thread_pool, task) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (sr_ctx->crc32_tasks_n++ == 0) {
+            r->main->blocked++;
+        }
+    }
+
+    return ngx_http_zip_crc32_hold(r, sr_ctx, in);
+}
+
+/*
+ * The end of the body is held back with the rest, and the subrequest must
+ * not be finalized before it is passed on: it is held like a request that
+ * reads its body, with r->main->count++ and NGX_DONE, and finalized by
+ * ngx_http_zip_crc32_thread_event_handler() once it is hashed.
+ */
+static ngx_int_t
+ngx_http_zip_crc32_hold(ngx_http_request_t *r, ngx_http_zip_sr_ctx_t *sr_ctx,
+        ngx_chain_t *in)
+{
+    ngx_chain_t *cl;
+
+    for (cl = in; cl && !cl->buf->last_in_chain; cl = cl->next) { /* void */ }
+
+    if (cl == NULL || sr_ctx->crc32_held) {
+        return NGX_OK;
+    }
+
+    sr_ctx->crc32_held = 1;
+    r->main->count++;
+
+    /* what was handling the response is done with it until then */
+    sr_ctx->read_event_handler = r->read_event_handler;
+    sr_ctx->write_event_handler = r->write_event_handler;
+
+    r->read_event_handler = ngx_http_block_reading;
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    return NGX_DONE;
+}
+
+static void
+ngx_http_zip_crc32_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_http_zip_crc32_task_t *t = data;
+    ngx_chain_t               *cl;
+    u_char                    *pos;
+    size_t                     left, n;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
+            "mod_zip: hashing %uz bytes in a thread", t->len);
+
+    t->crc32 = 0;
+
+    cl = t->in;
+    pos = t->pos;
+
+    for (left = t->len; ; cl = cl->next, pos = cl->buf->pos) {
+        n = ngx_min(left, (size_t) (cl->buf->last - pos));
+        ngx_http_zip_crc32_update(&t->crc32, pos, n);
+
+        left -= n;
+        if (left == 0) {
+            break;
+        }
+    }
+}
+
+/* The last chunk hashed: the held body goes on, and what waited after it */
+static void
+ngx_http_zip_crc32_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_http_zip_crc32_task_t *t = ev->data;
+    ngx_http_zip_sr_ctx_t     *sr_ctx = t->sr_ctx;
+    ngx_http_request_t        *r = t->request;
+    ngx_connection_t          *c = r->connection;
+    ngx_http_zip_ctx_t        *ctx;
+    ngx_http_zip_file_t       *file;
+    ngx_chain_t               *in, *cl;
+    ngx_int_t                  rc = NGX_OK;
+
+    ngx_http_set_log_request(c->log, r);
+
+    if (--sr_ctx->crc32_tasks_n) {
+        return;
+    }
+
+    r->main->blocked--;
+
+    ctx = ngx_http_get_module_ctx(r->main, ngx_http_zip_module);
+    file = sr_ctx->requesting_file;
+
+    for (t = sr_ctx->crc32_tasks; t; t = t->next) {
+        file->crc32 = ngx_http_zip_crc32_combine(file->crc32, t->crc32, t->len);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+            "mod_zip: CRC-32 hashed in threads (%08Xd)", file->crc32);
+
+    in = sr_ctx->crc32_hashing;
+    sr_ctx->crc32_hashing = NULL;
+    sr_ctx->crc32_tasks = NULL;
+
+    for (cl = in; cl; cl = cl->next) {
+        if (cl->buf->last_in_chain) {
+            ngx_http_zip_subrequest_finalize_crc32(r, file);
+            break;
+        }
+    }
+
+    if (ctx == NULL || ctx->abort || c->error) {
+        for (cl = in; cl; cl = cl->next) {
+            cl->buf->pos = cl->buf->last;
+        }
+        sr_ctx->crc32_waiting = NULL;
+
+    } else {
+        rc = ngx_http_zip_subrequest_output(r, ctx, sr_ctx, in);
+
+        if (rc != NGX_ERROR && sr_ctx->crc32_waiting) {
+            in = sr_ctx->crc32_waiting;
+            sr_ctx->crc32_waiting = NULL;
+
+            rc = ngx_http_zip_crc32_thread(r, ctx, sr_ctx, in);
+        }
+    }
+
+    if (rc == NGX_ERROR) {
+        ngx_http_finalize_request(r, NGX_ERROR);
+
+    } else if (sr_ctx->crc32_held) {
+        if (sr_ctx->crc32_tasks_n == 0) {
+            sr_ctx->crc32_held = 0;
+            r->read_event_handler = sr_ctx->read_event_handler;
+            r->write_event_handler = sr_ctx->write_event_handler;
+            ngx_http_finalize_request(r, rc);
+        }
+
+    } else {
+        /* not held, what handles the response is still in place */
+        r->write_event_handler(r);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+#endif
+
+static ngx_int_t
+ngx_http_zip_subrequest_update_crc32(ngx_chain_t *in, 
+        ngx_http_zip_file_t *file)
+{
+    ngx_chain_t *cl;
+    size_t       len;
+    u_char      *p;
+
+    if (file == NULL) 
+        return NGX_ERROR;
+
+    for (cl = in; cl != NULL; cl = cl->next) {
+        p = cl->buf->pos;
+        len = cl->buf->last - p;
+
+        ngx_http_zip_crc32_update(&file->crc32, p, len);
+    }
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_zip_subrequest_finalize_crc32(ngx_http_request_t *r,
+        ngx_http_zip_file_t *file)
+{
+    ngx_http_zip_loc_conf_t *zlcf;
+    ngx_http_zip_sr_ctx_t   *sr_ctx;
+    ngx_http_zip_ctx_t      *ctx;
+    uint32_t old_crc32 = file->crc32;
+
+    ngx_crc32_final(file->crc32);
+    file->crc32_final = 1;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "mod_zip: finalized CRC-32 (%08Xd -> %08Xd)", old_crc32, file->crc32);
+    (void)old_crc32;
+
+    // for the next archives with the file, see zip_crc_cache
+    sr_ctx = ngx_http_zip_get_module_sr_ctx(r);
+    ctx = ngx_http_get_module_ctx(r->main, ngx_http_zip_module);
+    zlcf = ngx_http_get_module_loc_conf(r->main, ngx_http_zip_module);
+
+    if (sr_ctx && ctx && zlcf->crc_cache && sr_ctx->validator.len && !file->is_stream
+            && ngx_http_zip_crc_cache_store(r, ctx, zlcf->crc_cache, file,
+                &sr_ctx->validator) != NGX_OK) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                "mod_zip: could not cache the CRC-32 of \"%V\"", &file->filename);
+    }
+
+    // the data descriptor may have been sent ahead of the body
+    if (file->data_descriptor) {
+        ngx_http_zip_write_data_descriptor(file->data_descriptor, file);
+        file->data_descriptor = NULL;
+    }
+}
+
+static ngx_int_t
+ngx_http_zip_subrequest_done(ngx_http_request_t *r, void *data, ngx_int_t rc)
+{
+    ngx_http_zip_sr_ctx_t *sr_ctx = data;
+    ngx_http_zip_sr_ctx_t *head;
+    ngx_http_zip_ctx_t    *ctx;
+    ngx_queue_t           *q;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "mod_zip: subrequest for \"%V?%V\" done, result %d",
+            &r->uri, &r->args, rc);
+
+    ctx = ngx_http_get_module_ctx(r->main, ngx_http_zip_module);
+    if (ctx == NULL) {
+        return rc;
+    }
+
+    ngx_http_zip_rehold(r->main);
+
+    /* an attempt that was resumed by another one */
+    if (r != sr_ctx->sr) {
+        return rc;
+    }
+
+    if (!sr_ctx->done && (rc == NGX_ERROR || rc >= NGX_HTTP_SPECIAL_RESPONSE)) {
+        rc = ngx_http_zip_retry_fetch(r, ctx, sr_ctx, rc);
+        if (rc == NGX_OK) {
+            return NGX_OK;
+        }
+    }
+
+    if (sr_ctx->entry->hedged && sr_ctx->entry->winner != sr_ctx) {
+        return ngx_http_zip_hedge_done(r, ctx, sr_ctx, rc);
+    }
+
+    /* called on every attempt to finalize, the body must have passed us */
+    if (sr_ctx->done || r->buffered) {
+        return rc;
+    }
+
+    ngx_http_zip_fetch_done(ctx, sr_ctx);
+
+    /* e.g. empty files have no body to see the end of */
+    if (sr_ctx->requesting_file->missing_crc32 && !sr_ctx->requesting_file->crc32_final) {
+        ngx_str_null(&sr_ctx->validator); // nor is a body cut short worth caching
+        ngx_http_zip_subrequest_finalize_crc32(r, sr_ctx->requesting_file);
+    }
+
+    if (ctx->out_of_order) {
+        /* background subrequests do not wake up their parent */
+        if (ngx_http_post_request(r->main, NULL) != NGX_OK) {
+            return NGX_ERROR;
+        }
+        return ngx_http_zip_send_next_pieces(r, ctx, rc);
+    }
+
+    /*
+     * Output is flushed in order up to the first unfinished subrequest,
+     * so what it has buffered no longer counts against the budget
+     */
+    while (!ngx_queue_empty(&ctx->subrequests)) {
+        q = ngx_queue_head(&ctx->subrequests);
+        head = ngx_queue_data(q, ngx_http_zip_sr_ctx_t, queue);
+
+        ctx->subrequests_buffered -= head->buffered;
+        head->buffered = 0;
+
+        if (!head->done) {
+            break;
+        }
+
+        ngx_queue_remove(q);
+    }
+
+    return ngx_http_zip_send_next_pieces(r, ctx, rc);
+}
+
+/*
+ * A fetch of a hedged piece that is not the one kept: it either lost the
+ * race, or failed before anything answered. In the latter case the next
+ * mirror is tried at once, and the archive is only given up on when no
+ * location is left. Either way its own failure must not end the archive.
+ */
+static ngx_int_t
+ngx_http_zip_hedge_done(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
+        ngx_http_zip_sr_ctx_t *sr_ctx, ngx_int_t rc)
+{
+    ngx_http_zip_sr_ctx_t *entry = sr_ctx->entry;
+
+    if (rc == NGX_ERROR || rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+        rc = NGX_OK;
+    }
+
+    if (sr_ctx->done || r->buffered) {
+        return rc;
+    }
+
+    ngx_http_zip_fetch_done(ctx, sr_ctx);
+
+    if (entry->winner == NULL && entry->fetches == 0) {
+        if (entry->mirrors_i == entry->requesting_file->mirrors->nelts) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "mod_zip: no location of \"%V\" answered, aborting...",
+                    &entry->requesting_file->filename);
+            ctx->abort = 1;
+            return NGX_ERROR;
+        }
+
+        if (ngx_http_zip_send_hedge(r->main, ctx, entry) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (ngx_http_post_request(r->main, NULL) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return ngx_http_zip_send_next_pieces(r, ctx, rc);
+}
+
+/*
+ * A fetch that failed or stalled is resumed from where it stopped with a
+ * Range subrequest, up to zip_subrequest_retries times. The bytes it got
+ * were passed on already, and a CRC-32 being computed carries on over the
+ * rest. In order, the new subrequest is a child of the failed one, so its
+ * output takes the failed one's place in the archive.
+ */
+static ngx_int_t
+ngx_http_zip_retry_fetch(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
+        ngx_http_zip_sr_ctx_t *sr_ctx, ngx_int_t rc)
+{
+    ngx_http_zip_loc_conf_t *zlcf;
+
+    zlcf = ngx_http_get_module_loc_conf(r->main, ngx_http_zip_module);
+
+    /* a hedged piece falls back on its other locations instead */
+    if (sr_ctx->entry->hedged && sr_ctx->entry->winner != sr_ctx) {
+        return rc;
+    }
+
+    if (ctx->abort || r->connection->error
+            || sr_ctx->retries == zlcf->subrequest_retries
+            || sr_ctx->crc32_tasks_n
+            || sr_ctx->received >= sr_ctx->fetch_range.end - sr_ctx->fetch_range.start) {
+        return rc;
+    }
+
+    sr_ctx->retries++;
+
+    ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+            "mod_zip: subrequest for \"%V?%V\" failed after %O bytes, "
+            "retry %ui of %ui", sr_ctx->uri, sr_ctx->args, sr_ctx->received,
+            sr_ctx->retries, zlcf->subrequest_retries);
+
+    if (ngx_http_zip_start_fetch(r->main, ctx->out_of_order ? r->main : r,
+                ctx, sr_ctx) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_zip_fetch_done(ngx_http_zip_ctx_t *ctx, ngx_http_zip_sr_ctx_t *sr_ctx)
+{
+    sr_ctx->done = 1;
+    sr_ctx->entry->fetches--;
+    ctx->subrequests_n--;
+
+    if (sr_ctx->fetch_zone) {
+        ngx_http_zip_fetch_zone_release(sr_ctx->fetch_zone);
+        sr_ctx->fetch_zone = NULL;
+    }
+}
+
+/*
+ * Carry on with the archive as soon as a subrequest is finished, rather
+ * than when the main request is woken up: with many small files that
+ * round trip is most of the time spent on each one.
+ */
+static ngx_int_t
+ngx_http_zip_send_next_pieces(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
+        ngx_int_t rc)
+{
+    if (rc == NGX_ERROR || rc >= NGX_HTTP_SPECIAL_RESPONSE
+            || ctx->abort || !ctx->parsed || ctx->trailer_sent) {
+        return rc;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "mod_zip: sending next pieces from subrequest");
+
+    if (ngx_http_zip_send_pieces(r->main, ctx) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    return rc;
+}
+
+/*
+ * Out of order, a subrequest's body is kept until the subrequest is
+ * complete: in buffers of its own up to zip_subrequest_buffer_size, and
+ * in a temporary file after that.
+ */
+static ngx_int_t
+ngx_http_zip_subrequest_save_body(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
+        ngx_http_zip_sr_ctx_t *sr_ctx, ngx_chain_t *in)
+{
+    ngx_http_zip_loc_conf_t  *zlcf;
+    ngx_chain_t              *cl, *ln;
+    ngx_buf_t                *b, *last;
+    size_t                    n;
+
+    zlcf = ngx_http_get_module_loc_conf(r->main, ngx_http_zip_module);
+
+    for (cl = in; cl; cl = cl->next) {
+        b = cl->buf;
+
+        while (b->pos < b->last) {
+            last = sr_ctx->last_out ? sr_ctx->last_out->buf : NULL;
+
+            if (last == NULL || last->in_file || last->last == last->end) {
+                if (ctx->free) {
+                    ln = ctx->free;
+                    ctx->free = ln->next;
+
+                } else if (ctx->subrequests_buffered + (off_t) ngx_pagesize
+                           <= (off_t) zlcf->subrequest_buffer_size)
+                {
+                    ln = ngx_alloc_chain_link(r->pool);
+                    if (ln == NULL) {
+                        return NGX_ERROR;
+                    }
+
+                    ln->buf = ngx_create_temp_buf(r->pool, ngx_pagesize);
+                    if (ln->buf == NULL) {
+                        return NGX_ERROR;
+                    }
+
+                    ln->buf->tag = (ngx_buf_tag_t) &ngx_http_zip_module;
+                    ctx->subrequests_buffered += ngx_pagesize;
+
+                } else {
+                    if (ngx_http_zip_save_body_to_temp_file(r, ctx, sr_ctx, b) != NGX_OK) {
+                        return NGX_ERROR;
+                    }
+                    continue;
+                }
+
+                ln->next = NULL;
+
+                if (sr_ctx->last_out) {
+                    sr_ctx->last_out->next = ln;
+                } else {
+                    sr_ctx->out = ln;
+                }
+                sr_ctx->last_out = ln;
+                last = ln->buf;
+            }
+
+            n = ngx_min(b->last - b->pos, last->end - last->last);
+            last->last = ngx_cpymem(last->last, b->pos, n);
+            b->pos += n;
+        }
+
+        if (b->in_file) {
+            b->file_pos = b->file_last;
+        }
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_zip_save_body_to_temp_file(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
+        ngx_http_zip_sr_ctx_t *sr_ctx, ngx_buf_t *b)
+{
+    ngx_http_zip_loc_conf_t  *zlcf;
+    ngx_temp_file_t          *tf;
+    ngx_chain_t               out, *ln;
+    ngx_buf_t                *last;
+    off_t                     start;
+
+    tf = ctx->temp_file;
+
+    if (tf == NULL) {
+        zlcf = ngx_http_get_module_loc_conf(r->main, ngx_http_zip_module);
+
+        tf = ngx_pcalloc(r->pool, sizeof(ngx_temp_file_t));
+        if (tf == NULL) {
+            return NGX_ERROR;
+        }
+
+        tf->file.fd = NGX_INVALID_FILE;
+        tf->file.log = r->connection->log;
+        tf->path = zlcf->temp_path;
+        tf->pool = r->pool;
+        tf->warn = "archive entries are buffered to a temporary file";
+        tf->clean = 1;
+
+        ctx->temp_file = tf;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    start = tf->offset;
+
+    if (ngx_write_chain_to_temp_file(tf, &out) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    b->pos = b->last;
+
+    last = sr_ctx->last_out ? sr_ctx->last_out->buf : NULL;
+
+    if (last && last->in_file && last->file_last == start) {
+        last->file_last = tf->offset;
+        return NGX_OK;
+    }
+
+    if ((ln = ngx_alloc_chain_link(r->pool)) == NULL
+        || (ln->buf = ngx_calloc_buf(r->pool)) == NULL)
+        return NGX_ERROR;
+
+    ln->buf->in_file = 1;
+    ln->buf->file = &tf->file;
+    ln->buf->file_pos = start;
+    ln->buf->file_last = tf->offset;
+    ln->next = NULL;
+
+    if (sr_ctx->last_out) {
+        sr_ctx->last_out->next = ln;
+    } else {
+        sr_ctx->out = ln;
+    }
+    sr_ctx->last_out = ln;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_zip_main_request_body_filter(ngx_http_request_t *r,
+        ngx_chain_t *in)
+{
+    ngx_http_zip_ctx_t   *ctx;
+    ngx_chain_t          *chain_link;
+    int rc;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_zip_module);
+
+    if (ctx == NULL || (ctx->trailer_sent && !ctx->out_of_order)) {
+        return ngx_http_next_body_filter(r, in);
+    }
+
+    if (ctx->abort) {
+        return NGX_ERROR;
+    }
+
+    if (r->headers_out.status != NGX_HTTP_OK &&
+            r->headers_out.status != NGX_HTTP_PARTIAL_CONTENT) {
+        return ngx_http_next_body_filter(r, in);
+    }
+
+    /* a paged list may be complete before the headers are sent */
+    if (ctx->parsed && r->header_sent) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                "mod_zip: restarting subrequests");
+        return ngx_http_zip_send_pieces(r, ctx);
+    }
+
+    if (in == NULL && !ctx->parsed) {
+        if (ctx->progressive && r->header_sent) {
+            return ngx_http_zip_send_pieces(r, ctx);
+        }
+        return ngx_http_next_body_filter(r, NULL);
+    }
+
+    /* the list is parsed as it arrives, and the buffers handed back */
+    for (chain_link = in; chain_link; chain_link = chain_link->next) {
+        /* or taken from a file on disk instead of the body */
+        if (ctx->manifest_file.len) {
+            chain_link->buf->pos = chain_link->buf->last;
+
+            if (chain_link->buf->last_buf
+                    && ngx_http_zip_read_manifest_file(r, ctx) == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+        }
+
+        if (chain_link->buf->last_buf && ctx->next_page.len) {
+            chain_link->buf->last_buf = 0;
+
+            if (ngx_http_zip_parse_list(r, ctx, chain_link->buf) == NGX_ERROR
+                    || ngx_http_zip_end_page(r, ctx) == NGX_ERROR
+                    || ngx_http_zip_fetch_page(r, ctx) == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+            continue;
+        }
+
+        if (ngx_http_zip_parse_list(r, ctx, chain_link->buf) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (!ctx->parsed && !ctx->progressive) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                "mod_zip: not the last buf");
+        return ngx_http_zip_discard_chain(r, in);
+    }
+
+    /* the sizes left out of the list are asked for before it is laid out */
+    if (ctx->sizes_missing && !ctx->progressive) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                "mod_zip: waiting for %ui sizes", ctx->sizes_missing);
+        if (ngx_http_zip_probe_sizes(r, ctx) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+        if (in) {
+            chain_link = ngx_chain_last_link(in);
+            chain_link->buf->last_buf = 0;
+        }
+        return ngx_http_zip_discard_chain(r, in);
+    }
+
+    /* progressive archives map their files as they go */
+    if (!ctx->progressive && ngx_http_zip_generate_pieces(r, ctx) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (!r->header_sent) {
+        rc = ngx_http_zip_admit(r, ctx);
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+        if (rc == NGX_DECLINED) {
+            r->headers_out.status = NGX_HTTP_SERVICE_UNAVAILABLE;
+            if (ngx_http_zip_add_retry_after(r, ctx->admission_zone->retry_after)
+                    == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+            return ngx_http_special_response_handler(r, NGX_HTTP_SERVICE_UNAVAILABLE);
+        }
+        rc = ngx_http_zip_set_headers(r, ctx);
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+        if (rc == NGX_HTTP_RANGE_NOT_SATISFIABLE) {
+            return ngx_http_special_response_handler(r, rc);
+        }
+        rc = ngx_http_send_header(r);
+        if (rc != NGX_OK &&
+            !(rc == NGX_AGAIN && r->connection->buffered)) {
+            return rc;
+        }
+
+        if (ngx_http_zip_strip_range_header(r) == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "mod_zip: failed to strip Range: header from request");
+            return NGX_ERROR;
+        }
+    }
+
+    if (!ctx->parsed) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                "mod_zip: not the last buf, sending what is known");
+        if (ngx_http_zip_send_pieces(r, ctx) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+        return ngx_http_zip_discard_chain(r, in);
+    }
+
+    if (in) {
+        chain_link = ngx_chain_last_link(in);
+        chain_link->buf->last_buf = 0;
+    }
+
+    return ngx_http_zip_send_pieces(r, ctx);
+}
+
+static ngx_int_t
+ngx_http_zip_parse_list(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
+        ngx_buf_t *buf)
+{
+    ngx_int_t rc;
+
+    ctx->manifest_size += buf->last - buf->pos;
+
+    if (buf->last > buf->pos) {
+        ctx->line_open = buf->last[-1] != LF;
+    }
+
+    rc = ctx->binary ? ngx_http_zip_parse_binary_request(ctx, buf)
+                     : ngx_http_zip_parse_request(ctx, buf);
+    if (rc == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "mod_zip: invalid file list from upstream");
+    }
+
+    return rc;
+}
+
+// the value of an upstream header, kept null-terminated
+static ngx_int_t
+ngx_http_zip_copy_header(ngx_http_request_t *r, ngx_str_t *name, ngx_str_t *value)
+{
+    ngx_http_variable_value_t  vv;
+    ngx_int_t                  rc;
+
+    ngx_str_null(value);
+
+    if (r->upstream) {
+        rc = ngx_http_zip_variable_unknown_header(r, &vv, name,
+                &r->upstream->headers_in.headers.part, sizeof("upstream_http_") - 1);
+    } else {
+        rc = ngx_http_zip_variable_unknown_header(r, &vv, name,
+                &r->headers_out.headers.part, sizeof("upstream_http_") - 1);
+    }
+
+    if (rc != NGX_OK || vv.not_found || vv.len == 0) {
+        return NGX_OK;
+    }
+
+    if ((value->data = ngx_pnalloc(r->pool, vv.len + 1)) == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(value->data, vv.data, vv.len);
+    value->data[vv.len] = '\0';
+    value->len = vv.len;
+
+    return NGX_OK;
+}
+
+/*
+ * A list that is the same for every download can be kept on disk, and the
+ * upstream only names it in X-Archive-Manifest-File. The name is relative
+ * to zip_manifest_root, and must not leave it: without the directive, or
+ * with an absolute name or a ".." in it, the download fails. The file is
+ * opened through the open file cache of the location, and parsed a chunk
+ * at a time like a body.
+ */
+static ngx_int_t
+ngx_http_zip_read_manifest_file(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+    ngx_http_zip_loc_conf_t   *zlcf;
+    ngx_open_file_info_t       of;
+    ngx_file_t                 file;
+    ngx_buf_t                  b;
+    ngx_str_t                  path;
+    u_char                    *buf, *p, *last, *segment;
+    ssize_t                    n;
+    off_t                      offset;
+
+    zlcf = ngx_http_get_module_loc_conf(r, ngx_http_zip_module);
+
+    if (zlcf->manifest_root.len == 0) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "mod_zip: X-Archive-Manifest-File \"%V\" without zip_manifest_root",
+                &ctx->manifest_file);
+        return NGX_ERROR;
+    }
+
+    p = ctx->manifest_file.data;
+    last = p + ctx->manifest_file.len;
+
+    if (p == last || *p == '/') {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "mod_zip: X-Archive-Manifest-File \"%V\" is not a relative name",
+                &ctx->manifest_file);
+        return NGX_ERROR;
+    }
+
+    for (segment = p; p <= last; p++) {
+        if (p < last && *p != '/') {
+            continue;
+        }
+        if (p - segment == 2 && segment[0] == '.' && segment[1] == '.') {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "mod_zip: X-Archive-Manifest-File \"%V\" leaves zip_manifest_root",
+                    &ctx->manifest_file);
+            return NGX_ERROR;
+        }
+        segment = p + 1;
+    }
+
+    path.len = zlcf->manifest_root.len + 1 + ctx->manifest_file.len;
+    if ((path.data = ngx_pnalloc(r->pool, path.len + 1)) == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(path.data, zlcf->manifest_root.data, zlcf->manifest_root.len);
+    *p++ = '/';
+    ngx_cpystrn(p, ctx->manifest_file.data, ctx->manifest_file.len + 1);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "mod_zip: file list from \"%V\"", &path);
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    ngx_memzero(&of, sizeof(ngx_open_file_info_t));
+
+    of.read_ahead = clcf->read_ahead;
+    of.directio = NGX_MAX_OFF_T_VALUE;
+    of.valid = clcf->open_file_cache_valid;
+    of.min_uses = clcf->open_file_cache_min_uses;
+    of.errors = clcf->open_file_cache_errors;
+    of.events = clcf->open_file_cache_events;
+
+    if (ngx_http_set_disable_symlinks(r, clcf, &path, &of) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_open_cached_file(clcf->open_file_cache, &path, &of, r->pool)
+            != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, of.err,
+                "mod_zip: %s \"%V\" failed", of.failed, &path);
+        return NGX_ERROR;
+    }
+
+    if (!of.is_file) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "mod_zip: \"%V\" is not a file", &path);
+        return NGX_ERROR;
+    }
+
+    if ((buf = ngx_pnalloc(r->pool, NGX_HTTP_ZIP_MANIFEST_FILE_BUFFER)) == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.fd = of.fd;
+    file.name = path;
+    file.log = r->connection->log;
+
+    for (offset = 0; offset < of.size; offset += n) {
+        n = ngx_read_file(&file, buf,
+                (size_t) ngx_min(of.size - offset, NGX_HTTP_ZIP_MANIFEST_FILE_BUFFER),
+                offset);
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+        if (n == 0) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                    "mod_zip: \"%V\" was truncated", &path);
+            return NGX_ERROR;
+        }
+
+        ngx_memzero(&b, sizeof(ngx_buf_t));
+        b.pos = buf;
+        b.last = buf + n;
+
+        if (ngx_http_zip_parse_list(r, ctx, &b) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * A list too long for one response is sent in pages: each response names
+ * the next one in an X-Archive-Files-Next header, and the last one has
+ * none. The pages are fetched one after the other with subrequests, and
+ * parsed as they arrive like the first one.
+ */
+static ngx_int_t
+ngx_http_zip_fetch_page(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx)
+{
+    ngx_http_zip_sr_ctx_t      *sr_ctx;
+    ngx_http_post_subrequest_t *ps;
+    ngx_http_request_t         *sr;
+    ngx_pool_cleanup_t         *cln;
+    u_char                     *q;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "mod_zip: next page of the file list at \"%V\"", &ctx->next_page);
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_zip_sr_ctx_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+    sr_ctx = cln->data;
+
+    ngx_memzero(sr_ctx, sizeof(ngx_http_zip_sr_ctx_t));
+
+    cln->handler = ngx_http_zip_sr_ctx_cleanup;
+
+    sr_ctx->page = 1;
+    sr_ctx->entry = sr_ctx;
+
+    sr_ctx->expanded_uri = ctx->next_page;
+    q = ngx_strlchr(ctx->next_page.data, ctx->next_page.data + ctx->next_page.len, '?');
+    if (q) {
+        sr_ctx->expanded_uri.len = q - ctx->next_page.data;
+        sr_ctx->expanded_args.data = q + 1;
+        sr_ctx->expanded_args.len = ctx->next_page.data + ctx->next_page.len - q - 1;
+    }
+    sr_ctx->uri = &sr_ctx->expanded_uri;
+    sr_ctx->args = &sr_ctx->expanded_args;
+
+    ngx_str_null(&ctx->next_page);
+
+    ps = ngx_palloc(r->pool, sizeof(ngx_http_post_subrequest_t));
+    if (ps == NULL) {
+        return NGX_ERROR;
+    }
+
+    ps->handler = ngx_http_zip_page_done;
+    ps->data = sr_ctx;
+
+    if (ngx_http_subrequest(r, sr_ctx->uri, sr_ctx->args, &sr, ps,
+                ctx->out_of_order ? NGX_HTTP_SUBREQUEST_BACKGROUND : NGX_HTTP_SUBREQUEST_WAITED)
+            == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    sr->filter_need_in_memory = 1;
+
+    ngx_http_set_ctx(sr, sr_ctx, ngx_http_zip_module);
+
+    sr_ctx->sr = sr;
+
+    return NGX_OK;
+}
+
+/* pages follow on from each other as if a line break came in between */
+static ngx_int_t
+ngx_http_zip_end_page(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx)
+{
+    ngx_buf_t  b;
+    u_char     lf = LF;
+
+    ngx_memzero(&b, sizeof(ngx_buf_t));
+
+    b.pos = &lf;
+    b.last = ctx->line_open && !ctx->binary ? &lf + 1 : &lf;
+    b.last_buf = ctx->next_page.len == 0;
+
+    return ngx_http_zip_parse_list(r, ctx, &b);
+}
+
+static ngx_int_t
+ngx_http_zip_page_body_filter(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
+        ngx_chain_t *in)
+{
+    ngx_chain_t *cl;
+
+    for (cl = in; cl; cl = cl->next) {
+        if (ngx_http_zip_parse_list(r, ctx, cl->buf) == NGX_ERROR) {
+            ctx->abort = 1;
+            return NGX_ERROR;
+        }
+        cl->buf->pos = cl->buf->last;
+    }
+
+    /* a progressive archive carries on with the files of the page */
+    if (ctx->progressive && r->main->header_sent) {
+        if (ngx_http_post_request(r->main, NULL) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_zip_page_done(ngx_http_request_t *r, void *data, ngx_int_t rc)
+{
+    ngx_http_zip_sr_ctx_t *sr_ctx = data;
+    ngx_http_zip_ctx_t    *ctx;
+
+    ctx = ngx_http_get_module_ctx(r->main, ngx_http_zip_module);
+    if (ctx == NULL) {
+        return rc;
+    }
+
+    ngx_http_zip_rehold(r->main);
+
+    /* called on every attempt to finalize, the body must have passed us */
+    if (sr_ctx->done || r->buffered) {
+        return rc;
+    }
+
+    sr_ctx->done = 1;
+
+    if (rc == NGX_ERROR || rc >= NGX_HTTP_SPECIAL_RESPONSE || ctx->abort) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "mod_zip: page \"%V?%V\" of the file list failed, aborting...",
+                sr_ctx->uri, sr_ctx->args);
+        ctx->abort = 1;
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_zip_end_page(r, ctx) == NGX_ERROR) {
+        ctx->abort = 1;
+        return NGX_ERROR;
+    }
+
+    if (ctx->next_page.len) {
+        return ngx_http_zip_fetch_page(r->main, ctx) == NGX_OK ? rc : NGX_ERROR;
+    }
+
+    /* background subrequests do not wake up their parent */
+    if (ctx->out_of_order && ngx_http_post_request(r->main, NULL) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return rc;
+}
+
+/*
+ * Files listed with "-" for a size are asked for it with HEAD subrequests,
+ * as many at a time as zip_subrequest_concurrency, and the archive is laid
+ * out once all have answered with a Content-Length. Progressive archives
+ * ask as the files come in, and map them up to the first one not sized yet.
+ */
+static ngx_int_t
+ngx_http_zip_probe_sizes(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx)
+{
+    ngx_http_zip_loc_conf_t *zlcf;
+    ngx_http_zip_file_t     *file;
+
+    zlcf = ngx_http_get_module_loc_conf(r, ngx_http_zip_module);
+
+    if (ctx->probe_part == NULL) {
+        ctx->probe_part = &ctx->files.part;
+    }
+
+    while (ctx->sizes_missing > ctx->probes_n
+            && ctx->probes_n < zlcf->subrequest_concurrency) {
+        if (ctx->probe_i >= ctx->probe_part->nelts) {
+            if (ctx->probe_part->next == NULL) {
+                break;
+            }
+            ctx->probe_part = ctx->probe_part->next;
+            ctx->probe_i = 0;
+            continue;
+        }
+
+        file = &((ngx_http_zip_file_t *) ctx->probe_part->elts)[ctx->probe_i];
+
+        // the last file of a list still coming in may not be complete
+        if (!ctx->parsed && file->index + 1 == ctx->files_n) {
+            break;
+        }
+
+        ctx->probe_i++;
+
+        if (file->missing_size && ngx_http_zip_probe_size(r, ctx, file) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_zip_probe_size(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
+        ngx_http_zip_file_t *file)
+{
+    ngx_http_zip_sr_ctx_t      *sr_ctx;
+    ngx_http_post_subrequest_t *ps;
+    ngx_http_request_t         *sr;
+    ngx_pool_cleanup_t         *cln;
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_zip_sr_ctx_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+    sr_ctx = cln->data;
+
+    ngx_memzero(sr_ctx, sizeof(ngx_http_zip_sr_ctx_t));
+
+    cln->handler = ngx_http_zip_sr_ctx_cleanup;
+
+    sr_ctx->probe = 1;
+    sr_ctx->entry = sr_ctx;
+    sr_ctx->requesting_file = file;
+
+    if (ngx_http_zip_set_location(r, ctx, sr_ctx, &file->uri, &file->args) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "mod_zip: asking \"%V?%V\" for its size", sr_ctx->uri, sr_ctx->args);
+
+    ps = ngx_palloc(r->pool, sizeof(ngx_http_post_subrequest_t));
+    if (ps == NULL) {
+        return NGX_ERROR;
+    }
+
+    ps->handler = ngx_http_zip_probe_done;
+    ps->data = sr_ctx;
+
+    if (ngx_http_subrequest(r, sr_ctx->uri, sr_ctx->args, &sr, ps,
+                ctx->out_of_order ? NGX_HTTP_SUBREQUEST_BACKGROUND : NGX_HTTP_SUBREQUEST_WAITED)
+            == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    sr->method = NGX_HTTP_HEAD;
+    sr->method_name = ngx_http_zip_head_method;
+    sr->header_only = 1;
+
+    if (ngx_http_zip_init_subrequest_headers(r, ctx, sr, NULL, NULL, NULL) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_set_ctx(sr, sr_ctx, ngx_http_zip_module);
+
+    sr_ctx->sr = sr;
+
+    ctx->probes_n++;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_zip_probe_done(ngx_http_request_t *r, void *data, ngx_int_t rc)
+{
+    ngx_http_zip_sr_ctx_t *sr_ctx = data;
+    ngx_http_zip_ctx_t    *ctx;
+
+    ctx = ngx_http_get_module_ctx(r->main, ngx_http_zip_module);
+    if (ctx == NULL) {
+        return rc;
+    }
+
+    ngx_http_zip_rehold(r->main);
+
+    /* called on every attempt to finalize */
+    if (sr_ctx->done || r->buffered) {
+        return rc;
+    }
+
+    sr_ctx->done = 1;
+    ctx->probes_n--;
+
+    if (rc == NGX_ERROR || rc >= NGX_HTTP_SPECIAL_RESPONSE || ctx->abort
+            || sr_ctx->requesting_file->missing_size) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                "mod_zip: size of \"%V\" not found at \"%V?%V\", aborting...",
+                &sr_ctx->requesting_file->filename, sr_ctx->uri, sr_ctx->args);
+        ctx->abort = 1;
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "mod_zip: \"%V\" is %O bytes",
+            &sr_ctx->requesting_file->filename, sr_ctx->requesting_file->size);
+
+    ctx->sizes_missing--;
+
+    if (ngx_http_zip_probe_sizes(r->main, ctx) == NGX_ERROR) {
+        ctx->abort = 1;
+        return NGX_ERROR;
+    }
+
+    /* background subrequests do not wake up their parent */
+    if (ctx->out_of_order && ngx_http_post_request(r->main, NULL) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return rc;
+}
+
+/*
+ * POST the CRC-32s computed for the archive to zip_crc_report, one
+ * "<location> <size> <crc>" line per file, so that the next file list can
+ * give them. It runs in the background: the archive does not wait for it.
+ */
+static ngx_int_t
+ngx_http_zip_report_crc32(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx)
+{
+    ngx_http_zip_loc_conf_t    *zlcf;
+    ngx_http_zip_sr_ctx_t      *sr_ctx;
+    ngx_http_zip_file_t        *file;
+    ngx_http_request_body_t    *rb;
+    ngx_http_request_t         *sr;
+    ngx_pool_cleanup_t         *cln;
+    ngx_list_part_t            *part;
+    ngx_table_elt_t            *h;
+    ngx_chain_t                *cl;
+    ngx_buf_t                  *b;
+    ngx_uint_t                  i, n = 0;
+    size_t                      len = 0;
+
+    zlcf = ngx_http_get_module_loc_conf(r, ngx_http_zip_module);
+
+    if (zlcf->crc_report.len == 0 || !ctx->missing_crc32) {
+        return NGX_OK;
+    }
+
+    for (part = &ctx->files.part; part; part = part->next) {
+        for (i = 0; i < part->nelts; i++) {
+            file = &((ngx_http_zip_file_t *)part->elts)[i];
+            if (!file->missing_crc32 || !file->crc32_final)
+                continue;
+
+            len += file->uri.len + 2 * ngx_escape_uri(NULL, file->uri.data,
+                        file->uri.len, NGX_ESCAPE_URI)
+                + sizeof("? + 00000000\n") + file->args.len + 2 * NGX_OFF_T_LEN;
+            n++;
+        }
+    }
+
+    if (n == 0) {
+        return NGX_OK;
+    }
+
+    if ((b = ngx_create_temp_buf(r->pool, len)) == NULL
+            || (cl = ngx_alloc_chain_link(r->pool)) == NULL
+            || (rb = ngx_pcalloc(r->pool, sizeof(ngx_http_request_body_t))) == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (part = &ctx->files.part; part; part = part->next) {
+        for (i = 0; i < part->nelts; i++) {
+            file = &((ngx_http_zip_file_t *)part->elts)[i];
+            if (!file->missing_crc32 || !file->crc32_final)
+                continue;
+
+            // spaces separate the fields, as in the file list
+            b->last = (u_char *) ngx_escape_uri(b->last, file->uri.data,
+                    file->uri.len, NGX_ESCAPE_URI);
+            if (file->args.len) {
+                *b->last++ = '?';
+                b->last = ngx_cpymem(b->last, file->args.data, file->args.len);
+            }
+            if (file->is_slice) {
+                b->last = ngx_sprintf(b->last, " %O+%O %08xD\n",
+                        file->source_offset, file->size, file->crc32);
+            } else {
+                b->last = ngx_sprintf(b->last, " %O %08xD\n", file->size, file->crc32);
+            }
+        }
+    }
+
+    b->last_buf = 1;
+    b->last_in_chain = 1;
+
+    cl->buf = b;
+    cl->next = NULL;
+    rb->bufs = cl;
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_zip_sr_ctx_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+    sr_ctx = cln->data;
+
+    ngx_memzero(sr_ctx, sizeof(ngx_http_zip_sr_ctx_t));
+
+    cln->handler = ngx_http_zip_sr_ctx_cleanup;
+
+    sr_ctx->report = 1;
+    sr_ctx->entry = sr_ctx;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "mod_zip: reporting %ui CRC-32s to \"%V\"", n, &zlcf->crc_report);
+
+    if (ngx_http_subrequest(r, &zlcf->crc_report, NULL, &sr, NULL,
+                NGX_HTTP_SUBREQUEST_BACKGROUND) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    sr->method = NGX_HTTP_POST;
+    sr->method_name = ngx_http_zip_post_method;
+    sr->header_only = 1;
+    sr->request_body = rb;
+
+    if (ngx_http_zip_init_subrequest_headers(r, ctx, sr, NULL, NULL, NULL) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if ((h = ngx_list_push(&sr->headers_in.headers)) == NULL) {
+        return NGX_ERROR;
+    }
+
+    h->hash = 1;
+    ngx_str_set(&h->key, "Content-Type");
+    ngx_str_set(&h->value, "text/plain");
+
+    sr->headers_in.content_type = h;
+    sr->headers_in.content_length_n = b->last - b->pos;
+
+    ngx_http_set_ctx(sr, sr_ctx, ngx_http_zip_module);
+
+    sr_ctx->sr = sr;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_zip_send_header_piece(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
+        ngx_http_zip_piece_t *piece, ngx_http_zip_range_t *range)
+{
+    ngx_chain_t *link;
+    if ((link = ngx_http_zip_file_header_chain_link(r, ctx, piece, range)) == NULL)
+        return NGX_ERROR;
+    return ngx_http_next_body_filter(r, link);
+}
+
+static ngx_int_t
+ngx_http_zip_send_file_piece(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
+        ngx_http_zip_piece_t *piece, ngx_http_zip_range_t *req_range)
+{
+    ngx_http_zip_sr_ctx_t *sr_ctx;
+    ngx_http_zip_loc_conf_t *zlcf;
+
+    sr_ctx = ngx_http_zip_fetch_piece(r, ctx, piece, req_range,
+            &piece->file->uri, &piece->file->args);
+    if (sr_ctx == NULL) {
+        if (ctx->fetch_zone) {
+            ngx_http_zip_fetch_zone_release(ctx->fetch_zone);
+        }
+        return NGX_ERROR;
+    }
+
+    sr_ctx->entry = sr_ctx;
+    sr_ctx->fetches = 1;
+    sr_ctx->fetch_zone = ctx->fetch_zone; // acquired by the caller
+
+    /* the entries fetched along are written by the subrequest, up to the last data */
+    if (sr_ctx->bundle_last) {
+        ctx->pieces_i = sr_ctx->bundle_last - ctx->pieces + 1;
+    }
+
+    ngx_queue_insert_tail(&ctx->subrequests, &sr_ctx->queue);
+
+    zlcf = ngx_http_get_module_loc_conf(r, ngx_http_zip_module);
+
+    /* the background subrequests of out of order archives can be raced */
+    if (ctx->out_of_order && piece->file->mirrors && zlcf->hedge_delay) {
+        sr_ctx->hedged = 1;
+        sr_ctx->request = r;
+        sr_ctx->hedge.handler = ngx_http_zip_hedge_handler;
+        sr_ctx->hedge.data = sr_ctx;
+        sr_ctx->hedge.log = r->connection->log;
+
+        ngx_add_timer(&sr_ctx->hedge, zlcf->hedge_delay);
+    }
+
+    return NGX_OK;
+}
+
+/* Start fetching a file piece from the given location */
+static ngx_http_zip_sr_ctx_t *
+ngx_http_zip_fetch_piece(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
+        ngx_http_zip_piece_t *piece, ngx_http_zip_range_t *req_range,
+        ngx_str_t *uri, ngx_str_t *args)
+{
+    ngx_http_zip_sr_ctx_t *sr_ctx;
+    ngx_pool_cleanup_t *cln;
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_zip_sr_ctx_t));
+    if (cln == NULL) {
+        return NULL;
+    }
+    sr_ctx = cln->data;
+    if (sr_ctx == NULL) {
+        return NULL;
+    }
+
+    ngx_memzero(sr_ctx, sizeof(ngx_http_zip_sr_ctx_t));
+
+    cln->handler = ngx_http_zip_sr_ctx_cleanup;
+
+    sr_ctx->requesting_file = piece->file;
+    sr_ctx->requesting_piece = piece;
+
+    if (ngx_http_zip_set_location(r, ctx, sr_ctx, uri, args) != NGX_OK) {
+        return NULL;
+    }
+
+    // a file piece is all of the file's data, or one segment of it
+    sr_ctx->fetch_range.start = piece->range.start;
+    sr_ctx->fetch_range.end = piece->range.end;
+    if (req_range) {
+        sr_ctx->fetch_range.start = ngx_max(sr_ctx->fetch_range.start, req_range->start);
+        sr_ctx->fetch_range.end = ngx_min(sr_ctx->fetch_range.end, req_range->end);
+    }
+
+    // or of the entries that follow it in the same location
+    sr_ctx->bundle_size = piece->file->size;
+    if (req_range == NULL && !ctx->out_of_order) {
+        sr_ctx->bundle_last = ngx_http_zip_bundle_end(r, ctx, piece);
+
+        if (sr_ctx->bundle_last == piece) {
+            sr_ctx->bundle_last = NULL;
+        } else {
+            sr_ctx->bundle_piece = piece;
+            sr_ctx->bundle_left = piece->file->size;
+            sr_ctx->bundle_size = sr_ctx->bundle_last->file->source_offset
+                + sr_ctx->bundle_last->file->size - piece->file->source_offset;
+            sr_ctx->fetch_range.end = sr_ctx->fetch_range.start + sr_ctx->bundle_size;
+        }
+    }
+
+    if (ngx_http_zip_start_fetch(r, r, ctx, sr_ctx) != NGX_OK) {
+        return NULL;
+    }
+
+    ctx->subrequests_n++;
+
+    return sr_ctx;
+}
+
+// a slice fetched whole, from a location of its own
+static ngx_uint_t
+ngx_http_zip_bundle_member(ngx_http_zip_piece_t *piece)
+{
+    ngx_http_zip_file_t *file = piece->file;
+
+    return piece->type == zip_file_piece && file->is_slice && !file->is_inline
+        && file->mirrors == NULL && file->size > 0
+        && piece->range.end - piece->range.start == file->size;
+}
+
+/*
+ * The last of the entries from a piece on that can be fetched with one
+ * subrequest: slices one after the other in the same location, up to
+ * zip_bundle_size of data. The piece itself when there is none.
+ */
+static ngx_http_zip_piece_t *
+ngx_http_zip_bundle_end(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
+        ngx_http_zip_piece_t *piece)
+{
+    ngx_http_zip_loc_conf_t *zlcf;
+    ngx_http_zip_piece_t *last, *next;
+    ngx_http_zip_file_t *file;
+    off_t size;
+
+    zlcf = ngx_http_get_module_loc_conf(r, ngx_http_zip_module);
+
+    if (zlcf->bundle_size == 0 || !ngx_http_zip_bundle_member(piece)) {
+        return piece;
+    }
+
+    last = piece;
+    size = piece->file->size;
+
+    for (next = piece + 1; next < ctx->pieces + ctx->pieces_n; next++) {
+        if (next->type == zip_header_piece || next->type == zip_trailer_piece) {
+            continue;
+        }
+
+        file = next->file;
+
+        if (!ngx_http_zip_bundle_member(next)
+                || file->source_offset != last->file->source_offset + last->file->size
+                || size + file->size > zlcf->bundle_size
+                || file->uri.len != piece->file->uri.len
+                || file->args.len != piece->file->args.len
+                || ngx_strncmp(file->uri.data, piece->file->uri.data, file->uri.len)
+                || ngx_strncmp(file->args.data, piece->file->args.data, file->args.len)) {
+            break;
+        }
+
+        size += file->size;
+        last = next;
+    }
+
+    return last;
+}
+
+/*
+ * Cut the body of a bundle at the ends of its entries, and put in what goes
+ * between them in the archive: the data descriptor of the entry that ends,
+ * if it has one, and the local file header of the next. A buffer that runs
+ * on past an end is sent after the copy of its front, so that it is not
+ * taken for sent and reused before that is.
+ */
+static ngx_chain_t *
+ngx_http_zip_split_bundle(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
+        ngx_http_zip_sr_ctx_t *sr_ctx, ngx_chain_t *in)
+{
+    ngx_chain_t *out, **ll, *cl;
+    ngx_http_zip_piece_t *piece;
+    ngx_http_zip_file_t *file;
+    ngx_buf_t *b, *data;
+    ngx_uint_t linked;
+    off_t size;
+
+    out = NULL;
+    ll = &out;
+
+    for (cl = in; cl; cl = cl->next) {
+        b = cl->buf;
+        linked = 0;
+
+        while (!linked && sr_ctx->bundle_piece != sr_ctx->bundle_last
+                && b->last - b->pos >= sr_ctx->bundle_left) {
+            piece = sr_ctx->bundle_piece;
+            file = piece->file;
+
+            if (b->last - b->pos == sr_ctx->bundle_left) {
+                data = b;
+                linked = 1;
+            } else {
+                if ((data = ngx_calloc_buf(r->pool)) == NULL) {
+                    return NULL;
+                }
+                data->memory = 1;
+                data->pos = b->pos;
+                data->last = b->pos + sr_ctx->bundle_left;
+                b->pos = data->last;
+            }
+
+            if ((*ll = ngx_alloc_chain_link(r->pool)) == NULL) {
+                return NULL;
+            }
+            (*ll)->buf = data;
+            ll = &(*ll)->next;
+
+            if (file->missing_crc32) {
+                ngx_http_zip_crc32_update(&file->crc32, data->pos, data->last - data->pos);
+                ngx_http_zip_subrequest_finalize_crc32(r, file);
+
+                if ((*ll = ngx_http_zip_data_descriptor_chain_link(r, piece + 1, NULL)) == NULL) {
+                    return NULL;
+                }
+                ll = &(*ll)->next;
+            }
+
+            while ((++piece)->type != zip_file_piece)
+                ;
+
+            if ((*ll = ngx_http_zip_file_header_chain_link(r, ctx, piece - 1, NULL)) == NULL) {
+                return NULL;
+            }
+            ll = &(*ll)->next;
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                    "mod_zip: bundle goes on with \"%V\"", &piece->file->filename);
+
+            sr_ctx->bundle_piece = piece;
+            sr_ctx->bundle_left = piece->file->size;
+            sr_ctx->requesting_file = piece->file;
+        }
+
+        if (linked) {
+            continue;
+        }
+
+        file = sr_ctx->requesting_file;
+        size = b->last - b->pos;
+
+        if (file->missing_crc32 && !file->crc32_final) {
+            ngx_http_zip_crc32_update(&file->crc32, b->pos, size);
+            if (b->last_in_chain) {
+                ngx_http_zip_subrequest_finalize_crc32(r, file);
+            }
+        }
+        sr_ctx->bundle_left -= size;
+
+        if ((*ll = ngx_alloc_chain_link(r->pool)) == NULL) {
+            return NULL;
+        }
+        (*ll)->buf = b;
+        ll = &(*ll)->next;
+    }
+
+    *ll = NULL;
+
+    return out;
+}
+
+/*
+ * With X-Archive-Uri-Template, the location of a file in the list is an ID
+ * put in place of each "{id}" of the template, escaped in the arguments.
+ * Arguments of the file itself come after those of the template.
+ */
+static ngx_int_t
+ngx_http_zip_expand_template(ngx_pool_t *pool, ngx_str_t *template,
+        ngx_str_t *id, ngx_uint_t escape, ngx_str_t *tail, ngx_str_t *out)
+{
+    u_char *p, *next, *last, *dst;
+    size_t len, id_len;
+
+    last = template->data + template->len;
+
+    id_len = id->len;
+    if (escape) {
+        id_len += 2 * ngx_escape_uri(NULL, id->data, id->len, escape);
+    }
+
+    len = template->len;
+    for (p = template->data; (next = ngx_strnstr(p, "{id}", last - p)) != NULL;
+            p = next + sizeof("{id}") - 1) {
+        len = len - (sizeof("{id}") - 1) + id_len;
+    }
+    if (tail && tail->len) {
+        len += 1 + tail->len;
+    }
+
+    if ((out->data = ngx_pnalloc(pool, len)) == NULL) {
+        return NGX_ERROR;
+    }
+
+    dst = out->data;
+    for (p = template->data; (next = ngx_strnstr(p, "{id}", last - p)) != NULL;
+            p = next + sizeof("{id}") - 1) {
+        dst = ngx_cpymem(dst, p, next - p);
+        if (escape) {
+            dst = (u_char *) ngx_escape_uri(dst, id->data, id->len, escape);
+        } else {
+            dst = ngx_cpymem(dst, id->data, id->len);
+        }
+    }
+    dst = ngx_cpymem(dst, p, last - p);
+
+    if (tail && tail->len) {
+        if (dst != out->data) {
+            *dst++ = '&';
+        }
+        dst = ngx_cpymem(dst, tail->data, tail->len);
+    }
+
+    out->len = dst - out->data;
+
+    return NGX_OK;
+}
+
+/*
+ * The location of a fetch, through X-Archive-Uri-Template if there is one.
+ * The expanded location is only kept as long as the fetch.
+ */
+static ngx_int_t
+ngx_http_zip_set_location(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
+        ngx_http_zip_sr_ctx_t *sr_ctx, ngx_str_t *uri, ngx_str_t *args)
+{
+    sr_ctx->uri = uri;
+    sr_ctx->args = args;
+
+    if (ctx->uri_template.len) {
+        if (ngx_http_zip_expand_template(r->pool, &ctx->uri_template, uri, 0,
+                    NULL, &sr_ctx->expanded_uri) != NGX_OK
+                || ngx_http_zip_expand_template(r->pool, &ctx->args_template, uri,
+                    NGX_ESCAPE_ARGS, args, &sr_ctx->expanded_args) != NGX_OK) {
+            return NGX_ERROR;
+        }
+        sr_ctx->uri = &sr_ctx->expanded_uri;
+        sr_ctx->args = &sr_ctx->expanded_args;
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * Issue the subrequest of a fetch, for the part of its range that was not
+ * received yet. The parent is the main request, or the failed subrequest
+ * a resumed one takes the place of.
+ */
+static ngx_int_t
+ngx_http_zip_start_fetch(ngx_http_request_t *r, ngx_http_request_t *pr,
+        ngx_http_zip_ctx_t *ctx, ngx_http_zip_sr_ctx_t *sr_ctx)
+{
+    ngx_http_zip_piece_t *piece = sr_ctx->requesting_piece;
+    ngx_http_zip_piece_t *header_piece;
+    ngx_http_zip_range_t data_range, fetch_range;
+    ngx_http_request_t *sr;
+    ngx_http_post_subrequest_t *ps;
+    ngx_int_t rc;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "mod_zip: subrequest for \"%V?%V\"", sr_ctx->uri, sr_ctx->args);
+
+    ps = ngx_palloc(r->pool, sizeof(ngx_http_post_subrequest_t));
+    if (ps == NULL) {
+        return NGX_ERROR;
+    }
+
+    ps->handler = ngx_http_zip_subrequest_done;
+    ps->data = sr_ctx;
+
+    rc = ngx_http_subrequest(pr, sr_ctx->uri, sr_ctx->args, &sr, ps,
+            ctx->out_of_order ? NGX_HTTP_SUBREQUEST_BACKGROUND : NGX_HTTP_SUBREQUEST_WAITED);
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "mod_zip: subrequest for \"%V?%V\" initiated, result %d", 
+            sr_ctx->uri, sr_ctx->args, rc);
+
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    sr->allow_ranges = 1;
+    sr->subrequest_ranges = 1;
+    sr->single_range = 1;
+
+    for (header_piece = piece; header_piece->type != zip_header_piece; header_piece--)
+        ;
+
+    data_range.start = header_piece->range.end;
+    data_range.end = data_range.start + sr_ctx->bundle_size;
+
+    fetch_range.start = sr_ctx->fetch_range.start + sr_ctx->received;
+    fetch_range.end = sr_ctx->fetch_range.end;
+
+    rc = ngx_http_zip_init_subrequest_headers(r, ctx, sr, &data_range, &fetch_range,
+            piece->file);
+    if (sr->headers_in.range) {
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                "mod_zip: subrequest for \"%V?%V\" Range: %V", 
+                sr_ctx->uri, sr_ctx->args, &sr->headers_in.range->value);
+    }
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_set_ctx(r, ctx, ngx_http_zip_module);
+    ngx_http_set_ctx(sr, sr_ctx, ngx_http_zip_module);
+
+    sr_ctx->sr = sr;
+
+    return NGX_OK;
+}
+
+/*
+ * Fetch a hedged piece from its next mirror as well, with the same Range.
+ * Whichever location answers first is kept, see the subrequest header
+ * filter, and the other fetches are left to finish into the void.
+ */
+static ngx_int_t
+ngx_http_zip_send_hedge(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
+        ngx_http_zip_sr_ctx_t *entry)
+{
+    ngx_http_zip_loc_conf_t *zlcf;
+    ngx_http_zip_mirror_t *mirror;
+    ngx_http_zip_sr_ctx_t *sr_ctx;
+    ngx_array_t *mirrors = entry->requesting_file->mirrors;
+
+    mirror = &((ngx_http_zip_mirror_t *) mirrors->elts)[entry->mirrors_i++];
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "mod_zip: hedging \"%V\" with \"%V?%V\"",
+            &entry->requesting_file->filename, &mirror->uri, &mirror->args);
+
+    sr_ctx = ngx_http_zip_fetch_piece(r, ctx, entry->requesting_piece, NULL,
+            &mirror->uri, &mirror->args);
+    if (sr_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    sr_ctx->entry = entry;
+    entry->fetches++;
+
+    if (entry->mirrors_i < mirrors->nelts) {
+        zlcf = ngx_http_get_module_loc_conf(r, ngx_http_zip_module);
+        ngx_add_timer(&entry->hedge, zlcf->hedge_delay);
+    }
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_zip_hedge_handler(ngx_event_t *ev)
+{
+    ngx_http_zip_sr_ctx_t *entry = ev->data;
+    ngx_http_request_t    *r = entry->request;
+    ngx_connection_t      *c = r->connection;
+    ngx_http_zip_ctx_t    *ctx;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+            "mod_zip: no answer for \"%V\" yet", &entry->requesting_file->filename);
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_zip_module);
+
+    if (ctx && !ctx->abort && entry->winner == NULL
+            && ngx_http_zip_send_hedge(r, ctx, entry) != NGX_OK) {
+        ngx_http_finalize_request(r, NGX_ERROR);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+static ngx_int_t ngx_http_zip_send_directory_piece(ngx_http_request_t *r,
+        ngx_http_zip_ctx_t *ctx, ngx_http_zip_piece_t *piece, ngx_http_zip_range_t *req_range)
+{
+    // Directory has no data.
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_zip_send_inline_piece(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
+        ngx_http_zip_piece_t *piece, ngx_http_zip_range_t *req_range)
+{
+    ngx_chain_t *link;
+
+    if (piece->file->size == 0) {
+        return NGX_OK;
+    }
+
+    if ((link = ngx_http_zip_inline_chain_link(r, piece, req_range)) == NULL) {
+        return NGX_ERROR;
+    }
+    return ngx_http_next_body_filter(r, link);
+}
+
+static ngx_int_t
+ngx_http_zip_send_trailer_piece(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
+        ngx_http_zip_piece_t *piece, ngx_http_zip_range_t *req_range)
+{
+    ngx_chain_t *link;
+
+    if ((link = ngx_http_zip_data_descriptor_chain_link(r, piece, req_range)) == NULL) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "mod_zip: data descriptor failed");
+        return NGX_ERROR;
+    }
+    return ngx_http_next_body_filter(r, link);
+}
+
+static ngx_int_t
+ngx_http_zip_send_central_directory_piece(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
+        ngx_http_zip_piece_t *piece, ngx_http_zip_range_t *req_range)
+{
+    ngx_chain_t *link;
+
+    if ((link = ngx_http_zip_central_directory_chain_link(r, ctx, piece, req_range)) == NULL) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "mod_zip: CD piece failed");
+        return NGX_ERROR;
+    }
+    return ngx_http_next_body_filter(r, link);
+}
+
+static ngx_int_t
+ngx_http_zip_send_piece(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
+        ngx_http_zip_piece_t *piece, ngx_http_zip_range_t *req_range)
+{
+    ngx_int_t rc = NGX_ERROR;
+
+    if (piece->type == zip_header_piece) {
+        rc = ngx_http_zip_send_header_piece(r, ctx, piece, req_range);
+    } else if (piece->type == zip_file_piece && piece->file->is_inline) {
+        rc = ngx_http_zip_send_inline_piece(r, ctx, piece, req_range);
+    } else if (piece->type == zip_file_piece) {
+        rc = ngx_http_zip_send_file_piece(r, ctx, piece, req_range);
+    } else if (piece->type == zip_dir_piece) {
+        rc = ngx_http_zip_send_directory_piece(r, ctx, piece, req_range);
+    } else if (piece->type == zip_trailer_piece) {
+        rc = ngx_http_zip_send_trailer_piece(r, ctx, piece, req_range);
+    } else if (piece->type == zip_central_directory_piece) {
+        rc = ngx_http_zip_send_central_directory_piece(r, ctx, piece, req_range);
+    }
+
+    return rc;
+}
+
+static ngx_int_t
+ngx_http_zip_send_boundary(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
+        ngx_http_zip_range_t *range)
+{
+    ngx_chain_t *link;
+    ngx_buf_t   *b;
+
+    if (range->boundary_sent) 
+        return NGX_OK;
+
+    if ((link = ngx_alloc_chain_link(r->pool)) == NULL 
+        || (b = ngx_calloc_buf(r->pool)) == NULL) 
+        return NGX_ERROR;
+
+    b->memory = 1;
+    b->pos = range->boundary_header.data;
+    b->last = b->pos + range->boundary_header.len;
+
+    link->buf = b;
+    link->next = NULL;
+
+    range->boundary_sent = 1;
+    return ngx_http_next_body_filter(r, link);
+}
+
+static ngx_int_t
+ngx_http_zip_send_final_boundary(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx)
+{
+    size_t len;
+    ngx_chain_t *link;
+    ngx_buf_t   *b;
+
+    if ((link = ngx_alloc_chain_link(r->pool)) == NULL
+        || (b = ngx_calloc_buf(r->pool)) == NULL)
+        return NGX_ERROR;
+
+    len = sizeof(CRLF "--") - 1 + NGX_ATOMIC_T_LEN + sizeof("--" CRLF) - 1;
+
+    b->memory = 1;
+    if ((b->pos = ngx_palloc(r->pool, len)) == NULL) 
+        return NGX_ERROR;
+   
+    b->last = ngx_sprintf(b->pos, CRLF "--%0muA--" CRLF, ctx->boundary);
+
+    link->buf = b;
+    link->next = NULL;
+
+    return ngx_http_next_body_filter(r, link);
+}
+
+/*
+ * Up to zip_subrequest_concurrency file pieces are fetched at once, and
+ * postpone keeps their output in archive order. The central directory
+ * waits for the CRC-32's that are still being computed.
+ */
+static ngx_int_t
+ngx_http_zip_can_send_piece(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
+        ngx_http_zip_piece_t *piece)
+{
+    ngx_http_zip_loc_conf_t  *zlcf;
+    ngx_uint_t                limit;
+
+    if (piece->type == zip_central_directory_piece) {
+        return ctx->subrequests_n == 0 || !ctx->missing_crc32;
+    }
+
+    if (piece->type != zip_file_piece || piece->file->is_inline) {
+        return 1;
+    }
+
+    if (ctx->subrequests_n) {
+        zlcf = ngx_http_get_module_loc_conf(r, ngx_http_zip_module);
+        limit = zlcf->subrequest_concurrency;
+
+        /* the segments of a large file are fetched side by side */
+        if (piece->range.end - piece->range.start < piece->file->size) {
+            limit = ngx_max(limit, zlcf->segments);
+        }
+
+        if (ctx->subrequests_n >= limit
+                || ctx->subrequests_buffered >= (off_t) zlcf->subrequest_buffer_size) {
+            return 0;
+        }
+    }
+
+    /* takes one of the fetches of the zone, if any */
+    return ngx_http_zip_fetch_zone_acquire(r, ctx);
+}
+
+/*
+ * The fetches of all archives that share a zip_fetch_zone are limited
+ * together, in all workers. An archive that finds the zone full waits in
+ * line behind the others of its worker: it is woken up when a fetch of
+ * the worker is done, and polls for those done by other workers.
+ */
 static ngx_int_t
-ngx_http_zip_send_header_piece(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
-        ngx_http_zip_piece_t *piece, ngx_http_zip_range_t *range)
+ngx_http_zip_fetch_zone_acquire(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx)
 {
-    ngx_chain_t *link;
-    if ((link = ngx_http_zip_file_header_chain_link(r, ctx, piece, range)) == NULL)
+    ngx_http_zip_fetch_zone_t *zone = ctx->fetch_zone;
+    ngx_atomic_uint_t          n;
+
+    if (zone == NULL) {
+        return 1;
+    }
+
+    if (ctx->fetch_waiting
+            ? ngx_queue_head(&zone->waiting) != &ctx->fetch_queue
+            : !ngx_queue_empty(&zone->waiting)) {
+        goto wait;
+    }
+
+    do {
+        n = zone->sh->fetches;
+        if (n >= zone->limit) {
+            goto wait;
+        }
+    } while (!ngx_atomic_cmp_set(&zone->sh->fetches, n, n + 1));
+
+    if (ctx->fetch_waiting) {
+        ngx_queue_remove(&ctx->fetch_queue);
+        ctx->fetch_waiting = 0;
+
+        if (ctx->fetch_wait.timer_set) {
+            ngx_del_timer(&ctx->fetch_wait);
+        }
+
+        ngx_http_zip_fetch_zone_wake_next(zone);
+    }
+
+    return 1;
+
+wait:
+
+    if (!ctx->fetch_waiting) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                "mod_zip: waiting for the fetch zone");
+
+        ngx_queue_insert_tail(&zone->waiting, &ctx->fetch_queue);
+        ctx->fetch_waiting = 1;
+    }
+
+    if (!ctx->fetch_wait.timer_set) {
+        ngx_add_timer(&ctx->fetch_wait, NGX_HTTP_ZIP_FETCH_ZONE_POLL);
+    }
+
+    return 0;
+}
+
+static void
+ngx_http_zip_fetch_zone_release(ngx_http_zip_fetch_zone_t *zone)
+{
+    (void) ngx_atomic_fetch_add(&zone->sh->fetches, -1);
+
+    ngx_http_zip_fetch_zone_wake_next(zone);
+}
+
+static void
+ngx_http_zip_fetch_zone_wake_next(ngx_http_zip_fetch_zone_t *zone)
+{
+    ngx_http_zip_ctx_t *ctx;
+
+    if (ngx_queue_empty(&zone->waiting) || zone->sh->fetches >= zone->limit) {
+        return;
+    }
+
+    ctx = ngx_queue_data(ngx_queue_head(&zone->waiting), ngx_http_zip_ctx_t, fetch_queue);
+
+    if (!ctx->fetch_wait.posted) {
+        ngx_post_event(&ctx->fetch_wait, &ngx_posted_events);
+    }
+}
+
+static void
+ngx_http_zip_fetch_zone_wake(ngx_event_t *ev)
+{
+    ngx_http_request_t *r = ev->data;
+    ngx_connection_t   *c = r->connection;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+            "mod_zip: woken up for the fetch zone");
+
+    /* the archive is carried on by the main request's writer */
+    ngx_http_zip_rehold(r);
+
+    if (ngx_http_post_request(r, NULL) != NGX_OK) {
+        ngx_http_finalize_request(r, NGX_ERROR);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+static void
+ngx_http_zip_fetch_zone_cleanup(void *data)
+{
+    ngx_http_zip_ctx_t *ctx = data;
+
+    if (ctx->fetch_wait.timer_set) {
+        ngx_del_timer(&ctx->fetch_wait);
+    }
+
+    if (ctx->fetch_wait.posted) {
+        ngx_delete_posted_event(&ctx->fetch_wait);
+    }
+
+    if (ctx->fetch_waiting) {
+        ngx_queue_remove(&ctx->fetch_queue);
+        ctx->fetch_waiting = 0;
+
+        ngx_http_zip_fetch_zone_wake_next(ctx->fetch_zone);
+    }
+}
+
+/*
+ * Archives that share a zip_admission_zone are turned away while the
+ * ones being sent would, with this one, need more memory or send more
+ * bytes than the zone allows. The memory is that of the file list and
+ * of the bodies held back for concurrency, ordering or checksums. An
+ * archive too big for the zone on its own is still let in when no other
+ * is being sent, or it would never be.
+ */
+static ngx_int_t
+ngx_http_zip_admit(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx)
+{
+    ngx_http_zip_admission_zone_t *zone;
+    ngx_http_zip_admission_sh_t   *sh;
+    ngx_http_zip_loc_conf_t       *zlcf;
+    ngx_pool_cleanup_t            *cln;
+    size_t                         memory;
+    ngx_int_t                      rc = NGX_OK;
+
+    zlcf = ngx_http_get_module_loc_conf(r, ngx_http_zip_module);
+    zone = zlcf->admission_zone;
+
+    if (zone == NULL || ctx->admission_zone) {
+        return NGX_OK;
+    }
+
+    memory = ctx->manifest_size
+        + ctx->files_n * sizeof(ngx_http_zip_file_t)
+        + ctx->pieces_n * sizeof(ngx_http_zip_piece_t);
+
+    if (ctx->missing_crc32 || ctx->out_of_order || zlcf->subrequest_concurrency > 1) {
+        memory += zlcf->subrequest_buffer_size;
+    }
+
+    if ((cln = ngx_pool_cleanup_add(r->pool, 0)) == NULL)
         return NGX_ERROR;
-    return ngx_http_next_body_filter(r, link);
+
+    sh = zone->sh;
+
+    ngx_shmtx_lock(&zone->shpool->mutex);
+
+    if (sh->archives
+            && ((zone->memory && sh->memory + memory > zone->memory)
+                || (zone->size && sh->size + ctx->archive_size > zone->size))) {
+        rc = NGX_DECLINED;
+
+    } else {
+        sh->memory += memory;
+        sh->size += ctx->archive_size;
+        sh->archives++;
+    }
+
+    ngx_shmtx_unlock(&zone->shpool->mutex);
+
+    /* the Retry-After of a turned away archive comes from the zone too */
+    ctx->admission_zone = zone;
+
+    if (rc == NGX_DECLINED) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                "mod_zip: turning away an archive of %O bytes, %uz bytes of memory",
+                ctx->archive_size, memory);
+        return NGX_DECLINED;
+    }
+
+    ctx->memory_cost = memory;
+    ctx->size_cost = ctx->archive_size; // not known yet, when progressive
+
+    cln->handler = ngx_http_zip_admission_cleanup;
+    cln->data = ctx;
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_zip_admission_cleanup(void *data)
+{
+    ngx_http_zip_ctx_t            *ctx = data;
+    ngx_http_zip_admission_zone_t *zone = ctx->admission_zone;
+
+    ngx_shmtx_lock(&zone->shpool->mutex);
+
+    zone->sh->memory -= ctx->memory_cost;
+    zone->sh->size -= ctx->size_cost;
+    zone->sh->archives--;
+
+    ngx_shmtx_unlock(&zone->shpool->mutex);
 }
 
+/* Initiate one or more subrequests for files to put in the ZIP archive */
 static ngx_int_t
-ngx_http_zip_send_file_piece(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
-        ngx_http_zip_piece_t *piece, ngx_http_zip_range_t *req_range)
+ngx_http_zip_send_pieces(ngx_http_request_t *r, 
+        ngx_http_zip_ctx_t *ctx)
+{
+    ngx_int_t             rc = NGX_OK, pieces_sent = 0;
+    ngx_http_zip_piece_t *piece;
+    ngx_http_zip_range_t *req_range = NULL;
+
+    if (ctx->out_of_order) {
+        return ngx_http_zip_send_pieces_out_of_order(r, ctx);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "mod_zip: sending pieces, starting with piece %d of total %d", ctx->pieces_i, ctx->pieces_n);
+
+    switch(ctx->ranges.nelts) {
+        case 0:
+            while (rc == NGX_OK && ctx->pieces_i < ctx->pieces_n) {
+                piece = &ctx->pieces[ctx->pieces_i];
+                if (!ngx_http_zip_can_send_piece(r, ctx, piece)) {
+                    rc = NGX_AGAIN;
+                    break;
+                }
+                ctx->pieces_i++;
+                pieces_sent++;
+                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "mod_zip: no ranges / sending piece type %d", piece->type);
+                rc = ngx_http_zip_send_piece(r, ctx, piece, NULL);
+                if (rc == NGX_AGAIN && r->connection->buffered && !r->postponed) {
+                    rc = NGX_OK;
+                }
+            }
+            break;
+        case 1:
+            req_range = &((ngx_http_zip_range_t *)ctx->ranges.elts)[0];
+            while (rc == NGX_OK && ctx->pieces_i < ctx->pieces_n) {
+                piece = &ctx->pieces[ctx->pieces_i];
+                if (!ngx_http_zip_ranges_intersect(&piece->range, req_range)) {
+                    ctx->pieces_i++;
+                    continue;
+                }
+                if (!ngx_http_zip_can_send_piece(r, ctx, piece)) {
+                    rc = NGX_AGAIN;
+                    break;
+                }
+                ctx->pieces_i++;
+                pieces_sent++;
+                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "mod_zip: 1 range / sending piece type %d", piece->type);
+                rc = ngx_http_zip_send_piece(r, ctx, piece, req_range);
+            }
+            break;
+        default:
+            while (rc == NGX_OK && ctx->ranges_i < ctx->ranges.nelts) {
+                req_range = &((ngx_http_zip_range_t *)ctx->ranges.elts)[ctx->ranges_i];
+                ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                        "mod_zip: sending range #%d start=%O end=%O (size %d)", 
+                        ctx->ranges_i, req_range->start, req_range->end, req_range->boundary_header.len);
+                rc = ngx_http_zip_send_boundary(r, ctx, req_range);
+                while (rc == NGX_OK && ctx->pieces_i < ctx->pieces_n) {
+                    piece = &ctx->pieces[ctx->pieces_i];
+                    if (!ngx_http_zip_ranges_intersect(&piece->range, req_range)) {
+                        ctx->pieces_i++;
+                        continue;
+                    }
+                    if (!ngx_http_zip_can_send_piece(r, ctx, piece)) {
+                        rc = NGX_AGAIN;
+                        break;
+                    }
+                    ctx->pieces_i++;
+                    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                            "mod_zip: sending range=%d piece=%d",
+                            ctx->ranges_i, pieces_sent);
+                    pieces_sent++;
+                    rc = ngx_http_zip_send_piece(r, ctx, piece, req_range);
+                }
+
+                if (rc == NGX_OK) {
+                    ctx->ranges_i++;
+                    ctx->pieces_i = 0;
+                }
+            }
+
+            if (rc == NGX_OK) {
+                ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                        "mod_zip: sending final boundary");
+                rc = ngx_http_zip_send_final_boundary(r, ctx);
+            }
+            break;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "mod_zip: sent %d pieces, last rc = %d", pieces_sent, rc);
+
+    if (rc == NGX_OK) {
+        ctx->trailer_sent = 1;
+        if (ngx_http_zip_report_crc32(r, ctx) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+        return ngx_http_send_special(r, NGX_HTTP_LAST);
+    }
+
+    /* NGX_DONE, NGX_AGAIN or NGX_ERROR */
+    return rc;
+}
+
+/*
+ * Send the local header, the saved body and the data descriptor of an
+ * entry at the current end of the archive, and record where it started
+ * for the central directory. The piece is the entry's file piece.
+ */
+static ngx_int_t
+ngx_http_zip_send_entry(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
+        ngx_http_zip_piece_t *piece, ngx_chain_t *body)
+{
+    ngx_http_zip_piece_t *header_piece = piece - 1;
+    ngx_http_zip_piece_t *last_piece = piece;
+    ngx_chain_t          *out, *cl, **ll;
+
+    if ((out = ngx_http_zip_file_header_chain_link(r, ctx, header_piece, NULL)) == NULL)
+        return NGX_ERROR;
+
+    ll = &out->next;
+    for (cl = body; cl; cl = cl->next) {
+        *ll = cl;
+        ll = &cl->next;
+    }
+
+    if (piece->file->missing_crc32) {
+        last_piece = piece + 1;
+        if ((*ll = ngx_http_zip_data_descriptor_chain_link(r, last_piece, NULL)) == NULL)
+            return NGX_ERROR;
+    }
+
+    piece->file->offset = ctx->entries_size;
+    ctx->entries_size += last_piece->range.end - header_piece->range.start;
+    if (piece->file->is_stream) {
+        ctx->entries_size += piece->file->size; // laid out empty
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "mod_zip: sending \"%V\" at offset %O", &piece->file->filename, piece->file->offset);
+
+    return ngx_output_chain(&ctx->output, out);
+}
+
+/*
+ * Entries are sent whenever their subrequests are complete, so a slow
+ * file does not hold up the ones after it. The offsets in the central
+ * directory are those the entries were actually written at.
+ */
+static ngx_int_t
+ngx_http_zip_send_pieces_out_of_order(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx)
+{
+    ngx_int_t                  rc = NGX_OK, pieces_rc;
+    ngx_queue_t               *q, *next;
+    ngx_chain_t               *cl, *out;
+    ngx_http_zip_piece_t      *piece;
+    ngx_http_zip_sr_ctx_t     *sr_ctx;
+    ngx_http_zip_loc_conf_t   *zlcf;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    zlcf = ngx_http_get_module_loc_conf(r, ngx_http_zip_module);
+
+    if (ctx->output.output_filter == NULL) {
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+        /* files buffered to disk are read back as the copy filter would */
+        ctx->output.sendfile = r->connection->sendfile;
+        ctx->output.need_in_memory = r->main_filter_need_in_memory
+                                     || r->filter_need_in_memory;
+        ctx->output.need_in_temp = r->filter_need_temporary;
+        ctx->output.alignment = clcf->directio_alignment;
+        ctx->output.pool = r->pool;
+        ctx->output.bufs.num = 1;
+        ctx->output.bufs.size = ngx_max(zlcf->subrequest_buffer_size / 4, (size_t) ngx_pagesize);
+        ctx->output.tag = (ngx_buf_tag_t) &ngx_http_zip_module_ctx;
+        ctx->output.output_filter = (ngx_output_chain_filter_pt) ngx_http_next_body_filter;
+        ctx->output.filter_ctx = r;
+    }
+
+    if (ctx->trailer_sent) {
+        rc = ngx_output_chain(&ctx->output, NULL);
+        goto done;
+    }
+
+    for (q = ngx_queue_head(&ctx->subrequests);
+         rc == NGX_OK && q != ngx_queue_sentinel(&ctx->subrequests);
+         q = next)
+    {
+        next = ngx_queue_next(q);
+        sr_ctx = ngx_queue_data(q, ngx_http_zip_sr_ctx_t, queue);
+
+        if (sr_ctx->hedged ? sr_ctx->winner == NULL || !sr_ctx->winner->done
+                           : !sr_ctx->done)
+        {
+            continue;
+        }
+
+        ngx_queue_remove(q);
+
+        out = sr_ctx->out;
+        sr_ctx->out = sr_ctx->last_out = NULL;
+
+        rc = ngx_http_zip_send_entry(r, ctx, sr_ctx->requesting_piece, out);
+
+        /* recycle the buffers that are sent already */
+        ngx_chain_update_chains(r->pool, &ctx->free, &ctx->busy, &out,
+                (ngx_buf_tag_t) &ngx_http_zip_module);
+    }
+
+    /* sizes of the files that have come in since, when progressive */
+    if (ctx->progressive && ngx_http_zip_probe_sizes(r, ctx) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    while (rc == NGX_OK || rc == NGX_AGAIN) {
+        if (ctx->pieces_i == ctx->pieces_n) {
+            /* files that have come in since, when progressive */
+            if (!ctx->progressive) {
+                break;
+            }
+
+            pieces_rc = ngx_http_zip_generate_pieces(r, ctx);
+            if (pieces_rc == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+            if (pieces_rc == NGX_DECLINED) {
+                break;
+            }
+            continue;
+        }
+
+        piece = &ctx->pieces[ctx->pieces_i];
+
+        if (piece->type == zip_file_piece && piece->file->is_inline) {
+            out = NULL;
+            if (piece->file->size
+                    && (out = ngx_http_zip_inline_chain_link(r, piece, NULL)) == NULL) {
+                return NGX_ERROR;
+            }
+            rc = ngx_http_zip_send_entry(r, ctx, piece, out);
+
+        } else if (piece->type == zip_file_piece) {
+            if (ctx->subrequests_n >= zlcf->subrequest_concurrency
+                    || !ngx_http_zip_fetch_zone_acquire(r, ctx)) {
+                break;
+            }
+            rc = ngx_http_zip_send_file_piece(r, ctx, piece, NULL);
+
+        } else if (piece->type == zip_dir_piece) {
+            rc = ngx_http_zip_send_entry(r, ctx, piece, NULL);
+
+        } else if (piece->type == zip_central_directory_piece) {
+            if (!ngx_queue_empty(&ctx->subrequests)) {
+                break;
+            }
+
+            if ((cl = ngx_http_zip_central_directory_chain_link(r, ctx, piece, NULL)) == NULL)
+                return NGX_ERROR;
+
+            cl->buf->last_buf = 1;
+            ctx->trailer_sent = 1;
+
+            if (ngx_http_zip_report_crc32(r, ctx) == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+            rc = ngx_output_chain(&ctx->output, cl);
+        }
+
+        /* local headers and data descriptors are sent along with the data */
+        ctx->pieces_i++;
+    }
+
+    if (rc == NGX_OK && !ctx->trailer_sent) {
+        rc = ngx_output_chain(&ctx->output, NULL);
+    }
+
+done:
+
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    return ctx->trailer_sent ? rc : NGX_AGAIN;
+}
+
+static void *
+ngx_http_zip_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_zip_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_zip_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->subrequest_concurrency = NGX_CONF_UNSET_UINT;
+    conf->subrequest_buffer_size = NGX_CONF_UNSET_SIZE;
+    conf->out_of_order = NGX_CONF_UNSET;
+    conf->progressive = NGX_CONF_UNSET;
+    conf->segment_threshold = NGX_CONF_UNSET;
+    conf->segments = NGX_CONF_UNSET_UINT;
+    conf->bundle_size = NGX_CONF_UNSET;
+#if (NGX_THREADS)
+    conf->thread_pool = NGX_CONF_UNSET_PTR;
+    conf->thread_chunk = NGX_CONF_UNSET_SIZE;
+#endif
+    conf->hedge_delay = NGX_CONF_UNSET_MSEC;
+    conf->subrequest_retries = NGX_CONF_UNSET_UINT;
+    conf->fetch_zone = NGX_CONF_UNSET_PTR;
+    conf->admission_zone = NGX_CONF_UNSET_PTR;
+    conf->crc_cache = NGX_CONF_UNSET_PTR;
+    conf->mtime = NGX_CONF_UNSET;
+
+    return conf;
+}
+
+static char *
+ngx_http_zip_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 {
-    ngx_http_zip_sr_ctx_t *sr_ctx;
-    ngx_http_request_t *sr;
-    ngx_http_post_subrequest_t *ps;
-    ngx_int_t rc;
+    ngx_http_zip_loc_conf_t  *prev = parent;
+    ngx_http_zip_loc_conf_t  *conf = child;
+
+    ngx_conf_merge_uint_value(conf->subrequest_concurrency,
+                              prev->subrequest_concurrency, 1);
+    ngx_conf_merge_size_value(conf->subrequest_buffer_size,
+                              prev->subrequest_buffer_size, 1024 * 1024);
+    ngx_conf_merge_value(conf->out_of_order, prev->out_of_order, 0);
+    ngx_conf_merge_value(conf->progressive, prev->progressive, 0);
+    ngx_conf_merge_off_value(conf->segment_threshold, prev->segment_threshold, 0);
+    ngx_conf_merge_uint_value(conf->segments, prev->segments, 4);
+    ngx_conf_merge_off_value(conf->bundle_size, prev->bundle_size, 0);
+#if (NGX_THREADS)
+    ngx_conf_merge_ptr_value(conf->thread_pool, prev->thread_pool, NULL);
+    ngx_conf_merge_size_value(conf->thread_chunk, prev->thread_chunk, 256 * 1024);
+#endif
+    ngx_conf_merge_msec_value(conf->hedge_delay, prev->hedge_delay, 0);
+    ngx_conf_merge_uint_value(conf->subrequest_retries, prev->subrequest_retries, 0);
+    ngx_conf_merge_ptr_value(conf->fetch_zone, prev->fetch_zone, NULL);
+    ngx_conf_merge_ptr_value(conf->admission_zone, prev->admission_zone, NULL);
+    ngx_conf_merge_ptr_value(conf->crc_cache, prev->crc_cache, NULL);
+    ngx_conf_merge_value(conf->mtime, prev->mtime, NGX_HTTP_ZIP_MTIME_NOW);
+    ngx_conf_merge_str_value(conf->cache_control, prev->cache_control, "max-age=0");
+
+    if (conf->cache_control.len == sizeof("off") - 1
+            && ngx_strncmp(conf->cache_control.data, "off", sizeof("off") - 1) == 0) {
+        ngx_str_set(&conf->cache_control, "");
+    }
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-            "mod_zip: subrequest for \"%V?%V\"", &piece->file->uri, &piece->file->args);
-    // need to check if the context has something going on....
-    if (ctx->wait) {
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                "mod_zip: have a wait context for \"%V?%V\"",
-                &ctx->wait->uri, &ctx->wait->args);
-        if (!ctx->wait->done) {
-            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                    "mod_zip: wait NOT DONE  \"%V?%V\"",
-                    &ctx->wait->uri, &ctx->wait->args);
-            return NGX_AGAIN;
-        }
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                "mod_zip: wait \"%V?%V\" done",
-                &ctx->wait->uri, &ctx->wait->args);
-        ctx->wait = NULL;
+    ngx_conf_merge_str_value(conf->crc_report, prev->crc_report, "");
+
+    if (conf->crc_report.len == sizeof("off") - 1
+            && ngx_strncmp(conf->crc_report.data, "off", sizeof("off") - 1) == 0) {
+        ngx_str_set(&conf->crc_report, "");
     }
 
-    ps = ngx_palloc(r->pool, sizeof(ngx_http_post_subrequest_t));
-    if (ps == NULL) {
-        return NGX_ERROR;
+    ngx_conf_merge_str_value(conf->manifest_root, prev->manifest_root, "");
+
+    if (conf->manifest_root.len == sizeof("off") - 1
+            && ngx_strncmp(conf->manifest_root.data, "off", sizeof("off") - 1) == 0) {
+        ngx_str_set(&conf->manifest_root, "");
     }
 
-    ps->handler = ngx_http_zip_subrequest_done;
-    ps->data = piece;
+    if (conf->manifest_root.len
+            && ngx_conf_full_name(cf->cycle, &conf->manifest_root, 0) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
 
-    rc = ngx_http_subrequest(r, &piece->file->uri, &piece->file->args, &sr, ps, NGX_HTTP_SUBREQUEST_WAITED);
-    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-            "mod_zip: subrequest for \"%V?%V\" initiated, result %d", 
-            &piece->file->uri, &piece->file->args, rc);
+#ifndef NGX_HTTP_SUBREQUEST_BACKGROUND
+    if (conf->out_of_order) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"zip_out_of_order\" requires nginx 1.13.1 or later");
+        return NGX_CONF_ERROR;
+    }
 
-    if (rc == NGX_ERROR) {
-        return NGX_ERROR;
+    if (conf->progressive) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"zip_progressive\" requires nginx 1.13.1 or later");
+        return NGX_CONF_ERROR;
     }
 
-    sr->allow_ranges = 1;
-    sr->subrequest_ranges = 1;
-    sr->single_range = 1;
+    if (conf->crc_report.len) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"zip_crc_report\" requires nginx 1.13.1 or later");
+        return NGX_CONF_ERROR;
+    }
+#endif
 
-    rc = ngx_http_zip_init_subrequest_headers(r, ctx, sr, &piece->range, req_range);
-    if (sr->headers_in.range) {
-        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                "mod_zip: subrequest for \"%V?%V\" Range: %V", 
-                &piece->file->uri, &piece->file->args, &sr->headers_in.range->value);
+    if (ngx_conf_merge_path_value(cf, &conf->temp_path, prev->temp_path,
+                                  &ngx_http_zip_temp_path)
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
     }
-    if (rc == NGX_ERROR) {
-        return NGX_ERROR;
+
+    return NGX_CONF_OK;
+}
+
+/* zip_fetch_zone <name> <number> | off */
+static char *
+ngx_http_zip_fetch_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_zip_loc_conf_t    *zlcf = conf;
+    ngx_http_zip_fetch_zone_t  *zone;
+    ngx_shm_zone_t             *shm_zone;
+    ngx_str_t                  *value;
+    ngx_int_t                   limit;
+
+    if (zlcf->fetch_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
     }
 
-    ngx_pool_cleanup_t *cln;
-    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_zip_sr_ctx_t));
-    if (cln == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    value = cf->args->elts;
+
+    if (cf->args->nelts == 2) {
+        if (ngx_strcmp(value[1].data, "off") == 0) {
+            zlcf->fetch_zone = NULL;
+            return NGX_CONF_OK;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
     }
-    sr_ctx = cln->data;
-    if (sr_ctx == NULL) {
-        return NGX_ERROR;
+
+    limit = ngx_atoi(value[2].data, value[2].len);
+    if (limit == NGX_ERROR || limit == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of fetches \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
     }
 
-    cln->handler = ngx_http_zip_sr_ctx_cleanup;
-    ngx_http_set_ctx(r, ctx, ngx_http_zip_module);
+    shm_zone = ngx_shared_memory_add(cf, &value[1], 8 * ngx_pagesize,
+                                     &ngx_http_zip_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
 
-    sr_ctx->requesting_file = piece->file;
+    zone = shm_zone->data;
 
-    ngx_http_set_ctx(sr, sr_ctx, ngx_http_zip_module);
-    if (ctx->wait) {
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                "mod_zip : only one subrequest may be waited at the same time; ");
-        return NGX_ERROR;
+    if (zone == NULL) {
+        zone = ngx_pcalloc(cf->pool, sizeof(ngx_http_zip_fetch_zone_t));
+        if (zone == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        zone->limit = limit;
+        ngx_queue_init(&zone->waiting);
+
+        shm_zone->init = ngx_http_zip_init_fetch_zone;
+        shm_zone->data = zone;
+
+    } else if (shm_zone->init != ngx_http_zip_init_fetch_zone
+               || zone->limit != (ngx_uint_t) limit) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zip_fetch_zone \"%V\" is already used with another limit",
+                           &value[1]);
+        return NGX_CONF_ERROR;
     }
-    ctx->wait = sr;
-    return NGX_AGAIN;   // must be NGX_AGAIN
-}
 
-static ngx_int_t ngx_http_zip_send_directory_piece(ngx_http_request_t *r,
-        ngx_http_zip_ctx_t *ctx, ngx_http_zip_piece_t *piece, ngx_http_zip_range_t *req_range)
-{
-    // Directory has no data.
-    return NGX_OK;
+    zlcf->fetch_zone = zone;
+
+    return NGX_CONF_OK;
 }
 
 static ngx_int_t
-ngx_http_zip_send_trailer_piece(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
-        ngx_http_zip_piece_t *piece, ngx_http_zip_range_t *req_range)
+ngx_http_zip_init_fetch_zone(ngx_shm_zone_t *shm_zone, void *data)
 {
-    ngx_chain_t *link;
+    ngx_http_zip_fetch_zone_t  *ozone = data;
+    ngx_http_zip_fetch_zone_t  *zone = shm_zone->data;
+    ngx_slab_pool_t            *shpool;
 
-    if (piece->file->missing_crc32) { // should always be true, but if we somehow needed trailer piece - go on
-        uint32_t old_crc32 = piece->file->crc32;
-        ngx_crc32_final(piece->file->crc32);
+    /* the fetches of the old workers are still counted */
+    if (ozone) {
+        zone->sh = ozone->sh;
+        return NGX_OK;
+    }
 
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                "mod_zip: finalized CRC-32 (%08Xd -> %08Xd)", old_crc32, piece->file->crc32);
-        (void)old_crc32;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        zone->sh = shpool->data;
+        return NGX_OK;
     }
 
-    if ((link = ngx_http_zip_data_descriptor_chain_link(r, piece, req_range)) == NULL) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "mod_zip: data descriptor failed");
+    zone->sh = ngx_slab_alloc(shpool, sizeof(ngx_http_zip_fetch_sh_t));
+    if (zone->sh == NULL) {
         return NGX_ERROR;
     }
-    return ngx_http_next_body_filter(r, link);
+
+    zone->sh->fetches = 0;
+
+    shpool->data = zone->sh;
+
+    return NGX_OK;
 }
 
-static ngx_int_t
-ngx_http_zip_send_central_directory_piece(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
-        ngx_http_zip_piece_t *piece, ngx_http_zip_range_t *req_range)
+/* zip_admission_zone <name> [memory=<size>] [size=<size>] [retry_after=<time>] | off */
+static char *
+ngx_http_zip_admission_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_chain_t *link;
+    ngx_http_zip_loc_conf_t        *zlcf = conf;
+    ngx_http_zip_admission_zone_t  *zone;
+    ngx_shm_zone_t                 *shm_zone;
+    ngx_str_t                      *value, s;
+    ngx_uint_t                      i;
+    ssize_t                         memory = 0;
+    off_t                           size = 0;
+    time_t                          retry_after = 5;
+
+    if (zlcf->admission_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
 
-    if ((link = ngx_http_zip_central_directory_chain_link(r, ctx, piece, req_range)) == NULL) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "mod_zip: CD piece failed");
-        return NGX_ERROR;
+    value = cf->args->elts;
+
+    if (cf->args->nelts == 2 && ngx_strcmp(value[1].data, "off") == 0) {
+        zlcf->admission_zone = NULL;
+        return NGX_CONF_OK;
     }
-    return ngx_http_next_body_filter(r, link);
-}
 
-static ngx_int_t
-ngx_http_zip_send_piece(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
-        ngx_http_zip_piece_t *piece, ngx_http_zip_range_t *req_range)
-{
-    ngx_int_t rc = NGX_ERROR;
+    for (i = 2; i < cf->args->nelts; i++) {
 
-    if (piece->type == zip_header_piece) {
-        rc = ngx_http_zip_send_header_piece(r, ctx, piece, req_range);
-    } else if (piece->type == zip_file_piece) {
-        rc = ngx_http_zip_send_file_piece(r, ctx, piece, req_range);
-    } else if (piece->type == zip_dir_piece) {
-        rc = ngx_http_zip_send_directory_piece(r, ctx, piece, req_range);
-    } else if (piece->type == zip_trailer_piece) {
-        rc = ngx_http_zip_send_trailer_piece(r, ctx, piece, req_range);
-    } else if (piece->type == zip_central_directory_piece) {
-        rc = ngx_http_zip_send_central_directory_piece(r, ctx, piece, req_range);
+        if (ngx_strncmp(value[i].data, "memory=", 7) == 0) {
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            memory = ngx_parse_size(&s);
+            if (memory == NGX_ERROR || memory == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "size=", 5) == 0) {
+            s.len = value[i].len - 5;
+            s.data = value[i].data + 5;
+
+            size = ngx_parse_offset(&s);
+            if (size == NGX_ERROR || size == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "retry_after=", 12) == 0) {
+            s.len = value[i].len - 12;
+            s.data = value[i].data + 12;
+
+            retry_after = ngx_parse_time(&s, 1);
+            if (retry_after == (time_t) NGX_ERROR) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
     }
 
-    return rc;
+    if (memory == 0 && size == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zip_admission_zone \"%V\" needs \"memory=\" or \"size=\"",
+                           &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &value[1], 8 * ngx_pagesize,
+                                     &ngx_http_zip_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    zone = shm_zone->data;
+
+    if (zone == NULL) {
+        zone = ngx_pcalloc(cf->pool, sizeof(ngx_http_zip_admission_zone_t));
+        if (zone == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        zone->memory = memory;
+        zone->size = size;
+        zone->retry_after = retry_after;
+
+        shm_zone->init = ngx_http_zip_init_admission_zone;
+        shm_zone->data = zone;
+
+    } else if (shm_zone->init != ngx_http_zip_init_admission_zone
+               || zone->memory != (size_t) memory || zone->size != size
+               || zone->retry_after != retry_after) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zip_admission_zone \"%V\" is already used with other limits",
+                           &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    zlcf->admission_zone = zone;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
 }
 
 static ngx_int_t
-ngx_http_zip_send_boundary(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx,
-        ngx_http_zip_range_t *range)
+ngx_http_zip_init_admission_zone(ngx_shm_zone_t *shm_zone, void *data)
 {
-    ngx_chain_t *link;
-    ngx_buf_t   *b;
+    ngx_http_zip_admission_zone_t  *ozone = data;
+    ngx_http_zip_admission_zone_t  *zone = shm_zone->data;
 
-    if (range->boundary_sent) 
+    zone->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    /* the archives of the old workers are still counted */
+    if (ozone) {
+        zone->sh = ozone->sh;
         return NGX_OK;
+    }
 
-    if ((link = ngx_alloc_chain_link(r->pool)) == NULL 
-        || (b = ngx_calloc_buf(r->pool)) == NULL) 
+    if (shm_zone->shm.exists) {
+        zone->sh = zone->shpool->data;
+        return NGX_OK;
+    }
+
+    zone->sh = ngx_slab_alloc(zone->shpool, sizeof(ngx_http_zip_admission_sh_t));
+    if (zone->sh == NULL) {
         return NGX_ERROR;
+    }
 
-    b->memory = 1;
-    b->pos = range->boundary_header.data;
-    b->last = b->pos + range->boundary_header.len;
+    zone->sh->memory = 0;
+    zone->sh->size = 0;
+    zone->sh->archives = 0;
 
-    link->buf = b;
-    link->next = NULL;
+    zone->shpool->data = zone->sh;
 
-    range->boundary_sent = 1;
-    return ngx_http_next_body_filter(r, link);
+    return NGX_OK;
 }
 
-static ngx_int_t
-ngx_http_zip_send_final_boundary(ngx_http_request_t *r, ngx_http_zip_ctx_t *ctx)
+/* zip_crc_cache <name> <size> | off */
+static char *
+ngx_http_zip_crc_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    size_t len;
-    ngx_chain_t *link;
-    ngx_buf_t   *b;
+    ngx_http_zip_loc_conf_t   *zlcf = conf;
+    ngx_http_zip_crc_cache_t  *cache;
+    ngx_shm_zone_t            *shm_zone;
+    ngx_str_t                 *value;
+    ssize_t                    size;
+
+    if (zlcf->crc_cache != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
 
-    if ((link = ngx_alloc_chain_link(r->pool)) == NULL
-        || (b = ngx_calloc_buf(r->pool)) == NULL)
-        return NGX_ERROR;
+    value = cf->args->elts;
 
-    len = sizeof(CRLF "--") - 1 + NGX_ATOMIC_T_LEN + sizeof("--" CRLF) - 1;
+    if (cf->args->nelts == 2) {
+        if (ngx_strcmp(value[1].data, "off") == 0) {
+            zlcf->crc_cache = NULL;
+            return NGX_CONF_OK;
+        }
 
-    b->memory = 1;
-    if ((b->pos = ngx_palloc(r->pool, len)) == NULL) 
-        return NGX_ERROR;
-   
-    b->last = ngx_sprintf(b->pos, CRLF "--%0muA--" CRLF, ctx->boundary);
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
 
-    link->buf = b;
-    link->next = NULL;
+    size = ngx_parse_size(&value[2]);
+    if (size == NGX_ERROR || size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid size \"%V\" of zip_crc_cache \"%V\"",
+                           &value[2], &value[1]);
+        return NGX_CONF_ERROR;
+    }
 
-    return ngx_http_next_body_filter(r, link);
+    shm_zone = ngx_shared_memory_add(cf, &value[1], size, &ngx_http_zip_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    cache = shm_zone->data;
+
+    if (cache == NULL) {
+        cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_zip_crc_cache_t));
+        if (cache == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        shm_zone->init = ngx_http_zip_init_crc_cache;
+        shm_zone->data = cache;
+
+    } else if (shm_zone->init != ngx_http_zip_init_crc_cache) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zip_crc_cache \"%V\" is already used as another zone",
+                           &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    zlcf->crc_cache = cache;
+
+    return NGX_CONF_OK;
 }
 
-/* Initiate one or more subrequests for files to put in the ZIP archive */
-static ngx_int_t
-ngx_http_zip_send_pieces(ngx_http_request_t *r, 
-        ngx_http_zip_ctx_t *ctx)
+#if (NGX_THREADS)
+
+/* zip_thread_pool <name> | off */
+static char *
+ngx_http_zip_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_int_t             rc = NGX_OK, pieces_sent = 0;
-    ngx_http_zip_piece_t *piece;
-    ngx_http_zip_range_t *req_range = NULL;
+    ngx_http_zip_loc_conf_t  *zlcf = conf;
+    ngx_str_t                *value;
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-            "mod_zip: sending pieces, starting with piece %d of total %d", ctx->pieces_i, ctx->pieces_n);
+    if (zlcf->thread_pool != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
 
-    switch(ctx->ranges.nelts) {
-        case 0:
-            while (rc == NGX_OK && ctx->pieces_i < ctx->pieces_n) {
-                piece = &ctx->pieces[ctx->pieces_i++];
-                pieces_sent++;
-                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "mod_zip: no ranges / sending piece type %d", piece->type);
-                rc = ngx_http_zip_send_piece(r, ctx, piece, NULL);
-                if (rc == NGX_AGAIN && r->connection->buffered && !r->postponed) {
-                    rc = NGX_OK;
-                }
-            }
-            break;
-        case 1:
-            req_range = &((ngx_http_zip_range_t *)ctx->ranges.elts)[0];
-            while (rc == NGX_OK && ctx->pieces_i < ctx->pieces_n) {
-                piece = &ctx->pieces[ctx->pieces_i++];
-                if (ngx_http_zip_ranges_intersect(&piece->range, req_range)) {
-                    pieces_sent++;
-                    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "mod_zip: 1 range / sending piece type %d", piece->type);
-                    rc = ngx_http_zip_send_piece(r, ctx, piece, req_range);
-                }
-            }
-            break;
-        default:
-            while (rc == NGX_OK && ctx->ranges_i < ctx->ranges.nelts) {
-                req_range = &((ngx_http_zip_range_t *)ctx->ranges.elts)[ctx->ranges_i];
-                ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                        "mod_zip: sending range #%d start=%O end=%O (size %d)", 
-                        ctx->ranges_i, req_range->start, req_range->end, req_range->boundary_header.len);
-                rc = ngx_http_zip_send_boundary(r, ctx, req_range);
-                while (rc == NGX_OK && ctx->pieces_i < ctx->pieces_n) {
-                    piece = &ctx->pieces[ctx->pieces_i++];
-                    if (ngx_http_zip_ranges_intersect(&piece->range, req_range)) {
-                        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                                "mod_zip: sending range=%d piece=%d",
-                                ctx->ranges_i, pieces_sent);
-                        pieces_sent++;
-                        rc = ngx_http_zip_send_piece(r, ctx, piece, req_range);
-                    }
-                }
+    value = cf->args->elts;
 
-                if (rc == NGX_OK) {
-                    ctx->ranges_i++;
-                    ctx->pieces_i = 0;
-                }
-            }
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        zlcf->thread_pool = NULL;
+        return NGX_CONF_OK;
+    }
 
-            if (rc == NGX_OK) {
-                ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                        "mod_zip: sending final boundary");
-                rc = ngx_http_zip_send_final_boundary(r, ctx);
-            }
-            break;
+    zlcf->thread_pool = ngx_thread_pool_add(cf, &value[1]);
+    if (zlcf->thread_pool == NULL) {
+        return NGX_CONF_ERROR;
     }
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-            "mod_zip: sent %d pieces, last rc = %d", pieces_sent, rc);
+    return NGX_CONF_OK;
+}
 
-    if (rc == NGX_OK) {
-        ctx->trailer_sent = 1;
-        return ngx_http_send_special(r, NGX_HTTP_LAST);
+#endif
+
+/* zip_mtime now | last_modified | <seconds since the epoch> */
+static char *
+ngx_http_zip_mtime(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_zip_loc_conf_t  *zlcf = conf;
+    ngx_str_t                *value;
+    time_t                    mtime;
+
+    if (zlcf->mtime != NGX_CONF_UNSET) {
+        return "is duplicate";
     }
 
-    /* NGX_DONE, NGX_AGAIN or NGX_ERROR */
-    return rc;
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "now") == 0) {
+        zlcf->mtime = NGX_HTTP_ZIP_MTIME_NOW;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strcmp(value[1].data, "last_modified") == 0) {
+        zlcf->mtime = NGX_HTTP_ZIP_MTIME_LAST_MODIFIED;
+        return NGX_CONF_OK;
+    }
+
+    mtime = ngx_atotm(value[1].data, value[1].len);
+    if (mtime == NGX_ERROR || mtime < NGX_HTTP_ZIP_DOS_EPOCH) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid time \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    zlcf->mtime = mtime;
+
+    return NGX_CONF_OK;
 }
 
 /* Install the module filters */
@@ -795,5 +4032,7 @@ ngx_http_zip_init(ngx_conf_t *cf)
     ngx_http_next_body_filter = ngx_http_top_body_filter;
     ngx_http_top_body_filter = ngx_http_zip_body_filter;
 
+    ngx_http_zip_crc32_init();
+
     return NGX_OK;
 }
@@ -5,30 +5,133 @@
 #include <ngx_http.h>
 #include <time.h>
 
+#ifdef NGX_ZIP_HAVE_ICONV
+#include <iconv.h>
+#endif
+
 #define NGX_ZIP_MIME_TYPE "application/zip"
+#define NGX_HTTP_ZIP_TEMP_PATH "zip_temp"
+
+/* how often an archive waiting for a fetch zone looks at other workers' */
+#define NGX_HTTP_ZIP_FETCH_ZONE_POLL 100
+
+/* the chunks a file list on disk is read in */
+#define NGX_HTTP_ZIP_MANIFEST_FILE_BUFFER 65536
+
+/* zip_mtime now | last_modified, other values are a time */
+#define NGX_HTTP_ZIP_MTIME_NOW            -2
+#define NGX_HTTP_ZIP_MTIME_LAST_MODIFIED  -3
+
+/* the earliest time a DOS date can hold, 1980-01-01 */
+#define NGX_HTTP_ZIP_DOS_EPOCH 315532800
+
 #define ngx_http_zip_current_file(ctx) ctx->pieces[ctx->pieces_i].file
 
 extern uint32_t   ngx_crc32_table256[];
+extern ngx_module_t  ngx_http_zip_module;
+
+typedef struct {
+    ngx_atomic_t    fetches; // in flight, in all workers
+} ngx_http_zip_fetch_sh_t;
+
+typedef struct {
+    ngx_http_zip_fetch_sh_t *sh;
+    ngx_uint_t      limit;
+    ngx_queue_t     waiting; // archives of this worker, first come first served
+} ngx_http_zip_fetch_zone_t;
+
+typedef struct {
+    size_t          memory; // estimated, of the archives being sent
+    off_t           size;
+    ngx_uint_t      archives;
+} ngx_http_zip_admission_sh_t;
+
+typedef struct {
+    ngx_http_zip_admission_sh_t *sh;
+    ngx_slab_pool_t *shpool;
+    size_t          memory;
+    off_t           size;
+    time_t          retry_after;
+} ngx_http_zip_admission_zone_t;
+
+typedef struct {
+    ngx_rbtree_t        rbtree;
+    ngx_rbtree_node_t   sentinel;
+    ngx_queue_t         queue; // most recently used first
+} ngx_http_zip_crc_cache_sh_t;
+
+typedef struct {
+    ngx_http_zip_crc_cache_sh_t *sh;
+    ngx_slab_pool_t *shpool;
+} ngx_http_zip_crc_cache_t;
+
+typedef struct {
+    ngx_str_node_t  sn; // the location, the size and the offset in it
+    ngx_queue_t     queue;
+    uint32_t        crc32;
+    ngx_str_t       validator; // ETag or Last-Modified the CRC-32 is of
+    u_char          data[1];
+} ngx_http_zip_crc_cache_node_t;
+
+typedef struct {
+    ngx_uint_t      subrequest_concurrency;
+    size_t          subrequest_buffer_size;
+    ngx_flag_t      out_of_order;
+    ngx_flag_t      progressive;
+    ngx_path_t     *temp_path;
+    off_t           segment_threshold;
+    ngx_uint_t      segments;
+    off_t           bundle_size;
+#if (NGX_THREADS)
+    ngx_thread_pool_t *thread_pool; // for missing CRC-32s
+    size_t          thread_chunk;
+#endif
+    ngx_msec_t      hedge_delay;
+    ngx_uint_t      subrequest_retries;
+    ngx_http_zip_fetch_zone_t *fetch_zone;
+    ngx_http_zip_admission_zone_t *admission_zone;
+    ngx_http_zip_crc_cache_t *crc_cache;
+    time_t          mtime;
+    ngx_str_t       cache_control; // empty: leave upstream's
+    ngx_str_t       crc_report; // empty: off
+    ngx_str_t       manifest_root; // empty: off
+} ngx_http_zip_loc_conf_t;
+
+typedef struct {
+    ngx_str_t   uri;
+    ngx_str_t   args;
+} ngx_http_zip_mirror_t;
 
 typedef struct {
     uint32_t    crc32;
     ngx_str_t   uri;
     ngx_str_t   args;
+    ngx_array_t *mirrors; // alternate locations, ngx_http_zip_mirror_t
     size_t      index; //! zip64 allows for 64bit number of files
     ngx_uint_t  dos_time;
     ngx_uint_t  unix_time;
+    ngx_uint_t  mode; // permission bits, 0: the defaults
     ngx_str_t   filename;
     ngx_str_t   filename_utf8;
     uint32_t    filename_utf8_crc32;
     off_t       size; 
     off_t       offset;
+    off_t       source_offset; // of the data in its location, when is_slice
+    u_char     *data_descriptor; // trailer waiting for the final CRC-32
+    ngx_str_t   validator; // of the location, when the CRC-32 is from zip_crc_cache
 
     unsigned    header_sent:1;
     unsigned    trailer_sent:1;
     unsigned    missing_crc32:1;
+    unsigned    missing_size:1; // "-" in the list, asked for with a HEAD subrequest
+    unsigned    crc32_final:1;
+    unsigned    crc32_cached:1;
     unsigned    need_zip64:1;
     unsigned    need_zip64_offset:1;
     unsigned    is_directory:1;
+    unsigned    is_inline:1; // no subrequest, the data is in uri
+    unsigned    is_stream:1; // "*" in the list, the size is counted as it is fetched
+    unsigned    is_slice:1; // "<offset>+<size>" in the list, fetched with a Range
 } ngx_http_zip_file_t;
 
 typedef struct {
@@ -57,9 +160,21 @@ typedef struct {
 } ngx_http_zip_piece_t;
 
 typedef struct {
-    ngx_array_t             unparsed_request;
-    ngx_http_zip_piece_t   *pieces;
-    ngx_array_t             files;
+    ngx_str_t               parse_token; // line or entry cut by the end of the last buffer
+    off_t                   manifest_size;
+    ngx_str_t               next_page; // X-Archive-Files-Next, of the latest page
+    ngx_str_t               manifest_file; // X-Archive-Manifest-File
+    ngx_http_zip_piece_t   *pieces; // the latest batch, when progressive
+    ngx_list_t              files; // elements stay put as the list grows
+    ngx_uint_t              files_n;
+    ngx_uint_t              files_pieced; // files the pieces have been generated for
+    ngx_list_part_t        *files_part; // where the next batch of pieces starts
+    ngx_uint_t              files_part_i;
+    ngx_uint_t              sizes_missing; // files whose size is not known yet
+    ngx_uint_t              probes_n; // HEAD subrequests for them in flight
+    ngx_list_part_t        *probe_part; // where the next one to ask for may be
+    ngx_uint_t              probe_i;
+    off_t                   pieces_end;
     ngx_array_t             ranges;
     ngx_uint_t              ranges_i;
     ngx_uint_t              pieces_i;
@@ -67,19 +182,102 @@ typedef struct {
     ngx_atomic_uint_t       boundary;
     off_t                   archive_size;
     off_t                   cd_size; // zip central directory size
-    ngx_http_request_t     *wait;
+    ngx_queue_t             subrequests; // in flight, in archive order
+    ngx_uint_t              subrequests_n;
+    off_t                   subrequests_buffered; // held in memory until their turn to be sent
     ngx_array_t             pass_srq_headers;
+    ngx_str_t               name_sep; // X-Archive-Name-Sep
+    ngx_str_t               uri_template; // X-Archive-Uri-Template, up to the '?'
+    ngx_str_t               args_template;
+#ifdef NGX_ZIP_HAVE_ICONV
+    iconv_t                 iconv_cd; // X-Archive-Charset
+#endif
+    off_t                   entries_size; // written so far, when out of order
+    ngx_chain_t            *free;
+    ngx_chain_t            *busy;
+    ngx_temp_file_t        *temp_file;
+    ngx_output_chain_ctx_t  output;
+    ngx_http_zip_fetch_zone_t *fetch_zone;
+    ngx_queue_t             fetch_queue; // waiting for the fetch zone
+    ngx_event_t             fetch_wait;
+    ngx_http_zip_admission_zone_t *admission_zone; // admitted to
+    size_t                  memory_cost;
+    off_t                   size_cost;
+    ngx_http_event_handler_pt  read_event_handler; // put back once it is no longer held
+    ngx_http_event_handler_pt  write_event_handler;
 
     unsigned                parsed:1;
+    unsigned                binary:1; // file list in the binary format
+    unsigned                mirrors:1; // alternate locations after "|", with zip_hedge_delay
+    unsigned                line_open:1; // the list so far does not end with a line break
     unsigned                trailer_sent:1;
     unsigned                abort:1;
     unsigned                missing_crc32:1; // used in subrequest, if true = reads file into memory and calculates it; also to indicate presence of such file
     unsigned                zip64_used:1;
     unsigned                unicode_path:1;
     unsigned                native_charset:1;
+    unsigned                out_of_order:1; // entries are written as their subrequests complete
+    unsigned                progressive:1; // and before the whole file list has arrived
+    unsigned                stream:1; // some entries are of unknown size: no Content-Length
+    unsigned                pieces_init:1;
+    unsigned                pieces_done:1; // up to the central directory
+    unsigned                fetch_waiting:1;
+    unsigned                held:1; // the list is done, see ngx_http_zip_write_handler()
 } ngx_http_zip_ctx_t;
 
-typedef struct {
+typedef struct ngx_http_zip_sr_ctx_s  ngx_http_zip_sr_ctx_t;
+typedef struct ngx_http_zip_crc32_task_s  ngx_http_zip_crc32_task_t;
+
+/* a chunk of a body hashed in the thread pool */
+struct ngx_http_zip_crc32_task_s {
+    ngx_chain_t            *in; // where it starts
+    u_char                 *pos;
+    size_t                  len;
+    uint32_t                crc32; // of the chunk alone, from 0
+    ngx_http_request_t     *request;
+    ngx_http_zip_sr_ctx_t  *sr_ctx;
+    ngx_http_zip_crc32_task_t *next;
+};
+
+struct ngx_http_zip_sr_ctx_s {
     ngx_http_zip_file_t    *requesting_file;
-} ngx_http_zip_sr_ctx_t;
+    ngx_http_zip_piece_t   *requesting_piece;
+    ngx_str_t              *uri;
+    ngx_str_t              *args;
+    ngx_str_t               expanded_uri; // from the URI template
+    ngx_str_t               expanded_args;
+    ngx_http_request_t     *sr; // the latest attempt
+    ngx_http_zip_range_t    fetch_range; // in the archive
+    off_t                   received; // of the fetch range, over all attempts
+    ngx_uint_t              retries;
+    ngx_http_zip_fetch_zone_t *fetch_zone; // holding one of its fetches
+    ngx_queue_t             queue;
+    off_t                   buffered;
+    ngx_chain_t            *out; // saved body, when out of order
+    ngx_chain_t            *last_out;
+    ngx_http_zip_sr_ctx_t  *entry; // the queued fetch of the same piece
+    ngx_http_zip_sr_ctx_t  *winner; // the fetch whose body is kept, when hedged
+    ngx_http_request_t     *request; // main request, for the hedge timer
+    ngx_event_t             hedge;
+    ngx_uint_t              mirrors_i; // next mirror to hedge with
+    ngx_uint_t              fetches; // in flight for the piece
+    ngx_http_zip_piece_t   *bundle_last; // file piece of the last entry fetched along
+    ngx_http_zip_piece_t   *bundle_piece; // the entry being received
+    off_t                   bundle_size; // of the data of all of them
+    off_t                   bundle_left; // of bundle_piece
+    ngx_chain_t            *crc32_hashing; // held back while its chunks are hashed
+    ngx_chain_t            *crc32_waiting; // arrived meanwhile
+    ngx_http_zip_crc32_task_t *crc32_tasks; // in body order
+    ngx_uint_t              crc32_tasks_n; // not complete yet
+    ngx_http_event_handler_pt  read_event_handler; // put back once its end is hashed
+    ngx_http_event_handler_pt  write_event_handler;
+    ngx_str_t               validator; // of the response, for zip_crc_cache
+
+    unsigned                done:1;
+    unsigned                hedged:1;
+    unsigned                page:1; // of the file list, see X-Archive-Files-Next
+    unsigned                probe:1; // HEAD for the size of requesting_file
+    unsigned                report:1; // POST of the computed CRC-32s, see zip_crc_report
+    unsigned                crc32_held:1; // its end is being hashed, finalized after
+};
 
@@ -3,6 +3,25 @@
 
 #include "ngx_http_zip_module.h"
 #include "ngx_http_zip_parsers.h"
+#include "ngx_http_zip_endian.h"
+
+/* an entry of the binary file list, followed by its URI and name */
+#pragma pack(push, 1)
+typedef struct {
+	uint32_t    crc32;
+	uint64_t    size;
+	uint32_t    mtime; // 0: the time of the request
+	uint16_t    mode; // permission bits, 0: the defaults
+	uint16_t    flags;
+	uint16_t    uri_len;
+	uint16_t    name_len;
+} ngx_http_zip_binary_entry_t;
+#pragma pack(pop)
+
+#define NGX_HTTP_ZIP_BINARY_MISSING_CRC32   0x0001
+#define NGX_HTTP_ZIP_BINARY_DIRECTORY       0x0002
+#define NGX_HTTP_ZIP_BINARY_MISSING_SIZE    0x0004
+#define NGX_HTTP_ZIP_BINARY_STREAM          0x0008
 
 static void
 ngx_http_zip_file_init(ngx_http_zip_file_t *parsing_file)
@@ -12,22 +31,127 @@ ngx_http_zip_file_init(ngx_http_zip_file_t *parsing_file)
 	ngx_str_null(&parsing_file->filename);
 	ngx_str_null(&parsing_file->filename_utf8);
 	
+	parsing_file->mirrors = NULL;
+	
 	parsing_file->header_sent = 0;
 	parsing_file->trailer_sent = 0;
 	
 	parsing_file->crc32 = 0;
 	parsing_file->size = 0;
+	parsing_file->source_offset = 0;
+	parsing_file->unix_time = 0;
+	parsing_file->mode = 0;
 	
 	parsing_file->missing_crc32 = 0;
+	parsing_file->missing_size = 0;
 	parsing_file->need_zip64 = 0;
 	parsing_file->need_zip64_offset = 0;
 	parsing_file->is_directory = 0;
+	parsing_file->is_inline = 0;
+	parsing_file->is_stream = 0;
+	parsing_file->is_slice = 0;
+}
+
+static ngx_http_zip_file_t *
+ngx_http_zip_push_file(ngx_http_zip_ctx_t *ctx)
+{
+	ngx_http_zip_file_t *parsing_file;
+	
+	parsing_file = ngx_list_push(&ctx->files);
+	if (parsing_file == NULL) {
+		return NULL;
+	}
+	ngx_http_zip_file_init(parsing_file);
+	
+	parsing_file->index = ctx->files_n++;
+	
+	return parsing_file;
+}
+
+/*
+* Entries that need no subrequest: directories, the data given in the list
+* after "@inline:", and empty files. The CRC-32 of what is at hand is
+* computed here, so only the files that are fetched count as missing one.
+* Sizes left out ("-") are counted, to be asked for before the archive is
+* laid out. Entries of a size unknown until fetched ("*") are written with
+* a data descriptor, and their CRC-32 is always computed. A slice of its
+* location ("<offset>+<size>") is fetched with a Range.
+*/
+static ngx_int_t
+ngx_http_zip_check_location(ngx_http_zip_ctx_t *ctx, ngx_http_zip_file_t *parsing_file)
+{
+	if (parsing_file->args.len == 0
+	&& parsing_file->uri.len == sizeof("@directory") - 1
+	&& ngx_strncmp(parsing_file->uri.data, "@directory", parsing_file->uri.len) == 0) {
+		parsing_file->is_directory = 1;
+		// Directory has no content.
+		parsing_file->size = 0;
+		parsing_file->missing_size = 0;
+		parsing_file->is_stream = 0;
+		parsing_file->is_slice = 0;
+		parsing_file->crc32 = 0;
+		parsing_file->missing_crc32 = 0;
+		parsing_file->uri.data = NULL;
+		parsing_file->uri.len = 0;
+		parsing_file->args.data = NULL;
+		parsing_file->args.len = 0;
+		
+	} else if (parsing_file->uri.len >= sizeof("@inline:") - 1
+	&& ngx_strncmp(parsing_file->uri.data, "@inline:", sizeof("@inline:") - 1) == 0) {
+		parsing_file->uri.data += sizeof("@inline:") - 1;
+		parsing_file->uri.len -= sizeof("@inline:") - 1;
+		if (parsing_file->missing_size || parsing_file->is_stream) {
+			parsing_file->size = parsing_file->uri.len;
+			parsing_file->missing_size = 0;
+			parsing_file->is_stream = 0;
+		}
+		if (parsing_file->args.len || parsing_file->is_slice
+		|| (off_t) parsing_file->uri.len != parsing_file->size) {
+			return NGX_ERROR;
+		}
+		parsing_file->is_inline = 1;
+		parsing_file->crc32 = ngx_crc32_long(parsing_file->uri.data, parsing_file->uri.len);
+		parsing_file->missing_crc32 = 0;
+		
+	} else if (parsing_file->size == 0 && !parsing_file->missing_size
+	&& !parsing_file->is_stream) {
+		parsing_file->is_inline = 1;
+		parsing_file->crc32 = 0;
+		parsing_file->missing_crc32 = 0;
+		ngx_str_null(&parsing_file->uri);
+		ngx_str_null(&parsing_file->args);
+	}
+	
+	if (parsing_file->is_stream) {
+		if (!parsing_file->missing_crc32) {
+			parsing_file->missing_crc32 = 1;
+			ngx_crc32_init(parsing_file->crc32);
+		}
+		ctx->stream = 1;
+	}
+	
+	if (parsing_file->missing_crc32) {
+		ctx->missing_crc32 = 1;
+	}
+	
+	if (parsing_file->missing_size) {
+		ctx->sizes_missing++;
+	}
+	
+	return NGX_OK;
 }
 
 static size_t
 destructive_url_decode_len(unsigned char* start, unsigned char* end)
 {
-	unsigned char *read_pos = start, *write_pos = start;
+	unsigned char *read_pos, *write_pos;
+	
+	/* most names have nothing to decode */
+	read_pos = memchr(start, '%', end - start);
+	if (read_pos == NULL) {
+		return end - start;
+	}
+	write_pos = read_pos;
 	
 	for (; read_pos < end; read_pos++) {
 		unsigned char ch = *read_pos;
@@ -69,334 +193,481 @@ int prefix, int suffix, ngx_http_zip_ctx_t *ctx)
 	return NGX_OK;
 }
 
+/*
+* Strings of the file list are copied out of the upstream buffers as they
+* are parsed, so the buffers can be reused. What ctx->parse_token holds,
+* the start of a line cut by the end of the last buffer, is put in front.
+*/
+static ngx_int_t
+ngx_http_zip_copy_token(ngx_http_zip_ctx_t *ctx, u_char *start, u_char *end,
+ngx_str_t *token)
+{
+	size_t  len = ctx->parse_token.len + (end - start);
+	u_char *data, *last;
+	
+	if ((data = ngx_pnalloc(ctx->files.pool, len)) == NULL) {
+		return NGX_ERROR;
+	}
+	
+	last = data;
+	if (ctx->parse_token.len) {
+		last = ngx_cpymem(last, ctx->parse_token.data, ctx->parse_token.len);
+	}
+	ngx_memcpy(last, start, end - start);
+	
+	ngx_str_null(&ctx->parse_token);
+	
+	token->data = data;
+	token->len = len;
+	
+	return NGX_OK;
+}
 
-#line 72 "ngx_http_zip_parsers.c"
-static const signed char _request_actions[] = {
-	0, 1, 2, 1, 3, 1, 4, 1,
-	6, 1, 7, 1, 8, 1, 9, 2,
-	0, 7, 2, 3, 1, 2, 5, 1,
-	0
-};
-
-static const signed char _request_key_offsets[] = {
-	0, 0, 7, 8, 11, 14, 16, 18,
-	19, 26, 27, 28, 31, 0
-};
-
-static const char _request_trans_keys[] = {
-	45, 48, 57, 65, 70, 97, 102, 32,
-	32, 48, 57, 32, 48, 57, 32, 63,
-	32, 63, 32, 32, 48, 57, 65, 70,
-	97, 102, 32, 32, 0, 10, 13, 10,
-	13, 45, 48, 57, 65, 70, 97, 102,
-	0
-};
-
-static const signed char _request_single_lengths[] = {
-	0, 1, 1, 1, 1, 2, 2, 1,
-	1, 1, 1, 3, 3, 0
-};
-
-static const signed char _request_range_lengths[] = {
-	0, 3, 0, 1, 1, 0, 0, 0,
-	3, 0, 0, 0, 3, 0
-};
-
-static const signed char _request_index_offsets[] = {
-	0, 0, 5, 7, 10, 13, 16, 19,
-	21, 26, 28, 30, 34, 0
-};
-
-static const signed char _request_cond_targs[] = {
-	2, 8, 8, 8, 0, 3, 0, 3,
-	4, 0, 5, 4, 0, 5, 0, 6,
-	7, 9, 6, 7, 11, 3, 8, 8,
-	8, 0, 0, 10, 7, 10, 0, 12,
-	12, 11, 12, 12, 2, 8, 8, 8,
-	0, 0, 1, 2, 3, 4, 5, 6,
-	7, 8, 9, 10, 11, 12, 0
-};
-
-static const signed char _request_cond_actions[] = {
-	15, 15, 15, 15, 0, 0, 0, 0,
-	7, 0, 0, 7, 0, 0, 0, 1,
-	18, 3, 0, 0, 11, 0, 9, 9,
-	9, 0, 0, 5, 21, 0, 0, 13,
-	13, 0, 0, 0, 15, 15, 15, 15,
-	0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 13, 0, 0
-};
-
-static const signed char _request_eof_trans[] = {
-	42, 43, 44, 45, 46, 47, 48, 49,
-	50, 51, 52, 53, 54, 0
-};
-
-static const int request_start = 1;
+/*
+* The location of a file or of an alternate one: [^?| ]+ ( "?" [^| ]+ )?,
+* where "|" only ends it if alternate locations are split off at all.
+*/
+static u_char *
+ngx_http_zip_scan_location(u_char *p, u_char *eol, ngx_uint_t mirrors,
+u_char **uri_end, u_char **args)
+{
+	u_char *uri = p, bar = mirrors ? '|' : ' ';
+	
+	for ( /* void */ ; p < eol && *p != ' ' && *p != '?' && *p != bar; p++) { /* void */ }
+	
+	if (p == uri) {
+		return NULL;
+	}
+	*uri_end = p;
+	*args = NULL;
+	
+	if (p < eol && *p == '?') {
+		*args = ++p;
+		for ( /* void */ ; p < eol && *p != ' ' && *p != bar; p++) { /* void */ }
+		
+		if (p == *args) {
+			return NULL;
+		}
+	}
+	
+	return p;
+}
 
-static const int request_en_main = 1;
+static ngx_int_t
+ngx_http_zip_add_mirror(ngx_http_zip_ctx_t *ctx, ngx_http_zip_file_t *parsing_file,
+u_char *start, u_char *end)
+{
+	ngx_http_zip_mirror_t *mirror;
+	ngx_str_t mirror_str;
+	u_char *q;
+	
+	/* what needs no subrequest has no use for them */
+	if (parsing_file->is_directory || parsing_file->is_inline) {
+		return NGX_OK;
+	}
+	
+	if (ngx_http_zip_copy_token(ctx, start, end, &mirror_str) == NGX_ERROR) {
+		return NGX_ERROR;
+	}
+	if (parsing_file->mirrors == NULL) {
+		parsing_file->mirrors = ngx_array_create(ctx->files.pool, 1,
+		sizeof(ngx_http_zip_mirror_t));
+		if (parsing_file->mirrors == NULL) {
+			return NGX_ERROR;
+		}
+	}
+	if ((mirror = ngx_array_push(parsing_file->mirrors)) == NULL) {
+		return NGX_ERROR;
+	}
+	ngx_str_null(&mirror->args);
+	q = ngx_strlchr(mirror_str.data, mirror_str.data + mirror_str.len, '?');
+	if (q) {
+		mirror->args.data = q + 1;
+		mirror->args.len = mirror_str.data + mirror_str.len - q - 1;
+	} else {
+		q = mirror_str.data + mirror_str.len;
+	}
+	mirror->uri.data = mirror_str.data;
+	mirror->uri.len = destructive_url_decode_len(mirror_str.data, q);
+	
+	return NGX_OK;
+}
 
+/*
+* A line of the file list, up to eol (a line break or the end of the list):
+*
+*     <crc> <size> <uri>[?<args>][|<uri>[?<args>]]... <filename>
+*
+* where <crc> is hex or "-", <size> is decimal, "<offset>+<size>", "-" or
+* "*", the fields are separated by one or more spaces, and the filename
+* runs to the end of the line. The searches are plain loops and memchr(),
+* instead of an action on every byte. Alternate locations are only split
+* off with zip_hedge_delay, which uses them (ctx->mirrors); otherwise a "|"
+* is a part of the location or its arguments, as it was before them.
+*/
+static ngx_int_t
+ngx_http_zip_parse_line(ngx_http_zip_ctx_t *ctx, u_char *p, u_char *eol)
+{
+	u_char *crc, *uri, *uri_end, *args, *args_end, *name, c;
+	uint32_t crc32 = 0;
+	off_t size = 0, offset = 0;
+	ngx_uint_t missing_crc32 = 0, missing_size = 0, stream = 0, slice = 0;
+	ngx_http_zip_file_t *parsing_file;
+	
+	if (p < eol && *p == '-') {
+		missing_crc32 = 1;
+		p++;
+	} else {
+		for (crc = p; p < eol; p++) {
+			c = *p;
+			if (c >= '0' && c <= '9') {
+				crc32 = crc32 * 16 + (c - '0');
+				continue;
+			}
+			c |= 0x20;
+			if (c < 'a' || c > 'f') {
+				break;
+			}
+			crc32 = crc32 * 16 + (c - 'a' + 10);
+		}
+		if (p == crc) {
+			return NGX_ERROR;
+		}
+	}
+	
+	if (p == eol || *p != ' ') {
+		return NGX_ERROR;
+	}
+	while (p < eol && *p == ' ') {
+		p++;
+	}
+	
+	if (p < eol && *p == '-') {
+		missing_size = 1;
+		p++;
+	} else if (p < eol && *p == '*') {
+		stream = 1;
+		p++;
+	} else {
+		if (p == eol || *p < '0' || *p > '9') {
+			return NGX_ERROR;
+		}
+		while (p < eol && *p >= '0' && *p <= '9') {
+			size = size * 10 + (*p++ - '0');
+		}
+		if (p < eol && *p == '+') {
+			slice = 1;
+			offset = size;
+			size = 0;
+			if (++p == eol || *p < '0' || *p > '9') {
+				return NGX_ERROR;
+			}
+			while (p < eol && *p >= '0' && *p <= '9') {
+				size = size * 10 + (*p++ - '0');
+			}
+		}
+	}
+	
+	if (p == eol || *p != ' ') {
+		return NGX_ERROR;
+	}
+	while (p < eol && *p == ' ') {
+		p++;
+	}
+	
+	uri = p;
+	if ((p = ngx_http_zip_scan_location(p, eol, ctx->mirrors, &uri_end, &args)) == NULL) {
+		return NGX_ERROR;
+	}
+	args_end = p;
+	
+	if ((parsing_file = ngx_http_zip_push_file(ctx)) == NULL) {
+		return NGX_ERROR;
+	}
+	
+	if (missing_crc32) {
+		parsing_file->missing_crc32 = 1;
+		ngx_crc32_init(parsing_file->crc32);
+	} else {
+		parsing_file->crc32 = crc32;
+	}
+	parsing_file->size = size;
+	parsing_file->missing_size = missing_size;
+	parsing_file->is_stream = stream;
+	parsing_file->is_slice = slice;
+	parsing_file->source_offset = offset;
+	
+	if (ngx_http_zip_copy_token(ctx, uri, uri_end, &parsing_file->uri) == NGX_ERROR) {
+		return NGX_ERROR;
+	}
+	parsing_file->uri.len = destructive_url_decode_len(parsing_file->uri.data,
+	parsing_file->uri.data + parsing_file->uri.len);
+	
+	if (args && ngx_http_zip_copy_token(ctx, args, args_end, &parsing_file->args) == NGX_ERROR) {
+		return NGX_ERROR;
+	}
+	
+	if (ngx_http_zip_check_location(ctx, parsing_file) == NGX_ERROR) {
+		return NGX_ERROR;
+	}
+	
+	while (p < eol && *p == '|') {
+		uri = ++p;
+		if ((p = ngx_http_zip_scan_location(p, eol, ctx->mirrors, &uri_end, &args)) == NULL
+		|| ngx_http_zip_add_mirror(ctx, parsing_file, uri, p) == NGX_ERROR) {
+			return NGX_ERROR;
+		}
+	}
+	
+	if (p == eol || *p != ' ') {
+		return NGX_ERROR;
+	}
+	while (p < eol && *p == ' ') {
+		p++;
+	}
+	
+	name = p;
+	if (p == eol || memchr(p, '\0', eol - p)) {
+		return NGX_ERROR;
+	}
+	
+	return ngx_http_zip_copy_token(ctx, name, eol, &parsing_file->filename);
+}
 
-#line 74 "ngx_http_zip_parsers.rl"
+static ngx_int_t
+ngx_http_zip_add_binary_entry(ngx_http_zip_ctx_t *ctx, u_char *p)
+{
+	ngx_http_zip_binary_entry_t entry;
+	ngx_http_zip_file_t *parsing_file;
+	u_char *uri, *q;
+	
+	ngx_memcpy(&entry, p, sizeof(entry));
+	entry.size = le64toh(entry.size);
+	entry.flags = le16toh(entry.flags);
+	entry.uri_len = le16toh(entry.uri_len);
+	entry.name_len = le16toh(entry.name_len);
+	
+	if (entry.size > NGX_MAX_OFF_T_VALUE || entry.name_len == 0
+	|| (entry.uri_len == 0 && !(entry.flags & NGX_HTTP_ZIP_BINARY_DIRECTORY))) {
+		return NGX_ERROR;
+	}
+	
+	if ((parsing_file = ngx_http_zip_push_file(ctx)) == NULL) {
+		return NGX_ERROR;
+	}
+	
+	parsing_file->size = entry.size;
+	parsing_file->missing_size = !!(entry.flags & NGX_HTTP_ZIP_BINARY_MISSING_SIZE);
+	parsing_file->is_stream = !!(entry.flags & NGX_HTTP_ZIP_BINARY_STREAM);
+	parsing_file->unix_time = le32toh(entry.mtime);
+	parsing_file->mode = le16toh(entry.mode) & 07777;
+	
+	if (entry.flags & NGX_HTTP_ZIP_BINARY_MISSING_CRC32) {
+		parsing_file->missing_crc32 = 1;
+		ngx_crc32_init(parsing_file->crc32);
+	} else {
+		parsing_file->crc32 = le32toh(entry.crc32);
+	}
+	
+	p += sizeof(entry);
+	
+	if (entry.flags & NGX_HTTP_ZIP_BINARY_DIRECTORY) {
+		ngx_str_set(&parsing_file->uri, "@directory");
+		
+	} else {
+		/* the URI is taken as is, its arguments are after the first '?' */
+		if ((uri = ngx_pnalloc(ctx->files.pool, entry.uri_len)) == NULL) {
+			return NGX_ERROR;
+		}
+		ngx_memcpy(uri, p, entry.uri_len);
+		
+		q = NULL;
+		if (entry.uri_len < sizeof("@inline:") - 1
+		|| ngx_strncmp(uri, "@inline:", sizeof("@inline:") - 1) != 0) {
+			q = ngx_strlchr(uri, uri + entry.uri_len, '?');
+		}
+		if (q) {
+			parsing_file->args.data = q + 1;
+			parsing_file->args.len = uri + entry.uri_len - q - 1;
+		} else {
+			q = uri + entry.uri_len;
+		}
+		parsing_file->uri.data = uri;
+		parsing_file->uri.len = q - uri;
+	}
+	
+	p += entry.uri_len;
+	
+	if ((parsing_file->filename.data = ngx_pnalloc(ctx->files.pool, entry.name_len)) == NULL) {
+		return NGX_ERROR;
+	}
+	ngx_memcpy(parsing_file->filename.data, p, entry.name_len);
+	parsing_file->filename.len = entry.name_len;
+	
+	return ngx_http_zip_check_location(ctx, parsing_file);
+}
 
+static size_t
+ngx_http_zip_binary_entry_size(u_char *p)
+{
+	ngx_http_zip_binary_entry_t entry;
+	
+	ngx_memcpy(&entry, p, sizeof(entry));
+	
+	return sizeof(entry) + le16toh(entry.uri_len) + le16toh(entry.name_len);
+}
 
+/*
+* The binary file list ("X-Archive-Files: zip-bin"). An entry cut by the
+* end of a buffer is carried over in ctx->parse_token, in storage of its
+* full size once that is known.
+*/
 ngx_int_t
-ngx_http_zip_parse_request(ngx_http_zip_ctx_t *ctx)
+ngx_http_zip_parse_binary_request(ngx_http_zip_ctx_t *ctx, ngx_buf_t *buf)
 {
-	int cs;
-	u_char *p = ctx->unparsed_request.elts;
-	u_char *pe = p + ctx->unparsed_request.nelts;
-	u_char *eof = pe;
-	ngx_http_zip_file_t *parsing_file = NULL;
+	u_char *p = buf->pos, *last = buf->last, *data;
+	size_t size, n;
+	ngx_str_t *carry = &ctx->parse_token;
 	
-
-#line 149 "ngx_http_zip_parsers.c"
-	{
-		cs = (int)request_start;
-	}
-
-#line 152 "ngx_http_zip_parsers.c"
-	{
-		int _klen;
-		unsigned int _trans = 0;
-		const char * _keys;
-		const signed char * _acts;
-		unsigned int _nacts;
-		_resume: {}
-		if ( p == pe && p != eof )
-			goto _out;
-		if ( p == eof ) {
-			if ( _request_eof_trans[cs] > 0 ) {
-				_trans = (unsigned int)_request_eof_trans[cs] - 1;
-			}
-		}
-		else {
-			_keys = ( _request_trans_keys + (_request_key_offsets[cs]));
-			_trans = (unsigned int)_request_index_offsets[cs];
+	while (p < last) {
+		if (carry->len) {
+			size = carry->len < sizeof(ngx_http_zip_binary_entry_t)
+			? sizeof(ngx_http_zip_binary_entry_t)
+			: ngx_http_zip_binary_entry_size(carry->data);
 			
-			_klen = (int)_request_single_lengths[cs];
-			if ( _klen > 0 ) {
-				const char *_lower = _keys;
-				const char *_upper = _keys + _klen - 1;
-				const char *_mid;
-				while ( 1 ) {
-					if ( _upper < _lower ) {
-						_keys += _klen;
-						_trans += (unsigned int)_klen;
-						break;
-					}
-					
-					_mid = _lower + ((_upper-_lower) >> 1);
-					if ( ( (*( p))) < (*( _mid)) )
-						_upper = _mid - 1;
-					else if ( ( (*( p))) > (*( _mid)) )
-						_lower = _mid + 1;
-					else {
-						_trans += (unsigned int)(_mid - _keys);
-						goto _match;
-					}
-				}
+			n = ngx_min(size - carry->len, (size_t) (last - p));
+			ngx_memcpy(carry->data + carry->len, p, n);
+			carry->len += n;
+			p += n;
+			
+			if (carry->len < size) {
+				break;
 			}
 			
-			_klen = (int)_request_range_lengths[cs];
-			if ( _klen > 0 ) {
-				const char *_lower = _keys;
-				const char *_upper = _keys + (_klen<<1) - 2;
-				const char *_mid;
-				while ( 1 ) {
-					if ( _upper < _lower ) {
-						_trans += (unsigned int)_klen;
-						break;
-					}
-					
-					_mid = _lower + (((_upper-_lower) >> 1) & ~1);
-					if ( ( (*( p))) < (*( _mid)) )
-						_upper = _mid - 2;
-					else if ( ( (*( p))) > (*( _mid + 1)) )
-						_lower = _mid + 2;
-					else {
-						_trans += (unsigned int)((_mid - _keys)>>1);
-						break;
-					}
+			if (size == sizeof(ngx_http_zip_binary_entry_t)
+			&& ngx_http_zip_binary_entry_size(carry->data) > size) {
+				size = ngx_http_zip_binary_entry_size(carry->data);
+				if ((data = ngx_pnalloc(ctx->files.pool, size)) == NULL) {
+					return NGX_ERROR;
 				}
+				ngx_memcpy(data, carry->data, carry->len);
+				carry->data = data;
+				continue;
 			}
 			
-			_match: {}
+			if (ngx_http_zip_add_binary_entry(ctx, carry->data) == NGX_ERROR) {
+				return NGX_ERROR;
+			}
+			ngx_str_null(carry);
+			continue;
 		}
-		cs = (int)_request_cond_targs[_trans];
 		
-		if ( _request_cond_actions[_trans] != 0 ) {
-			
-			_acts = ( _request_actions + (_request_cond_actions[_trans]));
-			_nacts = (unsigned int)(*( _acts));
-			_acts += 1;
-			while ( _nacts > 0 ) {
-				switch ( (*( _acts)) )
-				{
-					case 0:  {
-							{
-#line 87 "ngx_http_zip_parsers.rl"
-							
-							parsing_file = ngx_array_push(&ctx->files);
-							ngx_http_zip_file_init(parsing_file);
-							
-							parsing_file->index = ctx->files.nelts - 1;
-						}
-						
-#line 239 "ngx_http_zip_parsers.c"
-
-						break; 
-					}
-					case 1:  {
-							{
-#line 94 "ngx_http_zip_parsers.rl"
-							
-							if (parsing_file->args.len == 0
-							&& parsing_file->uri.len == sizeof("@directory") - 1
-							&& ngx_strncmp(parsing_file->uri.data, "@directory", parsing_file->uri.len) == 0) {
-								parsing_file->is_directory = 1;
-								// Directory has no content.
-								parsing_file->size = 0;
-								parsing_file->crc32 = 0;
-								parsing_file->missing_crc32 = 0;
-								parsing_file->uri.data = NULL;
-								parsing_file->uri.len = 0;
-								parsing_file->args.data = NULL;
-								parsing_file->args.len = 0;
-							}
-						}
-						
-#line 261 "ngx_http_zip_parsers.c"
-
-						break; 
-					}
-					case 2:  {
-							{
-#line 110 "ngx_http_zip_parsers.rl"
-							
-							parsing_file->uri.data = p;
-							parsing_file->uri.len = 1;
-						}
-						
-#line 272 "ngx_http_zip_parsers.c"
-
-						break; 
-					}
-					case 3:  {
-							{
-#line 115 "ngx_http_zip_parsers.rl"
-							
-							parsing_file->uri.len = destructive_url_decode_len(parsing_file->uri.data, p);
-						}
-						
-#line 282 "ngx_http_zip_parsers.c"
-
-						break; 
-					}
-					case 4:  {
-							{
-#line 118 "ngx_http_zip_parsers.rl"
-							
-							parsing_file->args.data = p;
-						}
-						
-#line 292 "ngx_http_zip_parsers.c"
-
-						break; 
-					}
-					case 5:  {
-							{
-#line 121 "ngx_http_zip_parsers.rl"
-							
-							parsing_file->args.len = p - parsing_file->args.data;
-						}
-						
-#line 302 "ngx_http_zip_parsers.c"
-
-						break; 
-					}
-					case 6:  {
-							{
-#line 124 "ngx_http_zip_parsers.rl"
-							
-							parsing_file->size = parsing_file->size * 10 + ((( (*( p)))) - '0');
-						}
-						
-#line 312 "ngx_http_zip_parsers.c"
-
-						break; 
-					}
-					case 7:  {
-							{
-#line 127 "ngx_http_zip_parsers.rl"
-							
-							if ((( (*( p)))) == '-') {
-								ctx->missing_crc32 = 1;
-								parsing_file->missing_crc32 = 1;
-								ngx_crc32_init(parsing_file->crc32);
-							} else {
-								parsing_file->crc32 *= 16;
-								parsing_file->crc32 += ngx_hextoi(p, 1);
-							}
-						}
-						
-#line 329 "ngx_http_zip_parsers.c"
-
-						break; 
-					}
-					case 8:  {
-							{
-#line 137 "ngx_http_zip_parsers.rl"
-							
-							parsing_file->filename.data = p;
-						}
-						
-#line 339 "ngx_http_zip_parsers.c"
+		n = last - p;
+		size = n < sizeof(ngx_http_zip_binary_entry_t)
+		? sizeof(ngx_http_zip_binary_entry_t)
+		: ngx_http_zip_binary_entry_size(p);
+		
+		if (n < size) {
+			if ((carry->data = ngx_pnalloc(ctx->files.pool, size)) == NULL) {
+				return NGX_ERROR;
+			}
+			ngx_memcpy(carry->data, p, n);
+			carry->len = n;
+			break;
+		}
+		
+		if (ngx_http_zip_add_binary_entry(ctx, p) == NGX_ERROR) {
+			return NGX_ERROR;
+		}
+		p += size;
+	}
+	
+	if (!buf->last_buf) {
+		return NGX_AGAIN;
+	}
+	
+	if (carry->len || ctx->files_n == 0) {
+		return NGX_ERROR;
+	}
+	
+	ctx->parsed = 1;
+	
+	return NGX_OK;
+}
 
-						break; 
-					}
-					case 9:  {
-							{
-#line 140 "ngx_http_zip_parsers.rl"
-							
-							parsing_file->filename.len = p - parsing_file->filename.data;
-						}
-						
-#line 349 "ngx_http_zip_parsers.c"
+/* a line ends with CR or LF, whichever comes first */
+static u_char *
+ngx_http_zip_find_eol(u_char *p, u_char *last)
+{
+	u_char *lf, *cr;
+	
+	lf = memchr(p, LF, last - p);
+	cr = memchr(p, CR, (lf ? lf : last) - p);
+	
+	return cr ? cr : lf;
+}
 
-						break; 
-					}
-				}
-				_nacts -= 1;
-				_acts += 1;
+/*
+* The text file list, a line at a time as its buffers arrive. Only the
+* strings of the files are kept, see ngx_http_zip_copy_token(); a line cut
+* by the end of a buffer is carried over in ctx->parse_token. Lines are
+* separated by any number of line breaks, and the list must not start with
+* one.
+*/
+ngx_int_t
+ngx_http_zip_parse_request(ngx_http_zip_ctx_t *ctx, ngx_buf_t *buf)
+{
+	u_char *p = buf->pos, *last = buf->last, *eol;
+	ngx_str_t line;
+	
+	if (p == NULL) {
+		p = last = (u_char *) "";
+	}
+	
+	while (p < last) {
+		if (ctx->parse_token.len == 0 && (*p == CR || *p == LF)) {
+			if (ctx->files_n == 0) {
+				return NGX_ERROR;
 			}
-			
+			p++;
+			continue;
 		}
 		
-		if ( p == eof ) {
-			if ( cs >= 11 )
-				goto _out;
+		if ((eol = ngx_http_zip_find_eol(p, last)) == NULL) {
+			if (ngx_http_zip_copy_token(ctx, p, last, &line) == NGX_ERROR) {
+				return NGX_ERROR;
+			}
+			ctx->parse_token = line;
+			break;
 		}
-		else {
-			if ( cs != 0 ) {
-				p += 1;
-				goto _resume;
+		
+		if (ctx->parse_token.len) {
+			if (ngx_http_zip_copy_token(ctx, p, eol, &line) == NGX_ERROR
+			|| ngx_http_zip_parse_line(ctx, line.data, line.data + line.len) == NGX_ERROR) {
+				return NGX_ERROR;
 			}
+		} else if (ngx_http_zip_parse_line(ctx, p, eol) == NGX_ERROR) {
+			return NGX_ERROR;
 		}
-		_out: {}
+		
+		p = eol;
 	}
 	
-#line 160 "ngx_http_zip_parsers.rl"
-
+	if (!buf->last_buf) {
+		return NGX_AGAIN;
+	}
 	
-	/* suppress warning */
-	(void)request_en_main;
+	/* the last line may end with the list */
+	if (ctx->parse_token.len) {
+		line = ctx->parse_token;
+		ngx_str_null(&ctx->parse_token);
+		
+		if (ngx_http_zip_parse_line(ctx, line.data, line.data + line.len) == NGX_ERROR) {
+			return NGX_ERROR;
+		}
+	}
 	
-	if (cs < 
-#line 377 "ngx_http_zip_parsers.c"
-11
-#line 165 "ngx_http_zip_parsers.rl"
-) {
+	if (ctx->files_n == 0) {
 		return NGX_ERROR;
 	}
 	
@@ -406,7 +677,7 @@ ngx_http_zip_parse_request(ngx_http_zip_ctx_t *ctx)
 }
 
 
-#line 387 "ngx_http_zip_parsers.c"
+#line 679 "ngx_http_zip_parsers.c"
 static const signed char _range_actions[] = {
 	0, 1, 0, 1, 1, 1, 2, 2,
 	0, 1, 2, 3, 1, 0
@@ -459,7 +730,7 @@ static const int range_start = 1;
 static const int range_en_main = 1;
 
 
-#line 177 "ngx_http_zip_parsers.rl"
+#line 681 "ngx_http_zip_parsers.rl"
 
 
 ngx_int_t
@@ -472,12 +743,12 @@ ngx_http_zip_parse_range(ngx_http_request_t *r, ngx_str_t *range_str, ngx_http_z
 	u_char *pe = range_str->data + range_str->len;
 	
 
-#line 450 "ngx_http_zip_parsers.c"
+#line 742 "ngx_http_zip_parsers.c"
 	{
 		cs = (int)range_start;
 	}
 
-#line 453 "ngx_http_zip_parsers.c"
+#line 745 "ngx_http_zip_parsers.c"
 	{
 		int _klen;
 		unsigned int _trans = 0;
@@ -550,7 +821,7 @@ ngx_http_zip_parse_range(ngx_http_request_t *r, ngx_str_t *range_str, ngx_http_z
 				{
 					case 0:  {
 							{
-#line 189 "ngx_http_zip_parsers.rl"
+#line 693 "ngx_http_zip_parsers.rl"
 							
 							if (range) {
 								if (ngx_http_zip_clean_range(range, prefix, suffix, ctx) == NGX_ERROR) {
@@ -565,34 +836,34 @@ ngx_http_zip_parse_range(ngx_http_request_t *r, ngx_str_t *range_str, ngx_http_z
 							prefix = 1;
 						}
 						
-#line 540 "ngx_http_zip_parsers.c"
+#line 832 "ngx_http_zip_parsers.c"
 
 						break; 
 					}
 					case 1:  {
 							{
-#line 203 "ngx_http_zip_parsers.rl"
+#line 707 "ngx_http_zip_parsers.rl"
 							range->start = range->start * 10 + ((( (*( p)))) - '0'); }
 						
-#line 548 "ngx_http_zip_parsers.c"
+#line 840 "ngx_http_zip_parsers.c"
 
 						break; 
 					}
 					case 2:  {
 							{
-#line 205 "ngx_http_zip_parsers.rl"
+#line 709 "ngx_http_zip_parsers.rl"
 							range->end = range->end * 10 + ((( (*( p)))) - '0'); prefix = 0; }
 						
-#line 556 "ngx_http_zip_parsers.c"
+#line 848 "ngx_http_zip_parsers.c"
 
 						break; 
 					}
 					case 3:  {
 							{
-#line 207 "ngx_http_zip_parsers.rl"
+#line 711 "ngx_http_zip_parsers.rl"
 							suffix = 1; }
 						
-#line 564 "ngx_http_zip_parsers.c"
+#line 856 "ngx_http_zip_parsers.c"
 
 						break; 
 					}
@@ -610,16 +881,16 @@ ngx_http_zip_parse_range(ngx_http_request_t *r, ngx_str_t *range_str, ngx_http_z
 		_out: {}
 	}
 	
-#line 220 "ngx_http_zip_parsers.rl"
+#line 724 "ngx_http_zip_parsers.rl"
 
 	
 	/* suppress warning */
 	(void)range_en_main;
 	
 	if (cs < 
-#line 586 "ngx_http_zip_parsers.c"
+#line 878 "ngx_http_zip_parsers.c"
 10
-#line 225 "ngx_http_zip_parsers.rl"
+#line 729 "ngx_http_zip_parsers.rl"
 ) {
 		return NGX_ERROR;
 	}
@@ -2,6 +2,25 @@
 
 #include "ngx_http_zip_module.h"
 #include "ngx_http_zip_parsers.h"
+#include "ngx_http_zip_endian.h"
+
+/* an entry of the binary file list, followed by its URI and name */
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t    crc32;
+    uint64_t    size;
+    uint32_t    mtime; // 0: the time of the request
+    uint16_t    mode; // permission bits, 0: the defaults
+    uint16_t    flags;
+    uint16_t    uri_len;
+    uint16_t    name_len;
+} ngx_http_zip_binary_entry_t;
+#pragma pack(pop)
+
+#define NGX_HTTP_ZIP_BINARY_MISSING_CRC32   0x0001
+#define NGX_HTTP_ZIP_BINARY_DIRECTORY       0x0002
+#define NGX_HTTP_ZIP_BINARY_MISSING_SIZE    0x0004
+#define NGX_HTTP_ZIP_BINARY_STREAM          0x0008
 
 static void
 ngx_http_zip_file_init(ngx_http_zip_file_t *parsing_file)
@@ -11,22 +30,127 @@ ngx_http_zip_file_init(ngx_http_zip_file_t *parsing_file)
     ngx_str_null(&parsing_file->filename);
     ngx_str_null(&parsing_file->filename_utf8);
 
+    parsing_file->mirrors = NULL;
+
     parsing_file->header_sent = 0;
     parsing_file->trailer_sent = 0;
 
     parsing_file->crc32 = 0;
     parsing_file->size = 0;
+    parsing_file->source_offset = 0;
+    parsing_file->unix_time = 0;
+    parsing_file->mode = 0;
 
     parsing_file->missing_crc32 = 0;
+    parsing_file->missing_size = 0;
     parsing_file->need_zip64 = 0;
     parsing_file->need_zip64_offset = 0;
     parsing_file->is_directory = 0;
+    parsing_file->is_inline = 0;
+    parsing_file->is_stream = 0;
+    parsing_file->is_slice = 0;
+}
+
+static ngx_http_zip_file_t *
+ngx_http_zip_push_file(ngx_http_zip_ctx_t *ctx)
+{
+    ngx_http_zip_file_t *parsing_file;
+
+    parsing_file = ngx_list_push(&ctx->files);
+    if (parsing_file == NULL) {
+        return NULL;
+    }
+    ngx_http_zip_file_init(parsing_file);
+
+    parsing_file->index = ctx->files_n++;
+
+    return parsing_file;
+}
+
+/*
+ * Entries that need no subrequest: directories, the data given in the list
+ * after "@inline:", and empty files. The CRC-32 of what is at hand is
+ * computed here, so only the files that are fetched count as missing one.
+ * Sizes left out ("-") are counted, to be asked for before the archive is
+ * laid out. Entries of a size unknown until fetched ("*") are written with
+ * a data descriptor, and their CRC-32 is always computed. A slice of its
+ * location ("<offset>+<size>") is fetched with a Range.
+ */
+static ngx_int_t
+ngx_http_zip_check_location(ngx_http_zip_ctx_t *ctx, ngx_http_zip_file_t *parsing_file)
+{
+    if (parsing_file->args.len == 0
+            && parsing_file->uri.len == sizeof("@directory") - 1
+            && ngx_strncmp(parsing_file->uri.data, "@directory", parsing_file->uri.len) == 0) {
+        parsing_file->is_directory = 1;
+        // Directory has no content.
+        parsing_file->size = 0;
+        parsing_file->missing_size = 0;
+        parsing_file->is_stream = 0;
+        parsing_file->is_slice = 0;
+        parsing_file->crc32 = 0;
+        parsing_file->missing_crc32 = 0;
+        parsing_file->uri.data = NULL;
+        parsing_file->uri.len = 0;
+        parsing_file->args.data = NULL;
+        parsing_file->args.len = 0;
+
+    } else if (parsing_file->uri.len >= sizeof("@inline:") - 1
+            && ngx_strncmp(parsing_file->uri.data, "@inline:", sizeof("@inline:") - 1) == 0) {
+        parsing_file->uri.data += sizeof("@inline:") - 1;
+        parsing_file->uri.len -= sizeof("@inline:") - 1;
+        if (parsing_file->missing_size || parsing_file->is_stream) {
+            parsing_file->size = parsing_file->uri.len;
+            parsing_file->missing_size = 0;
+            parsing_file->is_stream = 0;
+        }
+        if (parsing_file->args.len || parsing_file->is_slice
+                || (off_t) parsing_file->uri.len != parsing_file->size) {
+            return NGX_ERROR;
+        }
+        parsing_file->is_inline = 1;
+        parsing_file->crc32 = ngx_crc32_long(parsing_file->uri.data, parsing_file->uri.len);
+        parsing_file->missing_crc32 = 0;
+
+    } else if (parsing_file->size == 0 && !parsing_file->missing_size
+            && !parsing_file->is_stream) {
+        parsing_file->is_inline = 1;
+        parsing_file->crc32 = 0;
+        parsing_file->missing_crc32 = 0;
+        ngx_str_null(&parsing_file->uri);
+        ngx_str_null(&parsing_file->args);
+    }
+
+    if (parsing_file->is_stream) {
+        if (!parsing_file->missing_crc32) {
+            parsing_file->missing_crc32 = 1;
+            ngx_crc32_init(parsing_file->crc32);
+        }
+        ctx->stream = 1;
+    }
+
+    if (parsing_file->missing_crc32) {
+        ctx->missing_crc32 = 1;
+    }
+
+    if (parsing_file->missing_size) {
+        ctx->sizes_missing++;
+    }
+
+    return NGX_OK;
 }
 
 static size_t
 destructive_url_decode_len(unsigned char* start, unsigned char* end)
 {
-    unsigned char *read_pos = start, *write_pos = start;
+    unsigned char *read_pos, *write_pos;
+
+    /* most names have nothing to decode */
+    read_pos = memchr(start, '%', end - start);
+    if (read_pos == NULL) {
+        return end - start;
+    }
+    write_pos = read_pos;
 
     for (; read_pos < end; read_pos++) {
         unsigned char ch = *read_pos;
@@ -68,101 +192,481 @@ ngx_http_zip_clean_range(ngx_http_zip_range_t *range,
     return NGX_OK;
 }
 
-%%{
-    machine request;
-    write data noerror nofinal;
-}%%
+/*
+ * Strings of the file list are copied out of the upstream buffers as they
+ * are parsed, so the buffers can be reused. What ctx->parse_token holds,
+ * the start of a line cut by the end of the last buffer, is put in front.
+ */
+static ngx_int_t
+ngx_http_zip_copy_token(ngx_http_zip_ctx_t *ctx, u_char *start, u_char *end,
+        ngx_str_t *token)
+{
+    size_t  len = ctx->parse_token.len + (end - start);
+    u_char *data, *last;
 
-ngx_int_t
-ngx_http_zip_parse_request(ngx_http_zip_ctx_t *ctx)
+    if ((data = ngx_pnalloc(ctx->files.pool, len)) == NULL) {
+        return NGX_ERROR;
+    }
+
+    last = data;
+    if (ctx->parse_token.len) {
+        last = ngx_cpymem(last, ctx->parse_token.data, ctx->parse_token.len);
+    }
+    ngx_memcpy(last, start, end - start);
+
+    ngx_str_null(&ctx->parse_token);
+
+    token->data = data;
+    token->len = len;
+
+    return NGX_OK;
+}
+
+/*
+ * The location of a file or of an alternate one: [^?| ]+ ( "?" [^| ]+ )?,
+ * where "|" only ends it if alternate locations are split off at all.
+ */
+static u_char *
+ngx_http_zip_scan_location(u_char *p, u_char *eol, ngx_uint_t mirrors,
+        u_char **uri_end, u_char **args)
 {
-    int cs;
-    u_char *p = ctx->unparsed_request.elts;
-    u_char *pe = p + ctx->unparsed_request.nelts;
-    u_char *eof = pe;
-    ngx_http_zip_file_t *parsing_file = NULL;
+    u_char *uri = p, bar = mirrors ? '|' : ' ';
 
-    %%{
+    for ( /* void */ ; p < eol && *p != ' ' && *p != '?' && *p != bar; p++) { /* void */ }
+
+    if (p == uri) {
+        return NULL;
+    }
+    *uri_end = p;
+    *args = NULL;
+
+    if (p < eol && *p == '?') {
+        *args = ++p;
+        for ( /* void */ ; p < eol && *p != ' ' && *p != bar; p++) { /* void */ }
+
+        if (p == *args) {
+            return NULL;
+        }
+    }
+
+    return p;
+}
+
+static ngx_int_t
+ngx_http_zip_add_mirror(ngx_http_zip_ctx_t *ctx, ngx_http_zip_file_t *parsing_file,
+        u_char *start, u_char *end)
+{
+    ngx_http_zip_mirror_t *mirror;
+    ngx_str_t mirror_str;
+    u_char *q;
+
+    /* what needs no subrequest has no use for them */
+    if (parsing_file->is_directory || parsing_file->is_inline) {
+        return NGX_OK;
+    }
+
+    if (ngx_http_zip_copy_token(ctx, start, end, &mirror_str) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+    if (parsing_file->mirrors == NULL) {
+        parsing_file->mirrors = ngx_array_create(ctx->files.pool, 1,
+                sizeof(ngx_http_zip_mirror_t));
+        if (parsing_file->mirrors == NULL) {
+            return NGX_ERROR;
+        }
+    }
+    if ((mirror = ngx_array_push(parsing_file->mirrors)) == NULL) {
+        return NGX_ERROR;
+    }
+    ngx_str_null(&mirror->args);
+    q = ngx_strlchr(mirror_str.data, mirror_str.data + mirror_str.len, '?');
+    if (q) {
+        mirror->args.data = q + 1;
+        mirror->args.len = mirror_str.data + mirror_str.len - q - 1;
+    } else {
+        q = mirror_str.data + mirror_str.len;
+    }
+    mirror->uri.data = mirror_str.data;
+    mirror->uri.len = destructive_url_decode_len(mirror_str.data, q);
 
-        action start_file {
-            parsing_file = ngx_array_push(&ctx->files);
-            ngx_http_zip_file_init(parsing_file);
-
-            parsing_file->index = ctx->files.nelts - 1;
-        }
-
-        action check_directory {
-            if (parsing_file->args.len == 0
-                    && parsing_file->uri.len == sizeof("@directory") - 1
-                    && ngx_strncmp(parsing_file->uri.data, "@directory", parsing_file->uri.len) == 0) {
-                parsing_file->is_directory = 1;
-                // Directory has no content.
-                parsing_file->size = 0;
-                parsing_file->crc32 = 0;
-                parsing_file->missing_crc32 = 0;
-                parsing_file->uri.data = NULL;
-                parsing_file->uri.len = 0;
-                parsing_file->args.data = NULL;
-                parsing_file->args.len = 0;
+    return NGX_OK;
+}
+
+/*
+ * A line of the file list, up to eol (a line break or the end of the list):
+ *
+ *     <crc> <size> <uri>[?<args>][|<uri>[?<args>]]... <filename>
+ *
+ * where <crc> is hex or "-", <size> is decimal, "<offset>+<size>", "-" or
+ * "*", the fields are separated by one or more spaces, and the filename
+ * runs to the end of the line. The searches are plain loops and memchr(),
+ * instead of an action on every byte. Alternate locations are only split
+ * off with zip_hedge_delay, which uses them (ctx->mirrors); otherwise a "|"
+ * is a part of the location or its arguments, as it was before them.
+ */
+static ngx_int_t
+ngx_http_zip_parse_line(ngx_http_zip_ctx_t *ctx, u_char *p, u_char *eol)
+{
+    u_char *crc, *uri, *uri_end, *args, *args_end, *name, c;
+    uint32_t crc32 = 0;
+    off_t size = 0, offset = 0;
+    ngx_uint_t missing_crc32 = 0, missing_size = 0, stream = 0, slice = 0;
+    ngx_http_zip_file_t *parsing_file;
+
+    if (p < eol && *p == '-') {
+        missing_crc32 = 1;
+        p++;
+    } else {
+        for (crc = p; p < eol; p++) {
+            c = *p;
+            if (c >= '0' && c <= '9') {
+                crc32 = crc32 * 16 + (c - '0');
+                continue;
+            }
+            c |= 0x20;
+            if (c < 'a' || c > 'f') {
+                break;
             }
+            crc32 = crc32 * 16 + (c - 'a' + 10);
         }
+        if (p == crc) {
+            return NGX_ERROR;
+        }
+    }
 
-        action start_uri {
-            parsing_file->uri.data = fpc;
-            parsing_file->uri.len = 1;
+    if (p == eol || *p != ' ') {
+        return NGX_ERROR;
+    }
+    while (p < eol && *p == ' ') {
+        p++;
+    }
+
+    if (p < eol && *p == '-') {
+        missing_size = 1;
+        p++;
+    } else if (p < eol && *p == '*') {
+        stream = 1;
+        p++;
+    } else {
+        if (p == eol || *p < '0' || *p > '9') {
+            return NGX_ERROR;
+        }
+        while (p < eol && *p >= '0' && *p <= '9') {
+            size = size * 10 + (*p++ - '0');
         }
+        if (p < eol && *p == '+') {
+            slice = 1;
+            offset = size;
+            size = 0;
+            if (++p == eol || *p < '0' || *p > '9') {
+                return NGX_ERROR;
+            }
+            while (p < eol && *p >= '0' && *p <= '9') {
+                size = size * 10 + (*p++ - '0');
+            }
+        }
+    }
+
+    if (p == eol || *p != ' ') {
+        return NGX_ERROR;
+    }
+    while (p < eol && *p == ' ') {
+        p++;
+    }
 
-        action end_uri {
-            parsing_file->uri.len = destructive_url_decode_len(parsing_file->uri.data, fpc);
+    uri = p;
+    if ((p = ngx_http_zip_scan_location(p, eol, ctx->mirrors, &uri_end, &args)) == NULL) {
+        return NGX_ERROR;
+    }
+    args_end = p;
+
+    if ((parsing_file = ngx_http_zip_push_file(ctx)) == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (missing_crc32) {
+        parsing_file->missing_crc32 = 1;
+        ngx_crc32_init(parsing_file->crc32);
+    } else {
+        parsing_file->crc32 = crc32;
+    }
+    parsing_file->size = size;
+    parsing_file->missing_size = missing_size;
+    parsing_file->is_stream = stream;
+    parsing_file->is_slice = slice;
+    parsing_file->source_offset = offset;
+
+    if (ngx_http_zip_copy_token(ctx, uri, uri_end, &parsing_file->uri) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+    parsing_file->uri.len = destructive_url_decode_len(parsing_file->uri.data,
+            parsing_file->uri.data + parsing_file->uri.len);
+
+    if (args && ngx_http_zip_copy_token(ctx, args, args_end, &parsing_file->args) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_zip_check_location(ctx, parsing_file) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    while (p < eol && *p == '|') {
+        uri = ++p;
+        if ((p = ngx_http_zip_scan_location(p, eol, ctx->mirrors, &uri_end, &args)) == NULL
+                || ngx_http_zip_add_mirror(ctx, parsing_file, uri, p) == NGX_ERROR) {
+            return NGX_ERROR;
         }
-        action start_args {
-            parsing_file->args.data = fpc;
+    }
+
+    if (p == eol || *p != ' ') {
+        return NGX_ERROR;
+    }
+    while (p < eol && *p == ' ') {
+        p++;
+    }
+
+    name = p;
+    if (p == eol || memchr(p, '\0', eol - p)) {
+        return NGX_ERROR;
+    }
+
+    return ngx_http_zip_copy_token(ctx, name, eol, &parsing_file->filename);
+}
+
+static ngx_int_t
+ngx_http_zip_add_binary_entry(ngx_http_zip_ctx_t *ctx, u_char *p)
+{
+    ngx_http_zip_binary_entry_t entry;
+    ngx_http_zip_file_t *parsing_file;
+    u_char *uri, *q;
+
+    ngx_memcpy(&entry, p, sizeof(entry));
+    entry.size = le64toh(entry.size);
+    entry.flags = le16toh(entry.flags);
+    entry.uri_len = le16toh(entry.uri_len);
+    entry.name_len = le16toh(entry.name_len);
+
+    if (entry.size > NGX_MAX_OFF_T_VALUE || entry.name_len == 0
+            || (entry.uri_len == 0 && !(entry.flags & NGX_HTTP_ZIP_BINARY_DIRECTORY))) {
+        return NGX_ERROR;
+    }
+
+    if ((parsing_file = ngx_http_zip_push_file(ctx)) == NULL) {
+        return NGX_ERROR;
+    }
+
+    parsing_file->size = entry.size;
+    parsing_file->missing_size = !!(entry.flags & NGX_HTTP_ZIP_BINARY_MISSING_SIZE);
+    parsing_file->is_stream = !!(entry.flags & NGX_HTTP_ZIP_BINARY_STREAM);
+    parsing_file->unix_time = le32toh(entry.mtime);
+    parsing_file->mode = le16toh(entry.mode) & 07777;
+
+    if (entry.flags & NGX_HTTP_ZIP_BINARY_MISSING_CRC32) {
+        parsing_file->missing_crc32 = 1;
+        ngx_crc32_init(parsing_file->crc32);
+    } else {
+        parsing_file->crc32 = le32toh(entry.crc32);
+    }
+
+    p += sizeof(entry);
+
+    if (entry.flags & NGX_HTTP_ZIP_BINARY_DIRECTORY) {
+        ngx_str_set(&parsing_file->uri, "@directory");
+
+    } else {
+        /* the URI is taken as is, its arguments are after the first '?' */
+        if ((uri = ngx_pnalloc(ctx->files.pool, entry.uri_len)) == NULL) {
+            return NGX_ERROR;
         }
-        action end_args {
-            parsing_file->args.len = fpc - parsing_file->args.data;
+        ngx_memcpy(uri, p, entry.uri_len);
+
+        q = NULL;
+        if (entry.uri_len < sizeof("@inline:") - 1
+                || ngx_strncmp(uri, "@inline:", sizeof("@inline:") - 1) != 0) {
+            q = ngx_strlchr(uri, uri + entry.uri_len, '?');
         }
-        action size_incr {
-            parsing_file->size = parsing_file->size * 10 + (fc - '0');
+        if (q) {
+            parsing_file->args.data = q + 1;
+            parsing_file->args.len = uri + entry.uri_len - q - 1;
+        } else {
+            q = uri + entry.uri_len;
         }
-        action crc_incr {
-            if (fc == '-') {
-                ctx->missing_crc32 = 1;
-                parsing_file->missing_crc32 = 1;
-                ngx_crc32_init(parsing_file->crc32);
-            } else {
-                parsing_file->crc32 *= 16;
-                parsing_file->crc32 += ngx_hextoi(fpc, 1);
+        parsing_file->uri.data = uri;
+        parsing_file->uri.len = q - uri;
+    }
+
+    p += entry.uri_len;
+
+    if ((parsing_file->filename.data = ngx_pnalloc(ctx->files.pool, entry.name_len)) == NULL) {
+        return NGX_ERROR;
+    }
+    ngx_memcpy(parsing_file->filename.data, p, entry.name_len);
+    parsing_file->filename.len = entry.name_len;
+
+    return ngx_http_zip_check_location(ctx, parsing_file);
+}
+
+static size_t
+ngx_http_zip_binary_entry_size(u_char *p)
+{
+    ngx_http_zip_binary_entry_t entry;
+
+    ngx_memcpy(&entry, p, sizeof(entry));
+
+    return sizeof(entry) + le16toh(entry.uri_len) + le16toh(entry.name_len);
+}
+
+/*
+ * The binary file list ("X-Archive-Files: zip-bin"). An entry cut by the
+ * end of a buffer is carried over in ctx->parse_token, in storage of its
+ * full size once that is known.
+ */
+ngx_int_t
+ngx_http_zip_parse_binary_request(ngx_http_zip_ctx_t *ctx, ngx_buf_t *buf)
+{
+    u_char *p = buf->pos, *last = buf->last, *data;
+    size_t size, n;
+    ngx_str_t *carry = &ctx->parse_token;
+
+    while (p < last) {
+        if (carry->len) {
+            size = carry->len < sizeof(ngx_http_zip_binary_entry_t)
+                   ? sizeof(ngx_http_zip_binary_entry_t)
+                   : ngx_http_zip_binary_entry_size(carry->data);
+
+            n = ngx_min(size - carry->len, (size_t) (last - p));
+            ngx_memcpy(carry->data + carry->len, p, n);
+            carry->len += n;
+            p += n;
+
+            if (carry->len < size) {
+                break;
             }
+
+            if (size == sizeof(ngx_http_zip_binary_entry_t)
+                    && ngx_http_zip_binary_entry_size(carry->data) > size) {
+                size = ngx_http_zip_binary_entry_size(carry->data);
+                if ((data = ngx_pnalloc(ctx->files.pool, size)) == NULL) {
+                    return NGX_ERROR;
+                }
+                ngx_memcpy(data, carry->data, carry->len);
+                carry->data = data;
+                continue;
+            }
+
+            if (ngx_http_zip_add_binary_entry(ctx, carry->data) == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+            ngx_str_null(carry);
+            continue;
         }
-        action start_filename {
-            parsing_file->filename.data = fpc;
+
+        n = last - p;
+        size = n < sizeof(ngx_http_zip_binary_entry_t)
+               ? sizeof(ngx_http_zip_binary_entry_t)
+               : ngx_http_zip_binary_entry_size(p);
+
+        if (n < size) {
+            if ((carry->data = ngx_pnalloc(ctx->files.pool, size)) == NULL) {
+                return NGX_ERROR;
+            }
+            ngx_memcpy(carry->data, p, n);
+            carry->len = n;
+            break;
         }
-        action end_filename {
-            parsing_file->filename.len = fpc - parsing_file->filename.data;
+
+        if (ngx_http_zip_add_binary_entry(ctx, p) == NGX_ERROR) {
+            return NGX_ERROR;
         }
+        p += size;
+    }
+
+    if (!buf->last_buf) {
+        return NGX_AGAIN;
+    }
 
-        file_spec = ( [0-9a-fA-F]+ | "-" ) >start_file $crc_incr
-                  " "+
-                  [0-9]+ $size_incr
-                  " "+
-                  (
-                    [^? ]+ >start_uri %end_uri
-                    ( "?" [^ ]+ >start_args %end_args )?
-                  ) %check_directory
-                  " "+
-                  [^ ] >start_filename
-                  [^\r\n\0]* %end_filename;
+    if (carry->len || ctx->files_n == 0) {
+        return NGX_ERROR;
+    }
 
-        main := file_spec ([\r\n]+ file_spec)* [\r\n]*;
+    ctx->parsed = 1;
 
-       write init;
-       write exec;
-    }%%
+    return NGX_OK;
+}
 
-    /* suppress warning */
-    (void)request_en_main;
+/* a line ends with CR or LF, whichever comes first */
+static u_char *
+ngx_http_zip_find_eol(u_char *p, u_char *last)
+{
+    u_char *lf, *cr;
 
-    if (cs < %%{ write first_final; }%%) {
+    lf = memchr(p, LF, last - p);
+    cr = memchr(p, CR, (lf ? lf : last) - p);
+
+    return cr ? cr : lf;
+}
+
+/*
+ * The text file list, a line at a time as its buffers arrive. Only the
+ * strings of the files are kept, see ngx_http_zip_copy_token(); a line cut
+ * by the end of a buffer is carried over in ctx->parse_token. Lines are
+ * separated by any number of line breaks, and the list must not start with
+ * one.
+ */
+ngx_int_t
+ngx_http_zip_parse_request(ngx_http_zip_ctx_t *ctx, ngx_buf_t *buf)
+{
+    u_char *p = buf->pos, *last = buf->last, *eol;
+    ngx_str_t line;
+
+    if (p == NULL) {
+        p = last = (u_char *) "";
+    }
+
+    while (p < last) {
+        if (ctx->parse_token.len == 0 && (*p == CR || *p == LF)) {
+            if (ctx->files_n == 0) {
+                return NGX_ERROR;
+            }
+            p++;
+            continue;
+        }
+
+        if ((eol = ngx_http_zip_find_eol(p, last)) == NULL) {
+            if (ngx_http_zip_copy_token(ctx, p, last, &line) == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+            ctx->parse_token = line;
+            break;
+        }
+
+        if (ctx->parse_token.len) {
+            if (ngx_http_zip_copy_token(ctx, p, eol, &line) == NGX_ERROR
+                    || ngx_http_zip_parse_line(ctx, line.data, line.data + line.len) == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+        } else if (ngx_http_zip_parse_line(ctx, p, eol) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        p = eol;
+    }
+
+    if (!buf->last_buf) {
+        return NGX_AGAIN;
+    }
+
+    /* the last line may end with the list */
+    if (ctx->parse_token.len) {
+        line = ctx->parse_token;
+        ngx_str_null(&ctx->parse_token);
+
+        if (ngx_http_zip_parse_line(ctx, line.data, line.data + line.len) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (ctx->files_n == 0) {
         return NGX_ERROR;
     }
 
@@ -0,0 +1,107 @@
+#!/usr/bin/perl
+
+# Time spent per archive entry, for archives of many tiny files, the
+# throughput of a large file whose CRC-32 mod_zip computes, and the time
+# spent per line of a long file list of directories, which need no
+# subrequest, so that it is mostly the parsing of the list.
+#
+# Run against the test server (see README) with debug logging turned
+# off in nginx.conf, and compare the numbers of two builds. A location
+# the build does not have, such as /concurrent before mod_zip had
+# zip_subrequest_concurrency, is reported as n/a:
+#
+#     ./bench.pl [entries] [runs] [megabytes] [lines]
+
+use LWP::UserAgent;
+use Time::HiRes qw(gettimeofday tv_interval);
+
+$http_root = "http://localhost:8081";
+
+$entries = shift || 10000;
+$runs = shift || 5;
+$megabytes = shift || 256;
+$lines = shift || 1000000;
+
+open( MANIFEST, ">", "nginx/html/zip-bench.txt" );
+for (1..$entries) {
+    print MANIFEST "1a6349c5 24 /file1.txt file$_.txt\n";
+}
+close( MANIFEST );
+
+$ua = LWP::UserAgent->new;
+
+# the best of the runs, or undef where the build has no such location
+sub best_time($) {
+    my $uri = shift;
+    my $best;
+
+    for (1..$runs) {
+        my $start = [gettimeofday];
+        my $response = $ua->get("$http_root$uri", ":content_cb" => sub {});
+        my $elapsed = tv_interval($start);
+
+        if (!$response->is_success) {
+            print STDERR "$uri: " . $response->status_line . "\n";
+            return undef;
+        }
+
+        $best = $elapsed if !defined($best) || $elapsed < $best;
+    }
+
+    return $best;
+}
+
+for $prefix ("", "/concurrent", "/out_of_order") {
+    my $best = best_time("$prefix/zip-bench.txt");
+
+    if (defined($best)) {
+        printf("%-16s %d entries in %.3f s, %.1f us per entry\n",
+            ($prefix || "/"), $entries, $best, $best * 1000000 / $entries);
+    } else {
+        printf("%-16s n/a\n", ($prefix || "/"));
+    }
+}
+
+unlink "nginx/html/zip-bench.txt";
+
+open( DATA, ">", "nginx/html/bench.dat" );
+binmode DATA;
+$chunk = join("", map { chr(($_ * 131) & 0xff) } 0..1048575);
+print DATA $chunk for (1..$megabytes);
+close( DATA );
+
+open( MANIFEST, ">", "nginx/html/zip-bench-crc.txt" );
+print MANIFEST "- " . ($megabytes * 1048576) . " /bench.dat bench.dat\n";
+close( MANIFEST );
+
+{
+    my $best = best_time("/zip-bench-crc.txt");
+
+    if (defined($best)) {
+        printf("%-16s %d MB in %.3f s, %.1f MB/s\n",
+            "missing CRC", $megabytes, $best, $megabytes / $best);
+    } else {
+        printf("%-16s n/a\n", "missing CRC");
+    }
+}
+
+unlink "nginx/html/zip-bench-crc.txt", "nginx/html/bench.dat";
+
+open( MANIFEST, ">", "nginx/html/zip-bench-lines.txt" );
+for (1..$lines) {
+    print MANIFEST "0 0 \@directory dir$_/\n";
+}
+close( MANIFEST );
+
+{
+    my $best = best_time("/zip-bench-lines.txt");
+
+    if (defined($best)) {
+        printf("%-16s %d lines in %.3f s, %.2f us per line\n",
+            "file list", $lines, $best, $best * 1000000 / $lines);
+    } else {
+        printf("%-16s n/a\n", "file list");
+    }
+}
+
+unlink "nginx/html/zip-bench-lines.txt";
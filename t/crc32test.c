@@ -0,0 +1,142 @@
+/*
+ * Checks the CRC-32 kernels of ngx_http_zip_crc32.c against the CRC-32
+ * computed a bit at a time: the tables (slice-by-16), the PCLMULQDQ fold
+ * when built in and supported by the CPU, the choice between them made by
+ * ngx_http_zip_crc32_update(), and ngx_http_zip_crc32_combine(). Lengths,
+ * alignments and starting states are varied, see crc32test.sh.
+ */
+
+#include "../ngx_http_zip_crc32.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CRC32TEST_SIZE  (1024 * 1024 + 64)
+
+static ngx_uint_t  failed, checked;
+
+
+static uint32_t
+crc32test_bitwise(uint32_t crc, u_char *p, size_t len)
+{
+    ngx_uint_t  i;
+
+    while (len--) {
+        crc ^= *p++;
+        for (i = 0; i < 8; i++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+        }
+    }
+
+    return crc;
+}
+
+
+/* xorshift, for the same data on every run */
+static uint32_t
+crc32test_random(void)
+{
+    static uint32_t  x = 2463534242;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    return x;
+}
+
+
+static void
+crc32test_expect(const char *what, size_t off, size_t len, uint32_t got,
+    uint32_t expected)
+{
+    checked++;
+
+    if (got != expected) {
+        failed++;
+        printf("FAIL %s, offset %zu, length %zu: %08x instead of %08x\n",
+               what, off, len, got, expected);
+    }
+}
+
+
+int
+main(void)
+{
+    u_char    *data;
+    size_t     i, off, len, len1;
+    uint32_t   crc, ref, crc1, crc2;
+
+    ngx_http_zip_crc32_init();
+
+    data = malloc(CRC32TEST_SIZE);
+    if (data == NULL) {
+        return 2;
+    }
+
+    for (i = 0; i < CRC32TEST_SIZE; i++) {
+        data[i] = (u_char) crc32test_random();
+    }
+
+    /* every short length at every alignment, from random states */
+    for (len = 0; len <= 1024; len++) {
+        for (off = 0; off < 16; off++) {
+            crc = crc32test_random();
+            ref = crc32test_bitwise(crc, data + off, len);
+
+            crc32test_expect("slice16", off, len,
+                             ngx_http_zip_crc32_slice16(crc, data + off, len), ref);
+
+#if (NGX_ZIP_HAVE_CLMUL)
+            if (ngx_http_zip_crc32_fold == ngx_http_zip_crc32_clmul
+                && len >= 64 && len % 16 == 0)
+            {
+                crc32test_expect("clmul", off, len,
+                                 ngx_http_zip_crc32_clmul(crc, data + off, len), ref);
+            }
+#endif
+
+            crc1 = crc;
+            ngx_http_zip_crc32_update(&crc1, data + off, len);
+            crc32test_expect("update", off, len, crc1, ref);
+        }
+    }
+
+    /* long ones */
+    for (i = 0; i < 64; i++) {
+        off = crc32test_random() % 64;
+        len = crc32test_random() % (CRC32TEST_SIZE - 64);
+
+        ref = crc32test_bitwise(0xffffffff, data + off, len);
+
+        crc = 0xffffffff;
+        ngx_http_zip_crc32_update(&crc, data + off, len);
+        crc32test_expect("update", off, len, crc, ref);
+
+        /* as the thread pool does, in two chunks hashed apart */
+        len1 = len ? crc32test_random() % len : 0;
+
+        crc1 = 0xffffffff;
+        ngx_http_zip_crc32_update(&crc1, data + off, len1);
+        crc2 = 0;
+        ngx_http_zip_crc32_update(&crc2, data + off + len1, len - len1);
+
+        crc32test_expect("combine", off, len,
+                         ngx_http_zip_crc32_combine(crc1, crc2, len - len1), ref);
+    }
+
+#if (NGX_ZIP_HAVE_CLMUL)
+    printf("crc32test: PCLMULQDQ %s\n",
+           ngx_http_zip_crc32_fold == ngx_http_zip_crc32_clmul
+           ? "checked" : "not supported by this CPU");
+#else
+    printf("crc32test: PCLMULQDQ not built in\n");
+#endif
+
+    printf("crc32test: %lu of %lu checks failed\n",
+           (unsigned long) failed, (unsigned long) checked);
+
+    free(data);
+
+    return failed ? 1 : 0;
+}
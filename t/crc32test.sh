@@ -0,0 +1,14 @@
+#!/bin/bash
+
+# Builds and runs crc32test.c, with the headers of the nginx source tree
+# mod_zip was configured in (objs/ must be there):
+#
+#     ./crc32test.sh /path/to/nginx-source
+
+ngx=${1:?usage: $0 /path/to/nginx-source}
+
+${CC:-cc} -O2 -o crc32test crc32test.c \
+    -I "$ngx/objs" -I "$ngx/src/core" -I "$ngx/src/event" \
+    -I "$ngx/src/event/modules" -I "$ngx/src/os/unix" \
+    -I "$ngx/src/http" -I "$ngx/src/http/modules" \
+    && ./crc32test
@@ -1,4 +1,4 @@
 #!/bin/bash
 
 pkill nginx
-./nginx/sbin/nginx
+${1:-./nginx/sbin/nginx}
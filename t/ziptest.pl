@@ -2,8 +2,9 @@
 
 # TODO tests for Zip64
 
-use Test::More tests => 121;
+use Test::More tests => 338;
 use LWP::UserAgent;
+use IO::Socket::INET;
 use Archive::Zip;
 
 $temp_zip_path = "/tmp/mod_zip.zip";
@@ -116,6 +117,43 @@ is($zip->memberNamed("file1.txt")->hasDataDescriptor(), 8, "Has data descriptor
 is($zip->memberNamed("file1.txt")->crc32String(), "1a6349c5", "Generated file1.txt CRC is correct");
 is($zip->memberNamed("file2.txt")->crc32String(), "5d70c4d3", "Generated file2.txt CRC is correct");
 
+# long enough for the 16-byte and folding CRC-32 kernels, with a tail
+$response = $ua->get("$http_root/zip-missing-crc-large.txt");
+is($response->code, 200, "Returns OK with a larger file missing CRC");
+$zip = write_temp_zip($response->content);
+is($zip->contents("crc32.txt"), read_file("nginx/html/crc32.txt"), "crc32.txt in the ZIP");
+is($zip->memberNamed("crc32.txt")->crc32String(), "9b2e6009", "Generated crc32.txt CRC is correct");
+
+$response = $ua->get("$http_root/out_of_order/zip-missing-crc-large.txt");
+$zip = write_temp_zip($response->content);
+is($zip->contents("crc32.txt"), read_file("nginx/html/crc32.txt"), "crc32.txt in the ZIP (out of order)");
+is($zip->memberNamed("crc32.txt")->crc32String(), "9b2e6009", "Generated crc32.txt CRC is correct (out of order)");
+
+$response = $ua->get("$http_root/threaded/zip-missing-crc-large.txt");
+is($response->code, 200, "Returns OK with CRC-32 in threads");
+$zip = write_temp_zip($response->content);
+is($zip->contents("crc32.txt"), read_file("nginx/html/crc32.txt"), "crc32.txt in the ZIP (threads)");
+is($zip->memberNamed("crc32.txt")->crc32String(), "9b2e6009", "Generated crc32.txt CRC is correct (threads)");
+
+# the second time, the CRC-32s are known up front
+$response = $ua->get("$http_root/crc_cached/zip-missing-crc.txt");
+is($response->header("Accept-Ranges"), undef, "No Accept-Ranges header before the CRC-32s are cached");
+$response = $ua->get("$http_root/crc_cached/zip-missing-crc.txt");
+is($response->header("Accept-Ranges"), "bytes", "Accept-Ranges header with cached CRC-32s");
+$zip = test_zip_archive($response->content, "with cached CRC-32s");
+is($zip->memberNamed("file1.txt")->hasDataDescriptor(), 0, "No data descriptor with a cached CRC-32");
+is($zip->memberNamed("file1.txt")->crc32String(), "1a6349c5", "Cached file1.txt CRC is correct");
+is($zip->memberNamed("file2.txt")->crc32String(), "5d70c4d3", "Cached file2.txt CRC is correct");
+$response = $ua->get("$http_root/crc_cached/zip-missing-crc.txt", "Range" => "bytes=0-1");
+is($response->code, 206, "206 Partial Content with cached CRC-32s");
+
+$response = $ua->get("$http_root/crc_reported/zip-missing-crc.txt");
+is($response->code, 200, "Returns OK with zip_crc_report");
+sleep 1;
+$report = read_file("nginx/logs/crc-report.log");
+like($report, qr{/file1\.txt 24 1a6349c5\\x0A}, "Computed CRC-32 reported");
+unlike($report, qr{/file2\.txt}, "CRC-32 from the list not reported");
+
 $response = $ua->get("$http_root/zip-uppercase-crc.txt");
 is($response->code, 200, "Returns OK with uppercase CRC");
 $zip = test_zip_archive($response->content, "with uppercase CRC");
@@ -154,6 +192,224 @@ is($zip->numberOfMembers(), 3, "Correct number in spaces and plus ZIP");
 $response = $ua->get("$http_root/zip-internal-location.txt");
 is($response->code, 200, "Returns OK with internal locations");
 
+########## File list in small pieces
+
+set_debug_log("unbuffered");
+
+$response = $ua->get("$http_root/unbuffered/zip-many-files.txt");
+is($response->code, 200, "Returns OK with a file list in small pieces");
+
+$zip = test_zip_archive($response->content, "with a file list in small pieces");
+is($zip->numberOfMembers(), 136, "Correct number in ZIP with a file list in small pieces");
+
+########## Lines of every kind
+
+for $prefix ("", "/unbuffered") {
+    $response = $ua->get("$http_root$prefix/zip-mixed-lines.txt");
+    is($response->code, 200, "Returns OK with lines of every kind ($prefix)");
+
+    $zip = test_zip_archive($response->content, "with lines of every kind ($prefix)");
+    is($zip->numberOfMembers(), 4, "Correct number in ZIP with lines of every kind ($prefix)");
+    is($zip->memberNamed("file2.txt")->crc32String(), "5d70c4d3", "Generated file2.txt CRC is correct ($prefix)");
+    is($zip->memberNamed("spaces.txt")->crc32String(), "1a6349c5", "Decoded name with padded fields ($prefix)");
+}
+
+########## Binary file list
+
+$response = $ua->get("$http_root/zip-binary.bin");
+is($response->code, 200, "Returns OK with a binary file list");
+
+$zip = test_zip_archive($response->content, "with a binary file list");
+is($zip->numberOfMembers(), 4, "Correct number in ZIP with a binary file list");
+is($zip->memberNamed("file2.txt")->crc32String(), "5d70c4d3", "Generated file2.txt CRC is correct (binary)");
+is($zip->memberNamed("file2.txt")->unixFileAttributes() & 0777, 0600, "Permissions from a binary file list");
+is($zip->memberNamed("spaces.txt")->uncompressedSize(), 24, "Undecoded URI from a binary file list");
+$mtime = $zip->memberNamed("file1.txt")->lastModTime();
+ok($mtime >= 315532800 && $mtime <= time(), "Time before 1980 in a binary file list taken as none");
+
+########## Paged file list
+
+for $prefix ("", "/out_of_order", "/progressive") {
+    $response = $ua->get("$http_root$prefix/zip-paged.txt");
+    is($response->code, 200, "Returns OK with a paged file list ($prefix)");
+
+    $zip = test_zip_archive($response->content, "with a paged file list ($prefix)");
+    is($zip->numberOfMembers(), 3, "Correct number in ZIP with a paged file list ($prefix)");
+    is($zip->memberNamed("file2.txt")->crc32String(), "5d70c4d3", "Generated file2.txt CRC is correct (paged, $prefix)");
+}
+
+########## File list on disk
+
+$response = $ua->get("$http_root/zip-manifest-file.txt");
+is($response->code, 200, "Returns OK with a file list on disk");
+
+$zip = test_zip_archive($response->content, "with a file list on disk");
+is($zip->numberOfMembers(), 2, "Correct number in ZIP with a file list on disk");
+is($zip->memberNamed("file2.txt")->crc32String(), "5d70c4d3", "File2.txt CRC is correct (file list on disk)");
+
+$response = $ua->get("$http_root/zip-manifest-file-escape.txt");
+is($response->code, 500, "Server error when the file list on disk is outside zip_manifest_root");
+
+$response = $ua->get("$http_root/zip-manifest-file-absolute.txt");
+is($response->code, 500, "Server error when the file list on disk has an absolute name");
+
+$response = $ua->get("$http_root/concurrent/zip-manifest-file.txt");
+is($response->code, 500, "Server error with a file list on disk without zip_manifest_root");
+
+########## URI template
+
+$response = $ua->get("$http_root/zip-template.txt");
+is($response->code, 200, "Returns OK with a URI template");
+
+$zip = test_zip_archive($response->content, "with a URI template");
+is($zip->numberOfMembers(), 4, "Correct number in ZIP with a URI template");
+is($zip->memberNamed("file2.txt")->crc32String(), "5d70c4d3", "Generated file2.txt CRC is correct (URI template)");
+is($zip->memberNamed("spaces.txt")->uncompressedSize(), 24, "Decoded ID in a URI template");
+
+########## Progressive archives
+
+set_debug_log("progressive");
+
+$response = $ua->get("$http_root/progressive/zip-many-files.txt");
+is($response->code, 200, "Returns OK when progressive");
+is($response->header("Content-Length"), undef, "No Content-Length when progressive");
+
+$zip = test_zip_archive($response->content, "when progressive");
+is($zip->numberOfMembers(), 136, "Correct number in progressive ZIP");
+
+$response = $ua->get("$http_root/progressive/zip-missing-crc.txt");
+$zip = test_zip_archive($response->content, "when missing CRC and progressive");
+is($zip->memberNamed("file1.txt")->crc32String(), "1a6349c5", "Generated file1.txt CRC is correct (progressive)");
+is($zip->memberNamed("file2.txt")->crc32String(), "5d70c4d3", "Generated file2.txt CRC is correct (progressive)");
+
+$response = $ua->get("$http_root/progressive/zip.txt", "Range" => "bytes=10-20");
+is($response->code, 200, "Range ignored when progressive");
+
+########## Concurrent subrequests
+
+set_debug_log("concurrent");
+
+$response = $ua->get("$http_root/concurrent/zip-many-files.txt");
+is($response->code, 200, "Returns OK with many files fetched concurrently");
+
+$zip = test_zip_archive($response->content, "with many files fetched concurrently");
+is($zip->numberOfMembers(), 136, "Correct number in concurrently fetched ZIP");
+
+$response = $ua->get("$http_root/concurrent/zip-missing-crc.txt");
+is($response->code, 200, "Returns OK with missing CRC fetched concurrently");
+
+$zip = test_zip_archive($response->content, "when missing CRC fetched concurrently");
+is($zip->memberNamed("file1.txt")->crc32String(), "1a6349c5", "Generated file1.txt CRC is correct (concurrent)");
+is($zip->memberNamed("file2.txt")->crc32String(), "5d70c4d3", "file2.txt CRC is correct (concurrent)");
+
+$response = $ua->get("$http_root/concurrent/zip.txt",
+    "Range" => "bytes=".($file1_offset+9)."-".($file2_offset+4));
+is($response->code, 206, "206 Partial Content (concurrent)");
+is(substr($response->content, 0, 14), "the first file", "Subrange spanning part of first file (concurrent)");
+
+########## Out-of-order entries
+
+set_debug_log("out-of-order");
+
+$response = $ua->get("$http_root/out_of_order/zip-many-files.txt");
+is($response->code, 200, "Returns OK with many files out of order");
+
+$zip = test_zip_archive($response->content, "with many files out of order");
+is($zip->numberOfMembers(), 136, "Correct number in out-of-order ZIP");
+
+$response = $ua->get("$http_root/out_of_order/zip-missing-crc.txt");
+is($response->code, 200, "Returns OK with missing CRC out of order");
+
+$zip = test_zip_archive($response->content, "when missing CRC out of order");
+is($zip->memberNamed("file1.txt")->crc32String(), "1a6349c5", "Generated file1.txt CRC is correct (out of order)");
+is($zip->memberNamed("file2.txt")->crc32String(), "5d70c4d3", "file2.txt CRC is correct (out of order)");
+
+$response = $ua->get("$http_root/out_of_order/zip.txt", "Range" => "bytes=0-1");
+is($response->code, 200, "Range is ignored out of order");
+is($response->header("Accept-Ranges"), undef, "No Accept-Ranges header out of order");
+is($response->header("Content-Length"), $zip_length, "Content-Length header out of order");
+
+$response = $ua->get("$http_root/out_of_order_on_disk/zip-many-files.txt");
+is($response->code, 200, "Returns OK with many files out of order on disk");
+
+$zip = test_zip_archive($response->content, "with many files out of order on disk");
+is($zip->numberOfMembers(), 136, "Correct number in out-of-order ZIP on disk");
+
+########## Alternate locations
+
+set_debug_log("hedged");
+
+$response = $ua->get("$http_root/hedged/zip-mirrors.txt");
+is($response->code, 200, "Returns OK with a missing first location");
+
+$zip = test_zip_archive($response->content, "with alternate locations");
+is($zip->memberNamed("file1.txt")->crc32String(), "1a6349c5", "Generated file1.txt CRC is correct (alternate location)");
+is($zip->memberNamed("file2.txt")->crc32String(), "5d70c4d3", "file2.txt CRC is correct (first location)");
+
+$response = $ua->get("$http_root/hedged/zip-mirrors-404.txt");
+is($response->code, 500, "Server error when no location answers");
+
+$response = $ua->get("$http_root/zip-mirrors.txt");
+is($response->code, 500, "Alternate locations are not split off without zip_hedge_delay");
+
+$response = $ua->get("$http_root/zip-pipe-args.txt");
+is($response->code, 200, "Returns OK with a | in the arguments");
+
+$zip = test_zip_archive($response->content, "with a | in the arguments");
+is($zip->numberOfMembers(), 2, "Correct number in ZIP with a | in the arguments");
+
+$response = $ua->get("$http_root/hedged/zip-pipe-args-escaped.txt");
+is($response->code, 200, "Returns OK with an escaped | in the arguments (hedged)");
+
+$zip = test_zip_archive($response->content, "with an escaped | in the arguments (hedged)");
+is($zip->numberOfMembers(), 2, "Correct number in ZIP with an escaped | in the arguments (hedged)");
+
+########## Resumed subrequests
+
+set_debug_log("retried");
+
+$response = $ua->get("$http_root/retried/zip-flaky.txt");
+is($response->code, 200, "Returns OK when subrequests are retried");
+
+$zip = test_zip_archive($response->content, "when subrequests are retried");
+is($zip->memberNamed("file2.txt")->crc32String(), "5d70c4d3", "Generated file2.txt CRC is correct (retried)");
+
+$response = $ua->get("$http_root/retried_out_of_order/zip-flaky.txt");
+is($response->code, 200, "Returns OK when subrequests are retried out of order");
+
+$zip = test_zip_archive($response->content, "when subrequests are retried out of order");
+
+########## Shared fetch limit
+
+set_debug_log("fetch-zone");
+
+$response = $ua->get("$http_root/fetch_zone/zip-many-files.txt");
+is($response->code, 200, "Returns OK with a fetch zone");
+
+$zip = test_zip_archive($response->content, "with a fetch zone");
+is($zip->numberOfMembers(), 136, "Correct number in ZIP with a fetch zone");
+
+$response = $ua->get("$http_root/fetch_zone_out_of_order/zip-many-files.txt");
+is($response->code, 200, "Returns OK with a fetch zone out of order");
+
+$zip = test_zip_archive($response->content, "with a fetch zone out of order");
+is($zip->numberOfMembers(), 136, "Correct number in out-of-order ZIP with a fetch zone");
+
+########## Segmented files
+
+set_debug_log("segmented");
+
+$response = $ua->get("$http_root/segmented/zip.txt");
+is($response->code, 200, "Returns OK with segmented files");
+is($response->header("Content-Length"), $zip_length, "Content-Length header with segmented files");
+$zip = test_zip_archive($response->content, "with segmented files");
+
+$response = $ua->get("$http_root/segmented/zip.txt", "Range" => "bytes=".($file1_offset+9)."-".($file2_offset+4));
+is($response->code, 206, "206 Partial Content (segmented)");
+is(length($response->content), ($file2_offset+4)-($file1_offset+9)+1, "Length of partial content (segmented)");
+is(substr($response->content, 0, 14), "the first file", "Subrange spanning part of first file (segmented)");
+is(substr($response->content, 68, 4), "This", "Subrange spanning part of second file (segmented)");
+
 ########## Package empty directories
 
 $response = $ua->get("$http_root/zip-empty-dirs.txt");
@@ -176,6 +432,87 @@ $zip = test_zip_archive($response->content, "with not empty directories");
 is($zip->memberNamed("file1.txt")->isBinaryFile(), 1, "file1.txt exists in archive");
 is($zip->memberNamed("file2.txt")->isBinaryFile(), 1, "file2.txt exists in archive");
 
+########## Inline and empty files
+
+$response = $ua->get("$http_root/zip-inline.txt");
+is($response->code, 200, "Returns OK with inline and empty files");
+is($response->header("Accept-Ranges"), "bytes", "Accept-Ranges header with an inline file missing its CRC");
+$zip = test_zip_archive($response->content, "with inline and empty files");
+is($zip->numberOfMembers(), 3, "Correct number in ZIP with inline and empty files");
+is($zip->contents("hello.txt"), "hello world", "Inline file content is decoded");
+is($zip->memberNamed("hello.txt")->crc32String(), "0d4a1185", "Inline file CRC is computed");
+is($zip->memberNamed("empty.txt")->uncompressedSize(), 0, "Empty file is not fetched");
+is($zip->memberNamed("file1.txt")->crc32String(), "1a6349c5", "file1.txt CRC is correct next to inline files");
+
+########## Missing sizes
+
+$response = $ua->get("$http_root/zip-missing-size.txt");
+is($response->code, 200, "Returns OK with a missing size");
+is($response->header("Content-Length"), $zip_length, "Content-Length header with a missing size");
+$zip = test_zip_archive($response->content, "with a missing size");
+is($zip->memberNamed("file2.txt")->uncompressedSize(), 25, "Missing size is asked for");
+
+$response = $ua->get("$http_root/concurrent/zip-missing-size.txt");
+is($response->code, 200, "Returns OK with a missing size (concurrent)");
+$zip = test_zip_archive($response->content, "with a missing size (concurrent)");
+
+$response = $ua->get("$http_root/out_of_order/zip-missing-size.txt");
+is($response->code, 200, "Returns OK with a missing size (out of order)");
+$zip = test_zip_archive($response->content, "with a missing size (out of order)");
+
+$response = $ua->get("$http_root/progressive/zip-missing-size.txt");
+is($response->code, 200, "Returns OK with a missing size (progressive)");
+$zip = test_zip_archive($response->content, "with a missing size (progressive)");
+is($zip->memberNamed("file2.txt")->uncompressedSize(), 25, "Missing size is asked for (progressive)");
+
+$response = $ua->get("$http_root/zip-missing-size-404.txt");
+is($response->code, 500, "Server error when a missing size cannot be found");
+
+########## Entries of unknown size
+
+$response = $ua->get("$http_root/zip-stream.txt");
+is($response->code, 200, "Returns OK with an entry of unknown size");
+is($response->header("Content-Length"), undef, "No Content-Length with an entry of unknown size");
+$zip = test_zip_archive($response->content, "with an entry of unknown size");
+is($zip->memberNamed("file1.txt")->uncompressedSize(), 24, "Size of a streamed entry");
+is($zip->memberNamed("file1.txt")->crc32String(), "1a6349c5", "CRC of a streamed entry");
+
+$response = $ua->get("$http_root/concurrent/zip-stream.txt");
+is($response->code, 200, "Returns OK with an entry of unknown size (concurrent)");
+$zip = test_zip_archive($response->content, "with an entry of unknown size (concurrent)");
+
+$response = $ua->get("$http_root/out_of_order/zip-stream.txt");
+is($response->code, 200, "Returns OK with an entry of unknown size (out of order)");
+$zip = test_zip_archive($response->content, "with an entry of unknown size (out of order)");
+
+$response = $ua->get("$http_root/progressive/zip-stream.txt");
+is($response->code, 200, "Returns OK with an entry of unknown size (progressive)");
+$zip = test_zip_archive($response->content, "with an entry of unknown size (progressive)");
+
+########## Slices of a larger file
+
+$response = $ua->get("$http_root/zip-slices.txt");
+is($response->code, 200, "Returns OK with slices");
+is($response->header("Content-Length"), $zip_length, "Content-Length header with slices");
+$zip = test_zip_archive($response->content, "with slices");
+
+$response = $ua->get("$http_root/zip-slices.txt", "Range" => "bytes=".($file2_offset+1)."-");
+is($response->code, 206, "206 Partial Content (slices)");
+is(substr($response->content, 0, 25), "This is the second file.\n", "Subrange of a slice");
+
+$response = $ua->get("$http_root/out_of_order/zip-slices.txt");
+is($response->code, 200, "Returns OK with slices (out of order)");
+$zip = test_zip_archive($response->content, "with slices (out of order)");
+
+$response = $ua->get("$http_root/bundled/zip-slices.txt");
+is($response->code, 200, "Returns OK with bundled slices");
+is($response->header("Content-Length"), $zip_length, "Content-Length header with bundled slices");
+$zip = test_zip_archive($response->content, "with bundled slices");
+
+$response = $ua->get("$http_root/bundled/zip-slices-missing-crc.txt");
+is($response->code, 200, "Returns OK with bundled slices missing CRC");
+$zip = test_zip_archive($response->content, "with bundled slices missing CRC");
+
 ########## Pass headers in sub-requests
 
 $response = $ua->get("$http_root/zip-authorized-files-cookie.txt", "Cookie" => "session=verified");
@@ -224,8 +561,65 @@ $large_zip_file_content = $zip->contents( 'largefile.txt' );
 $large_file_content = read_file("nginx/html/largefile.txt");
 is(length($large_zip_file_content), length($large_file_content), "Found large file in ZIP");
 
+# hashed in threads as it comes from the upstream, while the client reads slowly
+$socket = IO::Socket::INET->new(PeerAddr => "localhost:8081");
+print $socket "GET /threaded/zip-missing-crc-largefile.txt HTTP/1.0\r\n\r\n";
+sleep 1;
+$slow_response = "";
+while ($socket->read($buffer, 65536)) {
+    $slow_response .= $buffer;
+    select(undef, undef, undef, 0.01);
+}
+close($socket);
+($slow_header, $slow_content) = split(/\r\n\r\n/, $slow_response, 2);
+like($slow_header, qr/^HTTP\/1\.1 200/, "Returns OK to a slow client with CRC-32 in threads");
+$zip = write_temp_zip($slow_content);
+is(length($zip->contents("largefile.txt")), length($large_file_content), "Found large file in ZIP (threads, slow client)");
+is($zip->memberNamed("largefile.txt")->crc32String(), "a052e423", "Generated large file CRC is correct (threads, slow client)");
+
+########## Admission zone
+
+set_debug_log("admission");
+
+$response = $ua->get("$http_root/admission/zip-many-files.txt");
+is($response->code, 200, "Returns OK when alone over the admission limit");
+
+# keep a large archive going by not reading it
+$socket = IO::Socket::INET->new(PeerAddr => "localhost:8081");
+print $socket "GET /admission/zip-large-file.txt HTTP/1.0\r\n\r\n";
+$socket->recv($status_line, 12);
+is($status_line, "HTTP/1.1 200", "Admits the first archive");
+
+$response = $ua->get("$http_root/admission/zip.txt");
+is($response->code, 503, "Turns away an archive over the admission limit");
+is($response->header("Retry-After"), "7", "Sends Retry-After when turned away");
+
+close($socket);
+sleep 1;
+
+$response = $ua->get("$http_root/admission/zip.txt");
+is($response->code, 200, "Admits an archive again once the others are done");
+
 unlink "nginx/html/largefile.txt";
 
+########## Modification time and caching
+
+$response = $ua->get("$http_root/mtime/zip.txt");
+is($response->code, 200, "Returns OK with the Last-Modified time");
+is($response->header("Cache-Control"), "public, max-age=3600", "Configured Cache-Control header");
+$zip = write_temp_zip($response->content);
+is($zip->memberNamed("file1.txt")->lastModFileDateTime(), (8047 << 16) + 10052, "Entry has the Last-Modified time");
+$archive = $response->content;
+sleep 1;
+$response = $ua->get("$http_root/mtime/zip.txt");
+ok($response->content eq $archive, "Same list yields the same archive");
+
+$response = $ua->get("$http_root/fixed_mtime/zip.txt");
+is($response->code, 200, "Returns OK with a fixed time");
+is($response->header("Cache-Control"), undef, "No Cache-Control header when off");
+$zip = write_temp_zip($response->content);
+is($zip->memberNamed("file2.txt")->lastModFileDateTime(), 1257116928, "Entry has the fixed time");
+
 set_debug_log("zip-headers");
 
 $response = $ua->get("$http_root/zip.txt");